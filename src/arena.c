@@ -0,0 +1,147 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * arena.c - Simple bump allocator
+ *
+ * Copyright (c) 2021 - 2024	Andrew Clayton <andrew@digital-domain.net>
+ */
+
+/*
+ * Each dir_entry's jf_file's and their names are allocated from an arena
+ * of their own. They all go away together (when the dir_entry does) so
+ * there's no need to free anything individually and we save a malloc(3)
+ * header and some rounding up per allocation.
+ *
+ * An arena isn't thread safe, it's only added to while the dir_entry is
+ * being built up, before anyone else can see it.
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_CHUNK_SIZE	4096
+#define ARENA_ALIGN		sizeof(void *)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct jf_arena {
+	struct arena_chunk *chunks;
+	size_t size;
+};
+
+struct jf_arena *jf_arena_new(void)
+{
+	return calloc(1, sizeof(struct jf_arena));
+}
+
+static struct arena_chunk *arena_chunk_new(struct jf_arena *arena,
+					   size_t size)
+{
+	struct arena_chunk *chunk;
+
+	arena->size += sizeof(struct arena_chunk) + size;
+
+	chunk = malloc(sizeof(struct arena_chunk) + size);
+	chunk->size = size;
+	chunk->used = 0;
+
+	return chunk;
+}
+
+static void *arena_alloc(struct jf_arena *arena, size_t size, size_t align)
+{
+	struct arena_chunk *chunk = arena->chunks;
+	size_t off = 0;
+	void *ptr;
+
+	if (chunk)
+		off = (chunk->used + align - 1) & ~(align - 1);
+
+	if (!chunk || off > chunk->size || chunk->size - off < size) {
+		/* Big ones get a chunk of their own behind the current one */
+		if (size > ARENA_CHUNK_SIZE / 4 && chunk) {
+			struct arena_chunk *big = arena_chunk_new(arena, size);
+
+			big->used = size;
+			big->next = chunk->next;
+			chunk->next = big;
+
+			return big->data;
+		}
+
+		chunk = arena_chunk_new(arena, size > ARENA_CHUNK_SIZE ?
+						size : ARENA_CHUNK_SIZE);
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		off = 0;
+	}
+
+	ptr = chunk->data + off;
+	chunk->used = off + size;
+
+	return ptr;
+}
+
+/* Returns size bytes of zeroed memory */
+void *jf_arena_alloc(struct jf_arena *arena, size_t size)
+{
+	void *ptr = arena_alloc(arena, size, ARENA_ALIGN);
+
+	memset(ptr, 0, size);
+
+	return ptr;
+}
+
+/* Strings don't need aligning */
+char *jf_arena_strndup(struct jf_arena *arena, const char *str, size_t len)
+{
+	char *s = arena_alloc(arena, len + 1, 1);
+
+	memcpy(s, str, len);
+	s[len] = '\0';
+
+	return s;
+}
+
+/* Like strdup(3), but NULL in gives NULL out */
+char *jf_arena_strdup(struct jf_arena *arena, const char *str)
+{
+	if (!str)
+		return NULL;
+
+	return jf_arena_strndup(arena, str, strlen(str));
+}
+
+/* How much memory it's using */
+size_t jf_arena_size(const struct jf_arena *arena)
+{
+	return arena->size;
+}
+
+void jf_arena_free(struct jf_arena *arena)
+{
+	struct arena_chunk *chunk;
+
+	if (!arena)
+		return;
+
+	chunk = arena->chunks;
+	while (chunk) {
+		struct arena_chunk *next = chunk->next;
+
+		free(chunk);
+		chunk = next;
+	}
+
+	free(arena);
+}
@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * arena.h - Simple bump allocator
+ *
+ * Copyright (c) 2021 - 2024	Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+struct jf_arena;
+
+struct jf_arena *jf_arena_new(void);
+void *jf_arena_alloc(struct jf_arena *arena, size_t size);
+char *jf_arena_strndup(struct jf_arena *arena, const char *str, size_t len);
+char *jf_arena_strdup(struct jf_arena *arena, const char *str);
+size_t jf_arena_size(const struct jf_arena *arena);
+void jf_arena_free(struct jf_arena *arena);
+
+#endif /* _ARENA_H_ */
@@ -0,0 +1,346 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * batch.c - Batching of API lookups by id (or artist name)
+ *
+ * Copyright (c) 2021 - 2024	Andrew Clayton <andrew@digital-domain.net>
+ */
+
+/*
+ * Lookups by id (or artist name) arriving within BATCH_WINDOW_MS of each
+ * other are made as a single API request for all of them, the API
+ * taking several ids ('+' separated) at once.
+ *
+ * Whoever starts a batch leads it: they wait out the window (or for it
+ * to fill), do the request and hand each member their part of the
+ * results. Anyone joining the batch meanwhile just waits for that.
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <curl/curl.h>
+#include <jansson.h>
+
+#include "jamendo-fuse.h"
+#include "engine.h"
+#include "batch.h"
+
+#define BATCH_WINDOW_MS		20
+
+struct batch {
+	enum jf_batch_kind kind;
+	int audio_fmt;
+	/* The most urgent of its members' */
+	enum jf_engine_prio prio;
+	pthread_cond_t cond;
+	bool closed;
+	bool done;
+	int result;
+	int refs;
+	size_t nr;
+	struct jf_batch_member *members[BATCH_MAX];
+
+	struct batch *next;
+};
+
+static struct batch *batches;
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Find the next member from *idx wanting id/name, the same thing could
+ * be wanted for more than one path.
+ */
+static struct jf_batch_member *batch_find(const struct batch *b, size_t *idx,
+					  uint64_t id, const char *name)
+{
+	while (*idx < b->nr) {
+		struct jf_batch_member *m = b->members[(*idx)++];
+
+		if (name ? strcasecmp(m->name, name) == 0 : m->id == id)
+			return m;
+	}
+
+	return NULL;
+}
+
+static size_t batch_albums_page(json_t *root, void *data, size_t *nr_new)
+{
+	struct batch *b = data;
+	json_t *albums;
+	json_t *album;
+	size_t index;
+
+	albums = json_object_get(root, "results");
+	json_array_foreach(albums, index, album) {
+		json_t *aid = json_object_get(album, "artist_id");
+		uint64_t id = parse_id(json_string_value(aid));
+		struct jf_batch_member *m;
+		size_t i = 0;
+
+		for (;;) {
+			m = batch_find(b, &i, id, NULL);
+			if (!m)
+				break;
+			json_array_append(m->results, album);
+		}
+		(*nr_new)++;
+	}
+
+	return json_array_size(albums);
+}
+
+static size_t batch_tracks_page(json_t *root, void *data, size_t *nr_new)
+{
+	struct batch *b = data;
+	json_t *albums;
+	json_t *album;
+	size_t index;
+
+	albums = json_object_get(root, "results");
+	json_array_foreach(albums, index, album) {
+		json_t *id = json_object_get(album, "id");
+		uint64_t aid = parse_id(json_string_value(id));
+		struct jf_batch_member *m;
+		size_t i = 0;
+
+		for (;;) {
+			m = batch_find(b, &i, aid, NULL);
+			if (!m)
+				break;
+			if (!m->results)
+				m->results = json_incref(album);
+		}
+		(*nr_new)++;
+	}
+
+	return json_array_size(albums);
+}
+
+static size_t batch_artist_ids_page(json_t *root, void *data,
+				    size_t *nr_new)
+{
+	struct batch *b = data;
+	json_t *artists;
+	json_t *artist;
+	size_t index;
+
+	artists = json_object_get(root, "results");
+	json_array_foreach(artists, index, artist) {
+		json_t *id = json_object_get(artist, "id");
+		json_t *name = json_object_get(artist, "name");
+		struct jf_batch_member *m;
+		size_t i = 0;
+
+		if (!json_string_value(name))
+			continue;
+		for (;;) {
+			m = batch_find(b, &i, 0, json_string_value(name));
+			if (!m)
+				break;
+			if (!m->id)
+				m->id = parse_id(json_string_value(id));
+		}
+		(*nr_new)++;
+	}
+
+	return json_array_size(artists);
+}
+
+static struct batch *batch_new(enum jf_batch_kind kind, int audio_fmt)
+{
+	struct batch *b;
+
+	b = calloc(1, sizeof(struct batch));
+	b->kind = kind;
+	b->audio_fmt = audio_fmt;
+	b->prio = api_prio;
+	pthread_cond_init(&b->cond, NULL);
+	b->refs = 1;
+
+	return b;
+}
+
+/* Do the request for a batch, filling in its members */
+static int batch_fetch(struct batch *b)
+{
+	char api[API_URL_MAX_LEN];
+	api_page_fn page_fn = NULL;
+	CURL *curl = NULL;
+	int len = 0;
+	static const char *api_base = "https://api.jamendo.com/v3.0";
+
+	switch (b->kind) {
+	case JF_BATCH_ALBUMS:
+		len = snprintf(api, sizeof(api),
+			       "%s/albums/?client_id=%s&format=json"
+			       "&artist_id=", api_base, client_id);
+		page_fn = batch_albums_page;
+		break;
+	case JF_BATCH_TRACKS:
+		len = snprintf(api, sizeof(api),
+			       "%s/albums/tracks/?client_id=%s&format=json"
+			       "&audioformat=%s&id=", api_base, client_id,
+			       audio_fmt_name(b->audio_fmt));
+		page_fn = batch_tracks_page;
+		break;
+	case JF_BATCH_ARTIST_IDS:
+		len = snprintf(api, sizeof(api),
+			       "%s/artists/?client_id=%s&format=json&name=",
+			       api_base, client_id);
+		page_fn = batch_artist_ids_page;
+		curl = curl_pool_get();
+		break;
+	}
+
+	/* Members' names/ids are limited so this always fits */
+	for (size_t i = 0; i < b->nr; i++) {
+		const struct jf_batch_member *m = b->members[i];
+		const char *sep = i > 0 ? "+" : "";
+		char *cstr;
+
+		if (!curl) {
+			len += snprintf(api + len, sizeof(api) - len,
+					"%s%" PRIu64, sep, m->id);
+			continue;
+		}
+
+		cstr = curl_easy_escape(curl, m->name, 0);
+		len += snprintf(api + len, sizeof(api) - len, "%s%s", sep,
+				cstr);
+		curl_free(cstr);
+	}
+	if (curl)
+		curl_pool_put(curl);
+
+	dbg("batch of %zu\n", b->nr);
+
+	return api_fetch_all(api, page_fn, b);
+}
+
+static void batch_put(struct batch *b)
+{
+	if (--b->refs > 0)
+		return;
+
+	pthread_cond_destroy(&b->cond);
+	free(b);
+}
+
+/* Called with batch_lock held */
+static void batch_close(struct batch *b)
+{
+	struct batch **pp;
+
+	if (b->closed)
+		return;
+
+	for (pp = &batches; *pp != b; pp = &(*pp)->next)
+		;
+	*pp = b->next;
+	b->closed = true;
+	pthread_cond_broadcast(&b->cond);
+}
+
+/*
+ * Have m looked up as part of a batch, joining the open one of its kind
+ * or starting one. Returns -1 if the batch request failed.
+ */
+int jf_batch_lookup(enum jf_batch_kind kind, int audio_fmt,
+		    struct jf_batch_member *m)
+{
+	struct batch *b;
+	struct timespec ts;
+	enum jf_engine_prio prio;
+	int ret;
+
+	pthread_mutex_lock(&batch_lock);
+	for (b = batches; b; b = b->next) {
+		if (b->kind == kind && b->audio_fmt == audio_fmt)
+			break;
+	}
+	if (b) {
+		b->members[b->nr++] = m;
+		b->refs++;
+		if (api_prio < b->prio)
+			b->prio = api_prio;
+		if (b->nr == BATCH_MAX)
+			batch_close(b);
+		while (!b->done)
+			pthread_cond_wait(&b->cond, &batch_lock);
+		ret = b->result;
+		batch_put(b);
+		pthread_mutex_unlock(&batch_lock);
+
+		jf_stats_inc(batched_lookups);
+
+		return ret;
+	}
+
+	b = batch_new(kind, audio_fmt);
+	b->members[b->nr++] = m;
+	b->next = batches;
+	batches = b;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += BATCH_WINDOW_MS * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+	while (!b->closed) {
+		if (pthread_cond_timedwait(&b->cond, &batch_lock,
+					   &ts) == ETIMEDOUT)
+			break;
+	}
+	batch_close(b);
+	pthread_mutex_unlock(&batch_lock);
+
+	/*
+	 * e.g the reval thread may be leading it, but someone in the
+	 * foreground shouldn't be stuck behind the background work.
+	 */
+	prio = api_prio;
+	api_prio = b->prio;
+	ret = batch_fetch(b);
+	api_prio = prio;
+
+	pthread_mutex_lock(&batch_lock);
+	b->done = true;
+	b->result = ret;
+	pthread_cond_broadcast(&b->cond);
+	batch_put(b);
+	pthread_mutex_unlock(&batch_lock);
+
+	return ret;
+}
+
+/*
+ * Look up nr (up to BATCH_MAX) members in one request, for someone who
+ * already has that many to look up. Returns -1 if the request failed.
+ */
+int jf_batch_run(enum jf_batch_kind kind, int audio_fmt,
+	     struct jf_batch_member **members, size_t nr)
+{
+	struct batch *b;
+	int ret;
+
+	b = batch_new(kind, audio_fmt);
+	memcpy(b->members, members, nr * sizeof(struct jf_batch_member *));
+	b->nr = nr;
+	ret = batch_fetch(b);
+	/* Nobody else knows about it */
+	batch_put(b);
+
+	return ret;
+}
@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * batch.h - Batching of API lookups by id (or artist name)
+ *
+ * Copyright (c) 2021 - 2024	Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <jansson.h>
+
+/* Most lookups made in one request, and the longest name batched */
+#define BATCH_MAX		16
+#define BATCH_NAME_MAX		64
+
+enum jf_batch_kind {
+	JF_BATCH_ALBUMS = 0,	/* an artist's albums, by artist id */
+	JF_BATCH_TRACKS,	/* an album's tracks, by album id */
+	JF_BATCH_ARTIST_IDS,	/* an artist's id, by name */
+};
+
+/*
+ * For JF_BATCH_ALBUMS results is an array the albums are added to, for
+ * JF_BATCH_TRACKS it's set to the album. For JF_BATCH_ARTIST_IDS, id is
+ * set.
+ */
+struct jf_batch_member {
+	uint64_t id;
+	const char *name;
+	json_t *results;
+};
+
+int jf_batch_lookup(enum jf_batch_kind kind, int audio_fmt,
+		    struct jf_batch_member *m);
+int jf_batch_run(enum jf_batch_kind kind, int audio_fmt,
+		 struct jf_batch_member **members, size_t nr);
+
+#endif /* _BATCH_H_ */
@@ -0,0 +1,803 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * cache.c - On-disk cache of file data
+ *
+ * Copyright (c) 2021 - 2024	Andrew Clayton <andrew@digital-domain.net>
+ */
+
+/*
+ * Each cached file (track id + format) is stored as a sparse file the
+ * size of the track, under its "<id>.<fmt>" name, made up of
+ * CACHE_BLOCK_SIZE blocks, along with a "<id>.<fmt>.map" file holding
+ * a small header and a bitmap of which blocks are present.
+ *
+ * The map is only ever replaced by writing a new one and rename(2)ing
+ * it over the old one after the data file has been fdatasync(2)'d, so
+ * after a crash we may have lost the most recently cached blocks, but
+ * the map never claims a block that isn't on disk.
+ *
+ * When over the size limit, whole files are evicted, least recently
+ * used first, skipping anything currently open.
+ *
+ * Blocks mostly come to us on the engine thread, which mustn't be kept
+ * waiting on the disk, so writing them out, committing maps and closing
+ * files is left to a writer thread. It does what it's given in order, so
+ * a file is only closed once everything written to it before
+ * jf_cache_close() has gone out. Queued blocks are copies, if there's
+ * more than CACHE_QUEUE_MAX of them waiting new ones are dropped, it's
+ * only a cache.
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <libac.h>
+
+#include "jamendo-fuse.h"
+#include "cache.h"
+
+#define CACHE_MAGIC		"JFCACHE"
+#define CACHE_VERSION		1
+
+/* How many new blocks before we write out the map */
+#define CACHE_COMMIT_BLOCKS	16
+
+#define CACHE_QUEUE_MAX		(32 * 1024 * 1024)
+
+struct cache_map_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t block_size;
+	uint64_t file_size;
+	int64_t atime;
+	uint32_t nr_blocks;
+	uint32_t pad;
+};
+
+/*
+ * One of these exists for every file in the cache, whether open or
+ * not. key, atime, bytes & refs are protected by cache_lock, the rest
+ * by lock and only valid while refs > 0. dirty is only touched by the
+ * writer.
+ */
+struct jf_cache_file {
+	char *key;
+	time_t atime;
+	uint64_t bytes;
+	int refs;
+
+	pthread_mutex_t lock;
+	int fd;
+	off_t size;
+	uint32_t nr_blocks;
+	uint8_t *bitmap;
+	uint32_t dirty;
+};
+
+/* Something for the writer to do */
+struct cache_op {
+	struct jf_cache_file *cf;
+	uint32_t blk;
+	char *data;		/* NULL for a close */
+	size_t len;
+	struct cache_op *next;
+};
+
+static ac_btree_t *cache_index;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static int cache_dirfd = -1;
+static uint64_t cache_max;
+static uint64_t cache_used;
+
+static struct cache_op *cache_queue;
+static struct cache_op **cache_queue_tail = &cache_queue;
+static size_t cache_queued;
+static pthread_t cache_writer;
+static bool cache_writer_running;
+static bool cache_writer_exit;
+static pthread_mutex_t cache_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_queue_cond = PTHREAD_COND_INITIALIZER;
+
+#define bitmap_size(nr_blocks)	(((nr_blocks) + 7) / 8)
+#define block_is_set(cf, blk)	((cf)->bitmap[(blk) / 8] & (1 << ((blk) % 8)))
+
+static uint32_t nr_blocks_for(off_t size)
+{
+	return (size + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE;
+}
+
+static size_t block_len(const struct jf_cache_file *cf, uint32_t blk)
+{
+	off_t left = cf->size - (off_t)blk * CACHE_BLOCK_SIZE;
+
+	return left < CACHE_BLOCK_SIZE ? (size_t)left : CACHE_BLOCK_SIZE;
+}
+
+static int compare_cache_keys(const void *a, const void *b)
+{
+	const struct jf_cache_file *cf1 = a;
+	const struct jf_cache_file *cf2 = b;
+
+	return strcmp(cf1->key, cf2->key);
+}
+
+static void free_cache_file(void *data)
+{
+	struct jf_cache_file *cf = data;
+
+	if (!cf)
+		return;
+
+	pthread_mutex_destroy(&cf->lock);
+	free(cf->bitmap);
+	free(cf->key);
+	free(cf);
+}
+
+static struct jf_cache_file *cache_file_new(const char *key)
+{
+	struct jf_cache_file *cf;
+
+	cf = calloc(1, sizeof(struct jf_cache_file));
+	cf->key = strdup(key);
+	cf->fd = -1;
+	pthread_mutex_init(&cf->lock, NULL);
+
+	return cf;
+}
+
+static void cache_unlink(const char *key)
+{
+	char path[PATH_MAX];
+
+	unlinkat(cache_dirfd, key, 0);
+	snprintf(path, sizeof(path), "%s.map", key);
+	unlinkat(cache_dirfd, path, 0);
+}
+
+/* Only called by the writer */
+static void cache_commit(struct jf_cache_file *cf)
+{
+	struct cache_map_hdr hdr = {};
+	char tmp[PATH_MAX];
+	char path[PATH_MAX];
+	struct iovec iov[2];
+	uint8_t *bitmap;
+	ssize_t len;
+	int fd;
+
+	/* Taken first, it mustn't claim anything not yet synced */
+	bitmap = malloc(bitmap_size(cf->nr_blocks));
+	pthread_mutex_lock(&cf->lock);
+	memcpy(bitmap, cf->bitmap, bitmap_size(cf->nr_blocks));
+	pthread_mutex_unlock(&cf->lock);
+
+	fdatasync(cf->fd);
+
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	hdr.version = CACHE_VERSION;
+	hdr.block_size = CACHE_BLOCK_SIZE;
+	hdr.file_size = cf->size;
+	hdr.atime = cf->atime;
+	hdr.nr_blocks = cf->nr_blocks;
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = bitmap;
+	iov[1].iov_len = bitmap_size(cf->nr_blocks);
+
+	snprintf(tmp, sizeof(tmp), "%s.map.tmp", cf->key);
+	snprintf(path, sizeof(path), "%s.map", cf->key);
+
+	fd = openat(cache_dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		    0600);
+	if (fd == -1) {
+		dbg("openat(%s): %s\n", tmp, strerror(errno));
+		goto out_free;
+	}
+	len = writev(fd, iov, 2);
+	if (len != (ssize_t)(iov[0].iov_len + iov[1].iov_len) ||
+	    fsync(fd) == -1) {
+		close(fd);
+		unlinkat(cache_dirfd, tmp, 0);
+		goto out_free;
+	}
+	close(fd);
+
+	renameat(cache_dirfd, tmp, cache_dirfd, path);
+	cf->dirty = 0;
+
+out_free:
+	free(bitmap);
+}
+
+/*
+ * Read in the map for key. Returns the bitmap (which the caller owns)
+ * or NULL if there isn't a valid map.
+ */
+static uint8_t *cache_map_load(const char *key, struct cache_map_hdr *hdr)
+{
+	char path[PATH_MAX];
+	uint8_t *bitmap;
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s.map", key);
+	fd = openat(cache_dirfd, path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return NULL;
+
+	len = read(fd, hdr, sizeof(*hdr));
+	if (len != sizeof(*hdr) ||
+	    memcmp(hdr->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+	    hdr->version != CACHE_VERSION ||
+	    hdr->block_size != CACHE_BLOCK_SIZE ||
+	    hdr->nr_blocks != nr_blocks_for(hdr->file_size)) {
+		close(fd);
+		return NULL;
+	}
+
+	bitmap = malloc(bitmap_size(hdr->nr_blocks));
+	len = read(fd, bitmap, bitmap_size(hdr->nr_blocks));
+	close(fd);
+	if (len != (ssize_t)bitmap_size(hdr->nr_blocks)) {
+		free(bitmap);
+		return NULL;
+	}
+
+	return bitmap;
+}
+
+static uint64_t cache_bitmap_bytes(const struct jf_cache_file *cf)
+{
+	uint64_t bytes = 0;
+
+	for (uint32_t blk = 0; blk < cf->nr_blocks; blk++) {
+		if (block_is_set(cf, blk))
+			bytes += block_len(cf, blk);
+	}
+
+	return bytes;
+}
+
+/* Called with cache_lock held */
+static int cache_file_load(struct jf_cache_file *cf, off_t size)
+{
+	struct cache_map_hdr hdr;
+
+	cf->fd = openat(cache_dirfd, cf->key, O_RDWR | O_CREAT | O_CLOEXEC,
+			0600);
+	if (cf->fd == -1) {
+		dbg("openat(%s): %s\n", cf->key, strerror(errno));
+		return -1;
+	}
+
+	cf->size = size;
+	cf->nr_blocks = nr_blocks_for(size);
+	cf->dirty = 0;
+
+	cf->bitmap = cache_map_load(cf->key, &hdr);
+	if (cf->bitmap && hdr.file_size == (uint64_t)size)
+		return 0;
+
+	/* No (usable) map, start afresh */
+	free(cf->bitmap);
+	cf->bitmap = calloc(1, bitmap_size(cf->nr_blocks));
+	cache_used -= cf->bytes;
+	cf->bytes = 0;
+	if (ftruncate(cf->fd, 0) == -1 || ftruncate(cf->fd, size) == -1)
+		dbg("ftruncate(%s): %s\n", cf->key, strerror(errno));
+
+	return 0;
+}
+
+struct lru_data {
+	const struct jf_cache_file *skip;
+	struct jf_cache_file *lru;
+};
+
+static void cache_find_lru(const void *nodep, VISIT which, void *data)
+{
+	struct jf_cache_file *cf = *(struct jf_cache_file **)nodep;
+	struct lru_data *lru = data;
+
+	switch (which) {
+	case preorder:
+	case endorder:
+		return;
+	case postorder:
+	case leaf:
+		if (cf->refs > 0 || cf == lru->skip)
+			return;
+		if (!lru->lru || cf->atime < lru->lru->atime)
+			lru->lru = cf;
+	}
+}
+
+/* Called with cache_lock held */
+static void cache_evict(const struct jf_cache_file *skip)
+{
+	while (cache_used > cache_max) {
+		struct lru_data lru = { .skip = skip };
+
+		ac_btree_foreach_data(cache_index, cache_find_lru, &lru);
+		if (!lru.lru)
+			break;
+
+		dbg("evicting [%s] (%lu bytes)\n", lru.lru->key,
+		    lru.lru->bytes);
+		cache_unlink(lru.lru->key);
+		cache_used -= lru.lru->bytes;
+		ac_btree_remove(cache_index, lru.lru);
+		jf_stats_inc(cache_evictions);
+	}
+}
+
+static bool has_suffix(const char *str, const char *suffix)
+{
+	size_t len = strlen(str);
+	size_t slen = strlen(suffix);
+
+	return len > slen && strcmp(str + len - slen, suffix) == 0;
+}
+
+/*
+ * Build the index of what's in the cache from the maps, anything else
+ * lying around (data without a map, left over temporary maps) is
+ * removed.
+ */
+static void cache_scan(void)
+{
+	DIR *dir;
+	struct dirent *de;
+
+	dir = fdopendir(dup(cache_dirfd));
+	if (!dir)
+		return;
+
+	for (;;) {
+		struct cache_map_hdr hdr;
+		struct jf_cache_file *cf;
+		struct stat sb;
+		char key[NAME_MAX + 1];
+
+		de = readdir(dir);
+		if (!de)
+			break;
+		if (!has_suffix(de->d_name, ".map"))
+			continue;
+
+		snprintf(key, sizeof(key), "%.*s",
+			 (int)(strlen(de->d_name) - 4), de->d_name);
+		cf = cache_file_new(key);
+		cf->bitmap = cache_map_load(key, &hdr);
+		if (!cf->bitmap ||
+		    fstatat(cache_dirfd, key, &sb, 0) == -1) {
+			cache_unlink(key);
+			free_cache_file(cf);
+			continue;
+		}
+
+		cf->size = hdr.file_size;
+		cf->nr_blocks = hdr.nr_blocks;
+		cf->atime = hdr.atime;
+		cf->bytes = cache_bitmap_bytes(cf);
+		free(cf->bitmap);
+		cf->bitmap = NULL;
+
+		cache_used += cf->bytes;
+		ac_btree_add(cache_index, cf);
+	}
+
+	rewinddir(dir);
+	for (;;) {
+		struct jf_cache_file cf = {};
+
+		de = readdir(dir);
+		if (!de)
+			break;
+		if (de->d_name[0] == '.')
+			continue;
+		if (has_suffix(de->d_name, ".map"))
+			continue;
+		cf.key = de->d_name;
+		if (!has_suffix(de->d_name, ".map.tmp") &&
+		    ac_btree_lookup(cache_index, &cf))
+			continue;
+
+		unlinkat(cache_dirfd, de->d_name, 0);
+	}
+
+	closedir(dir);
+}
+
+static void cache_write(struct jf_cache_file *cf, uint32_t blk,
+			const char *data, size_t len)
+{
+	ssize_t bytes;
+	bool set;
+
+	pthread_mutex_lock(&cf->lock);
+	set = block_is_set(cf, blk);
+	pthread_mutex_unlock(&cf->lock);
+	if (set)
+		return;
+
+	bytes = pwrite(cf->fd, data, len, (off_t)blk * CACHE_BLOCK_SIZE);
+	if (bytes != (ssize_t)len) {
+		dbg("pwrite(%s): short write/error\n", cf->key);
+		return;
+	}
+
+	pthread_mutex_lock(&cf->lock);
+	cf->bitmap[blk / 8] |= 1 << (blk % 8);
+	pthread_mutex_unlock(&cf->lock);
+	if (++cf->dirty >= CACHE_COMMIT_BLOCKS)
+		cache_commit(cf);
+
+	pthread_mutex_lock(&cache_lock);
+	cf->bytes += len;
+	cache_used += len;
+	cache_evict(cf);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static void cache_close(struct jf_cache_file *cf)
+{
+	bool commit;
+
+	/*
+	 * Committed with our reference still held, so nobody can open it
+	 * afresh meanwhile. Even if nothing new was cached, so the access
+	 * time is kept.
+	 */
+	pthread_mutex_lock(&cache_lock);
+	commit = cf->refs == 1 && cf->bytes > 0;
+	pthread_mutex_unlock(&cache_lock);
+	if (commit)
+		cache_commit(cf);
+
+	pthread_mutex_lock(&cache_lock);
+	if (--cf->refs > 0)
+		goto out_unlock;
+
+	pthread_mutex_lock(&cf->lock);
+	close(cf->fd);
+	cf->fd = -1;
+	free(cf->bitmap);
+	cf->bitmap = NULL;
+	pthread_mutex_unlock(&cf->lock);
+
+	if (cf->bytes == 0) {
+		cache_unlink(cf->key);
+		ac_btree_remove(cache_index, cf);
+	}
+	cache_evict(NULL);
+
+out_unlock:
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static void cache_op_run(struct cache_op *op)
+{
+	if (op->data)
+		cache_write(op->cf, op->blk, op->data, op->len);
+	else
+		cache_close(op->cf);
+
+	free(op->data);
+	free(op);
+}
+
+static void *cache_writer_fn(void *arg __unused)
+{
+	pthread_mutex_lock(&cache_queue_lock);
+	for (;;) {
+		struct cache_op *op = cache_queue;
+
+		if (!op) {
+			if (cache_writer_exit)
+				break;
+			pthread_cond_wait(&cache_queue_cond, &cache_queue_lock);
+			continue;
+		}
+
+		cache_queue = op->next;
+		if (!cache_queue)
+			cache_queue_tail = &cache_queue;
+		if (op->data)
+			cache_queued -= op->len;
+		pthread_mutex_unlock(&cache_queue_lock);
+
+		cache_op_run(op);
+
+		pthread_mutex_lock(&cache_queue_lock);
+	}
+	pthread_mutex_unlock(&cache_queue_lock);
+
+	return NULL;
+}
+
+static void cache_queue_add(struct cache_op *op)
+{
+	int err;
+
+	pthread_mutex_lock(&cache_queue_lock);
+	/* Not at init, we may have daemonised since */
+	if (!cache_writer_running) {
+		err = pthread_create(&cache_writer, NULL, cache_writer_fn,
+				     NULL);
+		if (err) {
+			pthread_mutex_unlock(&cache_queue_lock);
+			dbg("pthread_create(): %s\n", strerror(err));
+			cache_op_run(op);
+			return;
+		}
+		cache_writer_running = true;
+	}
+
+	*cache_queue_tail = op;
+	cache_queue_tail = &op->next;
+	if (op->data)
+		cache_queued += op->len;
+	pthread_cond_signal(&cache_queue_cond);
+	pthread_mutex_unlock(&cache_queue_lock);
+}
+
+int jf_cache_init(const char *dir, uint64_t max_size)
+{
+	if (mkdir_p(dir) == -1)
+		return -1;
+
+	cache_dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (cache_dirfd == -1)
+		return -1;
+
+	cache_max = max_size;
+	cache_index = ac_btree_new(compare_cache_keys, free_cache_file);
+
+	cache_scan();
+	cache_evict(NULL);
+
+	dbg("cache @ %s, %lu/%lu bytes used\n", dir, cache_used, cache_max);
+
+	return 0;
+}
+
+/* Waits for the writer to finish what it's been given */
+void jf_cache_destroy(void)
+{
+	if (!jf_cache_enabled())
+		return;
+
+	pthread_mutex_lock(&cache_queue_lock);
+	cache_writer_exit = true;
+	pthread_cond_signal(&cache_queue_cond);
+	pthread_mutex_unlock(&cache_queue_lock);
+	if (cache_writer_running)
+		pthread_join(cache_writer, NULL);
+	cache_writer_running = false;
+
+	ac_btree_destroy(cache_index);
+	close(cache_dirfd);
+	cache_dirfd = -1;
+}
+
+bool jf_cache_enabled(void)
+{
+	return cache_dirfd != -1;
+}
+
+uint64_t jf_cache_used(void)
+{
+	uint64_t used;
+
+	pthread_mutex_lock(&cache_lock);
+	used = cache_used;
+	pthread_mutex_unlock(&cache_lock);
+
+	return used;
+}
+
+struct jf_cache_file *jf_cache_open(uint64_t id, const char *fmt,
+				    off_t size)
+{
+	struct jf_cache_file *cf;
+	struct jf_cache_file key = {};
+	char name[NAME_MAX + 1];
+
+	if (!jf_cache_enabled() || !id || size <= 0)
+		return NULL;
+
+	snprintf(name, sizeof(name), "%" PRIu64 ".%s", id, fmt);
+	key.key = name;
+
+	pthread_mutex_lock(&cache_lock);
+	cf = ac_btree_lookup(cache_index, &key);
+	if (!cf) {
+		cf = cache_file_new(name);
+		ac_btree_add(cache_index, cf);
+	}
+
+	if (cf->refs == 0 && cache_file_load(cf, size) == -1) {
+		if (cf->bytes == 0)
+			ac_btree_remove(cache_index, cf);
+		cf = NULL;
+		goto out_unlock;
+	}
+	cf->refs++;
+	cf->atime = time(NULL);
+
+out_unlock:
+	pthread_mutex_unlock(&cache_lock);
+
+	return cf;
+}
+
+/* Done by the writer, once it's written out anything queued before it */
+void jf_cache_close(struct jf_cache_file *cf)
+{
+	struct cache_op *op;
+
+	if (!cf)
+		return;
+
+	op = calloc(1, sizeof(struct cache_op));
+	op->cf = cf;
+	cache_queue_add(op);
+}
+
+bool jf_cache_has(struct jf_cache_file *cf, off_t offset, size_t len)
+{
+	uint32_t first;
+	uint32_t last;
+	bool ret = true;
+
+	if (len == 0 || offset + (off_t)len > cf->size)
+		return false;
+
+	first = offset / CACHE_BLOCK_SIZE;
+	last = (offset + len - 1) / CACHE_BLOCK_SIZE;
+
+	pthread_mutex_lock(&cf->lock);
+	for (uint32_t blk = first; blk <= last; blk++) {
+		if (block_is_set(cf, blk))
+			continue;
+		ret = false;
+		break;
+	}
+	pthread_mutex_unlock(&cf->lock);
+
+	return ret;
+}
+
+int jf_cache_fd(const struct jf_cache_file *cf)
+{
+	return cf->fd;
+}
+
+ssize_t jf_cache_read(struct jf_cache_file *cf, char *buf, size_t len,
+		      off_t offset)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t bytes;
+
+		bytes = pread(cf->fd, buf + done, len - done, offset + done);
+		if (bytes == -1 && errno == EINTR)
+			continue;
+		if (bytes <= 0)
+			return -1;
+		done += bytes;
+	}
+
+	return done;
+}
+
+/* Is blk worth queueing? */
+static bool cache_want_block(struct jf_cache_file *cf, uint32_t blk,
+			     size_t len)
+{
+	bool full;
+	bool set;
+
+	pthread_mutex_lock(&cf->lock);
+	set = block_is_set(cf, blk);
+	pthread_mutex_unlock(&cf->lock);
+	if (set)
+		return false;
+
+	pthread_mutex_lock(&cache_queue_lock);
+	full = cache_queued + len > CACHE_QUEUE_MAX;
+	pthread_mutex_unlock(&cache_queue_lock);
+	if (full) {
+		dbg("cache writer behind, dropping block %u of [%s]\n", blk,
+		    cf->key);
+		return false;
+	}
+
+	return true;
+}
+
+static void cache_queue_block(struct jf_cache_file *cf, uint32_t blk,
+			      char *data, size_t len)
+{
+	struct cache_op *op;
+
+	op = calloc(1, sizeof(struct cache_op));
+	op->cf = cf;
+	op->blk = blk;
+	op->data = data;
+	op->len = len;
+	cache_queue_add(op);
+}
+
+/*
+ * Queue a copy of a block to be written out, it must be called before
+ * jf_cache_close() by whoever has cf open.
+ */
+void jf_cache_write_block(struct jf_cache_file *cf, uint32_t blk,
+			  const struct iovec *iov, int iovcnt)
+{
+	char *data;
+	size_t len;
+	size_t off = 0;
+
+	if (blk >= cf->nr_blocks)
+		return;
+
+	len = block_len(cf, blk);
+	if (!cache_want_block(cf, blk, len))
+		return;
+
+	data = malloc(len);
+	for (int i = 0; i < iovcnt && off < len; i++) {
+		size_t n = iov[i].iov_len;
+
+		if (n > len - off)
+			n = len - off;
+		memcpy(data + off, iov[i].iov_base, n);
+		off += n;
+	}
+	if (off != len) {
+		dbg("cache block %u of [%s] short\n", blk, cf->key);
+		free(data);
+		return;
+	}
+
+	cache_queue_block(cf, blk, data, len);
+}
+
+/*
+ * Like jf_cache_write_block(), but data (from malloc(3), the length of
+ * the block) is handed over rather than copied.
+ */
+void jf_cache_give_block(struct jf_cache_file *cf, uint32_t blk, char *data)
+{
+	if (blk >= cf->nr_blocks ||
+	    !cache_want_block(cf, blk, block_len(cf, blk))) {
+		free(data);
+		return;
+	}
+
+	cache_queue_block(cf, blk, data, block_len(cf, blk));
+}
@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * cache.h - On-disk cache of file data
+ *
+ * Copyright (c) 2021 - 2024	Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define CACHE_BLOCK_SIZE	(256 * 1024)
+
+struct jf_cache_file;
+
+int jf_cache_init(const char *dir, uint64_t max_size);
+void jf_cache_destroy(void);
+bool jf_cache_enabled(void);
+uint64_t jf_cache_used(void);
+
+struct jf_cache_file *jf_cache_open(uint64_t id, const char *fmt,
+				    off_t size);
+void jf_cache_close(struct jf_cache_file *cf);
+bool jf_cache_has(struct jf_cache_file *cf, off_t offset, size_t len);
+int jf_cache_fd(const struct jf_cache_file *cf);
+ssize_t jf_cache_read(struct jf_cache_file *cf, char *buf, size_t len,
+		      off_t offset);
+void jf_cache_write_block(struct jf_cache_file *cf, uint32_t blk,
+			  const struct iovec *iov, int iovcnt);
+void jf_cache_give_block(struct jf_cache_file *cf, uint32_t blk, char *data);
+
+#endif /* _CACHE_H_ */
@@ -0,0 +1,699 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * engine.c - Event loop running all the HTTP transfers
+ *
+ * Copyright (c) 2021 - 2024	Andrew Clayton <andrew@digital-domain.net>
+ */
+
+/*
+ * Every HTTP transfer is run by a single thread through one curl multi
+ * handle, driven by epoll(7) via curl's socket interface, rather than
+ * by whichever thread wanted it. A slow server then only holds up its
+ * own transfers, and how many can be going at once isn't limited by the
+ * number of threads.
+ *
+ * Transfers can be submitted from any thread along with a function to
+ * call (on the engine thread) once they're done, or jf_engine_perform()
+ * can be used to wait for one. They're started highest priority first,
+ * so long as there are fewer than max_xfers running in all, fewer than
+ * max_host_xfers to the host in question and fewer than the priority
+ * class allows, otherwise they wait.
+ *
+ * A class can also be given a bandwidth budget, which is shared out
+ * evenly between its running transfers, each getting its own token
+ * bucket. Write callbacks call jf_engine_throttle() with what they've
+ * been given, once a transfer has used up its tokens it's paused until
+ * they've been topped back up. So e.g several streams get an even share
+ * of what's allowed and background work can be kept from eating the
+ * bandwidth someone listening needs.
+ *
+ * The engine thread also calls the poll function passed to
+ * jf_engine_init() each time around, for anything that needs doing on
+ * it, i.e acting on the read-ahead requests of open files.
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <curl/curl.h>
+
+#include "jamendo-fuse.h"
+#include "engine.h"
+
+#define ENGINE_MAX_EVENTS	64
+/* Go around at least this often, regardless */
+#define ENGINE_WAIT_MAX_MS	1000
+/* And this often while anything is throttled */
+#define ENGINE_THROTTLE_MS	50
+/* How much a transfer can save up, in seconds worth of its share */
+#define ENGINE_BURST_SECS	0.25
+
+/* Limits for a priority class, 0 meaning none */
+struct engine_class {
+	long max_xfers;
+	long rate;
+
+	long nr_active;
+};
+
+/* Only touched by the engine thread */
+struct engine_host {
+	char *name;
+	long active;
+	struct engine_host *next;
+};
+
+struct engine_xfer {
+	CURL *curl;
+	enum jf_engine_prio prio;
+	char *host_name;
+	struct engine_host *host;
+	bool started;
+
+	/* Token bucket, if the class has a rate */
+	double tokens;
+	struct timespec refilled;
+	bool throttled;
+
+	jf_engine_done_fn done;
+	void *data;
+
+	/* In pending, or active once started */
+	struct engine_xfer *next;
+	struct engine_xfer *prev;
+};
+
+/* For jf_engine_perform() */
+struct engine_wait {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool done;
+	CURLcode res;
+};
+
+static CURLM *multi;
+static int epfd = -1;
+static int evfd = -1;
+static pthread_t engine_thread;
+/* Only cleared with pending_lock held, so nothing is queued after */
+static bool engine_running;
+static bool engine_exit;
+static void (*engine_poll)(void);
+
+static long max_xfers;
+static long max_host_xfers;
+static struct engine_class classes[JF_PRIO_NR];
+
+/* Only touched by the engine thread */
+static struct engine_xfer *active;
+static long nr_active;
+static long nr_throttled;
+static struct engine_host *hosts;
+static struct timespec timer_expire;
+static bool timer_set;
+
+/* Submitted but not yet started */
+static struct engine_xfer *pending[JF_PRIO_NR];
+static struct engine_xfer **pending_tail[JF_PRIO_NR];
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *url_host(const char *url)
+{
+	CURLU *u = curl_url();
+	char *host = NULL;
+	char *ret;
+
+	if (curl_url_set(u, CURLUPART_URL, url, 0) == CURLUE_OK)
+		curl_url_get(u, CURLUPART_HOST, &host, 0);
+	curl_url_cleanup(u);
+
+	ret = strdup(host ? host : "");
+	curl_free(host);
+
+	return ret;
+}
+
+static struct engine_host *engine_host_get(const char *name)
+{
+	struct engine_host *host;
+
+	for (host = hosts; host; host = host->next) {
+		if (strcmp(host->name, name) == 0)
+			return host;
+	}
+
+	host = calloc(1, sizeof(struct engine_host));
+	host->name = strdup(name);
+	host->next = hosts;
+	hosts = host;
+
+	return host;
+}
+
+static void engine_xfer_free(struct engine_xfer *xfer)
+{
+	free(xfer->host_name);
+	free(xfer);
+}
+
+/* Take a transfer out of the multi handle, engine thread only */
+static void engine_xfer_stop(struct engine_xfer *xfer)
+{
+	curl_multi_remove_handle(multi, xfer->curl);
+	curl_easy_setopt(xfer->curl, CURLOPT_PRIVATE, NULL);
+	xfer->host->active--;
+	classes[xfer->prio].nr_active--;
+	nr_active--;
+	if (xfer->throttled)
+		nr_throttled--;
+
+	if (xfer->prev)
+		xfer->prev->next = xfer->next;
+	else
+		active = xfer->next;
+	if (xfer->next)
+		xfer->next->prev = xfer->prev;
+}
+
+static double ts_elapsed(const struct timespec *t0,
+			 const struct timespec *t1)
+{
+	return (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/* Add tokens for the time since it was last topped up */
+static void engine_refill(struct engine_xfer *xfer,
+			  const struct timespec *now)
+{
+	const struct engine_class *cls = &classes[xfer->prio];
+	double share = (double)cls->rate / cls->nr_active;
+
+	xfer->tokens += share * ts_elapsed(&xfer->refilled, now);
+	if (xfer->tokens > share * ENGINE_BURST_SECS)
+		xfer->tokens = share * ENGINE_BURST_SECS;
+	xfer->refilled = *now;
+}
+
+/* Carry on with anything that's got tokens again */
+static void engine_unthrottle(void)
+{
+	struct engine_xfer *xfer;
+	struct timespec now;
+
+	if (!nr_throttled)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (xfer = active; xfer; xfer = xfer->next) {
+		if (!xfer->throttled)
+			continue;
+
+		engine_refill(xfer, &now);
+		if (xfer->tokens <= 0.0)
+			continue;
+
+		xfer->throttled = false;
+		nr_throttled--;
+		/* Can call straight back into the write callback */
+		curl_easy_pause(xfer->curl, CURLPAUSE_CONT);
+	}
+}
+
+static void engine_pending_unlink(struct engine_xfer **pp,
+				  enum jf_engine_prio prio)
+{
+	*pp = (*pp)->next;
+	if (!*pp)
+		pending_tail[prio] = pp;
+}
+
+static void engine_start_pending(void)
+{
+	pthread_mutex_lock(&pending_lock);
+	for (int prio = 0; prio < JF_PRIO_NR; prio++) {
+		struct engine_class *cls = &classes[prio];
+		struct engine_xfer **pp = &pending[prio];
+
+		while (*pp && nr_active < max_xfers &&
+		       (!cls->max_xfers || cls->nr_active < cls->max_xfers)) {
+			struct engine_xfer *xfer = *pp;
+
+			if (!xfer->host)
+				xfer->host = engine_host_get(xfer->host_name);
+			if (xfer->host->active >= max_host_xfers) {
+				pp = &xfer->next;
+				continue;
+			}
+
+			engine_pending_unlink(pp, prio);
+			xfer->started = true;
+			xfer->host->active++;
+			cls->nr_active++;
+			nr_active++;
+			if (cls->rate) {
+				clock_gettime(CLOCK_MONOTONIC,
+					      &xfer->refilled);
+				xfer->tokens = (double)cls->rate /
+					       cls->nr_active *
+					       ENGINE_BURST_SECS;
+			}
+			xfer->prev = NULL;
+			xfer->next = active;
+			if (active)
+				active->prev = xfer;
+			active = xfer;
+			curl_multi_add_handle(multi, xfer->curl);
+		}
+	}
+	pthread_mutex_unlock(&pending_lock);
+}
+
+static void engine_check_done(void)
+{
+	for (;;) {
+		CURLMsg *msg;
+		CURL *curl;
+		CURLcode res;
+		struct engine_xfer *xfer = NULL;
+		int msgs_left;
+
+		msg = curl_multi_info_read(multi, &msgs_left);
+		if (!msg)
+			break;
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		curl = msg->easy_handle;
+		res = msg->data.result;
+		curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&xfer);
+		if (!xfer)
+			continue;
+
+		engine_xfer_stop(xfer);
+		xfer->done(curl, res, xfer->data);
+		engine_xfer_free(xfer);
+	}
+}
+
+static int engine_socket_cb(CURL *curl __unused, curl_socket_t s, int what,
+			    void *userp __unused, void *socketp)
+{
+	struct epoll_event ev = { .data.fd = s };
+
+	if (what == CURL_POLL_REMOVE) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, s, NULL);
+		curl_multi_assign(multi, s, NULL);
+		return 0;
+	}
+
+	if (what & CURL_POLL_IN)
+		ev.events |= EPOLLIN;
+	if (what & CURL_POLL_OUT)
+		ev.events |= EPOLLOUT;
+
+	if (socketp) {
+		epoll_ctl(epfd, EPOLL_CTL_MOD, s, &ev);
+	} else {
+		epoll_ctl(epfd, EPOLL_CTL_ADD, s, &ev);
+		/* Just so we know it's been added */
+		curl_multi_assign(multi, s, &epfd);
+	}
+
+	return 0;
+}
+
+static int engine_timer_cb(CURLM *m __unused, long timeout_ms,
+			   void *userp __unused)
+{
+	if (timeout_ms < 0) {
+		timer_set = false;
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &timer_expire);
+	timer_expire.tv_sec += timeout_ms / 1000;
+	timer_expire.tv_nsec += (timeout_ms % 1000) * 1000000;
+	if (timer_expire.tv_nsec >= 1000000000) {
+		timer_expire.tv_sec++;
+		timer_expire.tv_nsec -= 1000000000;
+	}
+	timer_set = true;
+
+	return 0;
+}
+
+/* How long until curl's timer is due, in ms, 0 if it already is */
+static int engine_timer_left(void)
+{
+	struct timespec now;
+	long max = nr_throttled ? ENGINE_THROTTLE_MS : ENGINE_WAIT_MAX_MS;
+	long ms;
+
+	if (!timer_set)
+		return max;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (timer_expire.tv_sec - now.tv_sec) * 1000 +
+	     (timer_expire.tv_nsec - now.tv_nsec) / 1000000;
+	if (ms < 0)
+		return 0;
+	if (ms > max)
+		return max;
+
+	return ms;
+}
+
+static void engine_socket_action(int fd, uint32_t events)
+{
+	int flags = 0;
+	int running;
+
+	if (events & EPOLLIN)
+		flags |= CURL_CSELECT_IN;
+	if (events & EPOLLOUT)
+		flags |= CURL_CSELECT_OUT;
+	if (events & (EPOLLERR | EPOLLHUP))
+		flags |= CURL_CSELECT_ERR;
+
+	curl_multi_socket_action(multi, fd, flags, &running);
+}
+
+static void *engine_thread_fn(void *arg __unused)
+{
+	struct epoll_event events[ENGINE_MAX_EVENTS];
+
+	while (!__atomic_load_n(&engine_exit, __ATOMIC_ACQUIRE)) {
+		int running;
+		int n;
+
+		if (engine_poll)
+			engine_poll();
+		engine_unthrottle();
+		engine_start_pending();
+
+		n = epoll_wait(epfd, events, ENGINE_MAX_EVENTS,
+			       engine_timer_left());
+		for (int i = 0; i < n; i++) {
+			uint64_t val;
+
+			if (events[i].data.fd == evfd) {
+				if (read(evfd, &val, sizeof(val)) == -1)
+					dbg("read(eventfd) failed\n");
+				continue;
+			}
+			engine_socket_action(events[i].data.fd,
+					     events[i].events);
+		}
+
+		if (timer_set && engine_timer_left() == 0) {
+			timer_set = false;
+			curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0,
+						 &running);
+		}
+
+		engine_check_done();
+	}
+
+	return NULL;
+}
+
+/* Set the limits for a class, before the engine is started */
+void jf_engine_set_class(enum jf_engine_prio prio, long max, long rate)
+{
+	classes[prio].max_xfers = max;
+	classes[prio].rate = rate;
+}
+
+int jf_engine_init(long max, long max_host, void (*poll)(void))
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	int err;
+
+	max_xfers = max;
+	max_host_xfers = max_host;
+	engine_poll = poll;
+	for (int prio = 0; prio < JF_PRIO_NR; prio++)
+		pending_tail[prio] = &pending[prio];
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1)
+		return -1;
+	evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (evfd == -1)
+		goto out_close;
+
+	ev.data.fd = evfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, evfd, &ev);
+
+	multi = curl_multi_init();
+	curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, engine_socket_cb);
+	curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, engine_timer_cb);
+
+	err = pthread_create(&engine_thread, NULL, engine_thread_fn, NULL);
+	if (err) {
+		dbg("pthread_create(): %s\n", strerror(err));
+		curl_multi_cleanup(multi);
+		goto out_close;
+	}
+	__atomic_store_n(&engine_running, true, __ATOMIC_RELEASE);
+
+	return 0;
+
+out_close:
+	if (evfd != -1)
+		close(evfd);
+	close(epfd);
+	epfd = evfd = -1;
+
+	return -1;
+}
+
+/*
+ * Anything still outstanding is failed with CURLE_ABORTED_BY_CALLBACK
+ * so nobody is left waiting on it.
+ */
+void jf_engine_destroy(void)
+{
+	struct engine_xfer *left[JF_PRIO_NR];
+
+	if (!jf_engine_running())
+		return;
+
+	__atomic_store_n(&engine_exit, true, __ATOMIC_RELEASE);
+	jf_engine_wakeup();
+	pthread_join(engine_thread, NULL);
+
+	/* Anyone submitting from here on is failed straight away */
+	pthread_mutex_lock(&pending_lock);
+	__atomic_store_n(&engine_running, false, __ATOMIC_RELEASE);
+	for (int prio = 0; prio < JF_PRIO_NR; prio++) {
+		left[prio] = pending[prio];
+		pending[prio] = NULL;
+		pending_tail[prio] = &pending[prio];
+	}
+	pthread_mutex_unlock(&pending_lock);
+
+	for (int prio = 0; prio < JF_PRIO_NR; prio++) {
+		while (left[prio]) {
+			struct engine_xfer *xfer = left[prio];
+
+			left[prio] = xfer->next;
+			xfer->done(xfer->curl, CURLE_ABORTED_BY_CALLBACK,
+				   xfer->data);
+			engine_xfer_free(xfer);
+		}
+	}
+
+	while (active) {
+		struct engine_xfer *xfer = active;
+
+		engine_xfer_stop(xfer);
+		xfer->done(xfer->curl, CURLE_ABORTED_BY_CALLBACK, xfer->data);
+		engine_xfer_free(xfer);
+	}
+
+	curl_multi_cleanup(multi);
+	close(evfd);
+	close(epfd);
+	epfd = evfd = -1;
+
+	while (hosts) {
+		struct engine_host *next = hosts->next;
+
+		free(hosts->name);
+		free(hosts);
+		hosts = next;
+	}
+}
+
+bool jf_engine_running(void)
+{
+	return __atomic_load_n(&engine_running, __ATOMIC_ACQUIRE);
+}
+
+void jf_engine_wakeup(void)
+{
+	uint64_t val = 1;
+
+	if (evfd == -1)
+		return;
+
+	if (write(evfd, &val, sizeof(val)) == -1)
+		dbg("write(eventfd) failed\n");
+}
+
+/*
+ * Queue curl to fetch url. done is called on the engine thread once
+ * it's finished (successfully or not) and so must not block, the engine
+ * is done with curl by then. If the engine isn't running it's called
+ * straight away with CURLE_FAILED_INIT.
+ *
+ * CURLOPT_PRIVATE belongs to the engine while the transfer is queued.
+ */
+void jf_engine_submit(CURL *curl, const char *url, enum jf_engine_prio prio,
+		      jf_engine_done_fn done, void *data)
+{
+	struct engine_xfer *xfer;
+
+	if (!jf_engine_running()) {
+		done(curl, CURLE_FAILED_INIT, data);
+		return;
+	}
+
+	xfer = calloc(1, sizeof(struct engine_xfer));
+	xfer->curl = curl;
+	xfer->prio = prio;
+	xfer->host_name = url_host(url);
+	xfer->done = done;
+	xfer->data = data;
+
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, xfer);
+
+	pthread_mutex_lock(&pending_lock);
+	/* Gone since we looked */
+	if (!engine_running) {
+		pthread_mutex_unlock(&pending_lock);
+		curl_easy_setopt(curl, CURLOPT_PRIVATE, NULL);
+		engine_xfer_free(xfer);
+		done(curl, CURLE_FAILED_INIT, data);
+		return;
+	}
+	*pending_tail[prio] = xfer;
+	pending_tail[prio] = &xfer->next;
+	pthread_mutex_unlock(&pending_lock);
+
+	jf_engine_wakeup();
+}
+
+/*
+ * Abandon a submitted transfer without its done function being called.
+ * Only to be called on the engine thread, i.e from the poll function.
+ */
+void jf_engine_cancel(CURL *curl)
+{
+	struct engine_xfer *xfer = NULL;
+	struct engine_xfer **pp;
+
+	curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&xfer);
+	if (!xfer)
+		return;
+
+	if (xfer->started) {
+		engine_xfer_stop(xfer);
+		engine_xfer_free(xfer);
+		return;
+	}
+
+	pthread_mutex_lock(&pending_lock);
+	for (pp = &pending[xfer->prio]; *pp != xfer; pp = &(*pp)->next)
+		;
+	engine_pending_unlink(pp, xfer->prio);
+	pthread_mutex_unlock(&pending_lock);
+
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, NULL);
+	engine_xfer_free(xfer);
+}
+
+/*
+ * Called from a write callback with how much it's been given. If it
+ * returns true, the transfer is over its share of its class's bandwidth
+ * and the callback should return CURL_WRITEFUNC_PAUSE without taking
+ * any of it, the engine will carry it on again later.
+ */
+bool jf_engine_throttle(CURL *curl, size_t len)
+{
+	struct engine_xfer *xfer = NULL;
+	struct timespec now;
+
+	curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&xfer);
+	if (!xfer || !classes[xfer->prio].rate)
+		return false;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	engine_refill(xfer, &now);
+	/* Let it go into debt so any size write can get through */
+	if (xfer->tokens > 0.0) {
+		xfer->tokens -= len;
+		return false;
+	}
+
+	if (!xfer->throttled) {
+		xfer->throttled = true;
+		nr_throttled++;
+	}
+
+	return true;
+}
+
+static void engine_wait_done(CURL *curl __unused, CURLcode res, void *data)
+{
+	struct engine_wait *wait = data;
+
+	pthread_mutex_lock(&wait->lock);
+	wait->res = res;
+	wait->done = true;
+	pthread_cond_signal(&wait->cond);
+	pthread_mutex_unlock(&wait->lock);
+}
+
+/*
+ * Like curl_easy_perform(), but run by the engine. Must not be called on
+ * the engine thread.
+ */
+CURLcode jf_engine_perform(CURL *curl, const char *url,
+			   enum jf_engine_prio prio)
+{
+	struct engine_wait wait = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+
+	if (!jf_engine_running()) {
+		curl_easy_setopt(curl, CURLOPT_URL, url);
+		return curl_easy_perform(curl);
+	}
+
+	jf_engine_submit(curl, url, prio, engine_wait_done, &wait);
+
+	pthread_mutex_lock(&wait.lock);
+	while (!wait.done)
+		pthread_cond_wait(&wait.cond, &wait.lock);
+	pthread_mutex_unlock(&wait.lock);
+
+	pthread_mutex_destroy(&wait.lock);
+	pthread_cond_destroy(&wait.cond);
+
+	return wait.res;
+}
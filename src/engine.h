@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * engine.h - Event loop running all the HTTP transfers
+ *
+ * Copyright (c) 2021 - 2024	Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _ENGINE_H_
+#define _ENGINE_H_
+
+#include <stdbool.h>
+
+#include <curl/curl.h>
+
+/* Highest first, waiting transfers are started in this order */
+enum jf_engine_prio {
+	JF_PRIO_READ = 0,	/* file data */
+	JF_PRIO_META,		/* directory listings, track sizes */
+	JF_PRIO_BG,		/* prefetching, refreshing */
+
+	JF_PRIO_NR,
+};
+
+typedef void (*jf_engine_done_fn)(CURL *curl, CURLcode res, void *data);
+
+void jf_engine_set_class(enum jf_engine_prio prio, long max_xfers,
+			 long rate);
+int jf_engine_init(long max_xfers, long max_host_xfers,
+		   void (*poll)(void));
+void jf_engine_destroy(void);
+bool jf_engine_running(void);
+void jf_engine_wakeup(void);
+void jf_engine_submit(CURL *curl, const char *url, enum jf_engine_prio prio,
+		      jf_engine_done_fn done, void *data);
+void jf_engine_cancel(CURL *curl);
+bool jf_engine_throttle(CURL *curl, size_t len);
+CURLcode jf_engine_perform(CURL *curl, const char *url,
+			   enum jf_engine_prio prio);
+
+#endif /* _ENGINE_H_ */
@@ -0,0 +1,573 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * headtail.c - On-disk cache of the start and end of files
+ *
+ * Copyright (c) 2021 - 2024	Andrew Clayton <andrew@digital-domain.net>
+ */
+
+/*
+ * Media scanners (MPD, beets etc) look at every file, but generally only
+ * read the tags and stream headers at the start and end of it. Rather
+ * than keep whole files around for that, this keeps just those two
+ * regions of each file, so a second scan needn't touch the network.
+ *
+ * Each region of each file (track id + format) is stored as its own
+ * small "<id>.<fmt>.{head,tail}" file, a header followed by the data.
+ * They're written in full to a temporary file which is then rename(2)'d
+ * into place, so anything found under its proper name is complete.
+ *
+ * The files mtime is used as the access time, when over the size limit
+ * the least recently used regions are removed.
+ *
+ * Regions are fetched on the engine thread (filling in the background)
+ * or on a FUSE thread that has a read to answer, neither of which should
+ * wait on the disk, so they're handed to jf_headtail_give() and stored by
+ * a writer thread. If it's more than HEADTAIL_QUEUE_MAX behind, new ones
+ * are dropped.
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <libac.h>
+
+#include "jamendo-fuse.h"
+#include "headtail.h"
+
+#define HEADTAIL_MAGIC		"JFHDTL"
+#define HEADTAIL_VERSION	1
+
+/* Don't update the mtime on every read */
+#define HEADTAIL_TOUCH_SECS	(60 * 60)
+
+#define HEADTAIL_QUEUE_MAX	(8 * 1024 * 1024)
+
+struct headtail_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t len;
+	uint64_t file_size;
+	uint64_t offset;
+};
+
+/* All protected by ht_lock */
+struct headtail_region {
+	char *key;
+	off_t size;
+	uint32_t len;
+	time_t atime;
+};
+
+/* A region waiting for the writer */
+struct headtail_op {
+	uint64_t id;
+	char *fmt;
+	off_t size;
+	off_t roff;
+	char *data;
+	size_t len;
+	struct headtail_op *next;
+};
+
+static ac_btree_t *ht_index;
+static pthread_mutex_t ht_lock = PTHREAD_MUTEX_INITIALIZER;
+static int ht_dirfd = -1;
+static uint64_t ht_max;
+static uint64_t ht_used;
+
+static struct headtail_op *ht_queue;
+static struct headtail_op **ht_queue_tail = &ht_queue;
+static size_t ht_queued;
+static pthread_t ht_writer;
+static bool ht_writer_running;
+static bool ht_writer_exit;
+static pthread_mutex_t ht_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ht_queue_cond = PTHREAD_COND_INITIALIZER;
+
+static int compare_region_keys(const void *a, const void *b)
+{
+	const struct headtail_region *hr1 = a;
+	const struct headtail_region *hr2 = b;
+
+	return strcmp(hr1->key, hr2->key);
+}
+
+static void free_region(void *data)
+{
+	struct headtail_region *hr = data;
+
+	if (!hr)
+		return;
+
+	free(hr->key);
+	free(hr);
+}
+
+static void region_key(char *buf, size_t size, uint64_t id, const char *fmt,
+		       off_t roff)
+{
+	snprintf(buf, size, "%" PRIu64 ".%s.%s", id, fmt,
+		 roff == 0 ? "head" : "tail");
+}
+
+static uint64_t region_bytes(const struct headtail_region *hr)
+{
+	return sizeof(struct headtail_hdr) + hr->len;
+}
+
+static struct headtail_region *region_lookup(const char *key)
+{
+	struct headtail_region hr = { .key = (char *)key };
+
+	return ac_btree_lookup(ht_index, &hr);
+}
+
+struct lru_data {
+	struct headtail_region *lru;
+};
+
+static void ht_find_lru(const void *nodep, VISIT which, void *data)
+{
+	struct headtail_region *hr = *(struct headtail_region **)nodep;
+	struct lru_data *lru = data;
+
+	switch (which) {
+	case preorder:
+	case endorder:
+		return;
+	case postorder:
+	case leaf:
+		if (!lru->lru || hr->atime < lru->lru->atime)
+			lru->lru = hr;
+	}
+}
+
+/* Called with ht_lock held */
+static void ht_remove(struct headtail_region *hr)
+{
+	unlinkat(ht_dirfd, hr->key, 0);
+	ht_used -= region_bytes(hr);
+	ac_btree_remove(ht_index, hr);
+}
+
+/* Called with ht_lock held */
+static void ht_evict(void)
+{
+	while (ht_used > ht_max) {
+		struct lru_data lru = {};
+
+		ac_btree_foreach_data(ht_index, ht_find_lru, &lru);
+		if (!lru.lru)
+			break;
+
+		dbg("evicting [%s]\n", lru.lru->key);
+		ht_remove(lru.lru);
+	}
+}
+
+static bool has_suffix(const char *str, const char *suffix)
+{
+	size_t len = strlen(str);
+	size_t slen = strlen(suffix);
+
+	return len > slen && strcmp(str + len - slen, suffix) == 0;
+}
+
+/*
+ * Build the index from the headers of what's there, anything that
+ * doesn't look right (including left over temporary files) is removed.
+ */
+static void ht_scan(void)
+{
+	DIR *dir;
+	struct dirent *de;
+
+	dir = fdopendir(dup(ht_dirfd));
+	if (!dir)
+		return;
+
+	for (;;) {
+		struct headtail_hdr hdr;
+		struct headtail_region *hr;
+		struct stat sb;
+		ssize_t len;
+		int fd;
+
+		de = readdir(dir);
+		if (!de)
+			break;
+		if (de->d_name[0] == '.')
+			continue;
+		if (has_suffix(de->d_name, ".tmp"))
+			goto out_unlink;
+
+		fd = openat(ht_dirfd, de->d_name, O_RDONLY | O_CLOEXEC);
+		if (fd == -1)
+			goto out_unlink;
+		len = read(fd, &hdr, sizeof(hdr));
+		if (fstat(fd, &sb) == -1)
+			len = -1;
+		close(fd);
+
+		if (len != sizeof(hdr) ||
+		    memcmp(hdr.magic, HEADTAIL_MAGIC,
+			   sizeof(HEADTAIL_MAGIC)) != 0 ||
+		    hdr.version != HEADTAIL_VERSION ||
+		    sb.st_size != (off_t)(sizeof(hdr) + hdr.len))
+			goto out_unlink;
+
+		hr = calloc(1, sizeof(struct headtail_region));
+		hr->key = strdup(de->d_name);
+		hr->size = hdr.file_size;
+		hr->len = hdr.len;
+		hr->atime = sb.st_mtime;
+
+		ht_used += region_bytes(hr);
+		ac_btree_add(ht_index, hr);
+		continue;
+
+out_unlink:
+		unlinkat(ht_dirfd, de->d_name, 0);
+	}
+
+	closedir(dir);
+}
+
+int jf_headtail_init(const char *dir, uint64_t max_size)
+{
+	if (mkdir_p(dir) == -1)
+		return -1;
+
+	ht_dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (ht_dirfd == -1)
+		return -1;
+
+	ht_max = max_size;
+	ht_index = ac_btree_new(compare_region_keys, free_region);
+
+	ht_scan();
+	ht_evict();
+
+	dbg("head/tail cache @ %s, %lu/%lu bytes used\n", dir, ht_used,
+	    ht_max);
+
+	return 0;
+}
+
+/* Waits for the writer to store what it's been given */
+void jf_headtail_destroy(void)
+{
+	if (!jf_headtail_enabled())
+		return;
+
+	pthread_mutex_lock(&ht_queue_lock);
+	ht_writer_exit = true;
+	pthread_cond_signal(&ht_queue_cond);
+	pthread_mutex_unlock(&ht_queue_lock);
+	if (ht_writer_running)
+		pthread_join(ht_writer, NULL);
+	ht_writer_running = false;
+
+	ac_btree_destroy(ht_index);
+	close(ht_dirfd);
+	ht_dirfd = -1;
+}
+
+bool jf_headtail_enabled(void)
+{
+	return ht_dirfd != -1;
+}
+
+uint64_t jf_headtail_used(void)
+{
+	uint64_t used;
+
+	pthread_mutex_lock(&ht_lock);
+	used = ht_used;
+	pthread_mutex_unlock(&ht_lock);
+
+	return used;
+}
+
+/*
+ * Find the region of a file of size that [offset, offset + len) (clipped
+ * to the end of the file) lies within. The head is the first
+ * HEADTAIL_HEAD_SIZE bytes, the tail the last HEADTAIL_TAIL_SIZE not
+ * already in the head.
+ */
+bool jf_headtail_region(off_t size, off_t offset, size_t len, off_t *roff,
+			size_t *rlen)
+{
+	off_t head = size < HEADTAIL_HEAD_SIZE ? size : HEADTAIL_HEAD_SIZE;
+	off_t end;
+
+	if (len == 0 || offset < 0 || !(offset < size))
+		return false;
+
+	end = offset + (off_t)len;
+	if (end > size)
+		end = size;
+
+	if (end <= head) {
+		*roff = 0;
+		*rlen = head;
+		return true;
+	}
+
+	*roff = size - HEADTAIL_TAIL_SIZE;
+	if (*roff < head)
+		*roff = head;
+	if (offset < *roff)
+		return false;
+	*rlen = size - *roff;
+
+	return true;
+}
+
+bool jf_headtail_has(uint64_t id, const char *fmt, off_t size, off_t roff)
+{
+	struct headtail_region *hr;
+	char key[NAME_MAX + 1];
+	bool ret;
+
+	if (!jf_headtail_enabled())
+		return false;
+
+	region_key(key, sizeof(key), id, fmt, roff);
+
+	pthread_mutex_lock(&ht_lock);
+	hr = region_lookup(key);
+	ret = hr && hr->size == size;
+	pthread_mutex_unlock(&ht_lock);
+
+	return ret;
+}
+
+/*
+ * Returns the number of bytes read (clipped to the end of the file), or
+ * -1 if the range isn't all in the cache.
+ */
+ssize_t jf_headtail_read(uint64_t id, const char *fmt, off_t size,
+			 char *buf, size_t len, off_t offset)
+{
+	struct headtail_region *hr;
+	char key[NAME_MAX + 1];
+	off_t roff;
+	size_t rlen;
+	ssize_t bytes;
+	time_t now;
+	bool touch;
+	int fd;
+
+	if (!jf_headtail_enabled() ||
+	    !jf_headtail_region(size, offset, len, &roff, &rlen))
+		return -1;
+
+	if (offset + (off_t)len > size)
+		len = size - offset;
+
+	region_key(key, sizeof(key), id, fmt, roff);
+	now = time(NULL);
+
+	pthread_mutex_lock(&ht_lock);
+	hr = region_lookup(key);
+	if (!hr || hr->size != size || hr->len != rlen) {
+		pthread_mutex_unlock(&ht_lock);
+		return -1;
+	}
+	touch = now - hr->atime > HEADTAIL_TOUCH_SECS;
+	hr->atime = now;
+	pthread_mutex_unlock(&ht_lock);
+
+	/* If it was evicted in the meantime, it's simply a miss */
+	fd = openat(ht_dirfd, key, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	bytes = pread(fd, buf, len,
+		      sizeof(struct headtail_hdr) + (offset - roff));
+	if (touch)
+		futimens(fd, NULL);
+	close(fd);
+
+	if (bytes != (ssize_t)len)
+		return -1;
+
+	return len;
+}
+
+/*
+ * Store the region of a file of size starting at roff. Anything that
+ * isn't exactly one of the regions of the file is ignored.
+ */
+static void headtail_store(uint64_t id, const char *fmt, off_t size,
+			   off_t roff, const char *data, size_t len)
+{
+	struct headtail_hdr hdr = {};
+	struct headtail_region *hr;
+	char key[NAME_MAX + 1];
+	char tmp[PATH_MAX];
+	struct iovec iov[2];
+	off_t off;
+	size_t rlen;
+	ssize_t bytes;
+	int fd;
+
+	if (!jf_headtail_enabled() ||
+	    !jf_headtail_region(size, roff, len, &off, &rlen) ||
+	    off != roff || rlen != len)
+		return;
+
+	region_key(key, sizeof(key), id, fmt, roff);
+	/* Two threads could be storing the same region */
+	snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", key, (long)gettid());
+
+	memcpy(hdr.magic, HEADTAIL_MAGIC, sizeof(HEADTAIL_MAGIC));
+	hdr.version = HEADTAIL_VERSION;
+	hdr.len = len;
+	hdr.file_size = size;
+	hdr.offset = roff;
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = len;
+
+	fd = openat(ht_dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		    0600);
+	if (fd == -1) {
+		dbg("openat(%s): %s\n", tmp, strerror(errno));
+		return;
+	}
+	bytes = writev(fd, iov, 2);
+	if (bytes != (ssize_t)(sizeof(hdr) + len) || fdatasync(fd) == -1) {
+		close(fd);
+		unlinkat(ht_dirfd, tmp, 0);
+		return;
+	}
+	close(fd);
+
+	pthread_mutex_lock(&ht_lock);
+	if (renameat(ht_dirfd, tmp, ht_dirfd, key) == -1) {
+		unlinkat(ht_dirfd, tmp, 0);
+		goto out_unlock;
+	}
+
+	hr = region_lookup(key);
+	if (hr) {
+		ht_used -= region_bytes(hr);
+	} else {
+		hr = calloc(1, sizeof(struct headtail_region));
+		hr->key = strdup(key);
+		ac_btree_add(ht_index, hr);
+	}
+	hr->size = size;
+	hr->len = len;
+	hr->atime = time(NULL);
+	ht_used += region_bytes(hr);
+
+	ht_evict();
+
+out_unlock:
+	pthread_mutex_unlock(&ht_lock);
+}
+
+static void ht_op_free(struct headtail_op *op)
+{
+	free(op->fmt);
+	free(op->data);
+	free(op);
+}
+
+static void *ht_writer_fn(void *arg __unused)
+{
+	pthread_mutex_lock(&ht_queue_lock);
+	for (;;) {
+		struct headtail_op *op = ht_queue;
+
+		if (!op) {
+			if (ht_writer_exit)
+				break;
+			pthread_cond_wait(&ht_queue_cond, &ht_queue_lock);
+			continue;
+		}
+
+		ht_queue = op->next;
+		if (!ht_queue)
+			ht_queue_tail = &ht_queue;
+		ht_queued -= op->len;
+		pthread_mutex_unlock(&ht_queue_lock);
+
+		headtail_store(op->id, op->fmt, op->size, op->roff,
+			       op->data, op->len);
+		ht_op_free(op);
+
+		pthread_mutex_lock(&ht_queue_lock);
+	}
+	pthread_mutex_unlock(&ht_queue_lock);
+
+	return NULL;
+}
+
+/*
+ * Like headtail_store(), but done later by the writer thread. data
+ * (from malloc(3)) is handed over.
+ */
+void jf_headtail_give(uint64_t id, const char *fmt, off_t size, off_t roff,
+		      char *data, size_t len)
+{
+	struct headtail_op *op;
+	int err;
+
+	op = calloc(1, sizeof(struct headtail_op));
+	op->id = id;
+	op->fmt = strdup(fmt);
+	op->size = size;
+	op->roff = roff;
+	op->data = data;
+	op->len = len;
+
+	pthread_mutex_lock(&ht_queue_lock);
+	if (!jf_headtail_enabled() || ht_writer_exit ||
+	    ht_queued + len > HEADTAIL_QUEUE_MAX) {
+		pthread_mutex_unlock(&ht_queue_lock);
+		dbg("not storing %" PRIu64 ".%s @ %jd\n", id, fmt,
+		    (intmax_t)roff);
+		ht_op_free(op);
+		return;
+	}
+	/* Not at init, we may have daemonised since */
+	if (!ht_writer_running) {
+		err = pthread_create(&ht_writer, NULL, ht_writer_fn, NULL);
+		if (err) {
+			pthread_mutex_unlock(&ht_queue_lock);
+			dbg("pthread_create(): %s\n", strerror(err));
+			ht_op_free(op);
+			return;
+		}
+		ht_writer_running = true;
+	}
+
+	*ht_queue_tail = op;
+	ht_queue_tail = &op->next;
+	ht_queued += len;
+	pthread_cond_signal(&ht_queue_cond);
+	pthread_mutex_unlock(&ht_queue_lock);
+}
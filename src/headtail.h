@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * headtail.h - On-disk cache of the start and end of files
+ *
+ * Copyright (c) 2021 - 2024	Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _HEADTAIL_H_
+#define _HEADTAIL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* Enough for the tags and stream headers, embedded artwork aside */
+#define HEADTAIL_HEAD_SIZE	(128 * 1024)
+#define HEADTAIL_TAIL_SIZE	(32 * 1024)
+
+int jf_headtail_init(const char *dir, uint64_t max_size);
+void jf_headtail_destroy(void);
+bool jf_headtail_enabled(void);
+uint64_t jf_headtail_used(void);
+
+bool jf_headtail_region(off_t size, off_t offset, size_t len, off_t *roff,
+			size_t *rlen);
+bool jf_headtail_has(uint64_t id, const char *fmt, off_t size, off_t roff);
+ssize_t jf_headtail_read(uint64_t id, const char *fmt, off_t size,
+			 char *buf, size_t len, off_t offset);
+void jf_headtail_give(uint64_t id, const char *fmt, off_t size, off_t roff,
+		      char *data, size_t len);
+
+#endif /* _HEADTAIL_H_ */
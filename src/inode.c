@@ -0,0 +1,324 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * inode.c - Inode numbers handed out to the kernel
+ *
+ * Copyright (c) 2021 - 2024	Andrew Clayton <andrew@digital-domain.net>
+ */
+
+/*
+ * Every file and directory the kernel has looked up gets an inode
+ * number which it then uses to refer to it. They're handed out in order
+ * and never reused, so a number always means the same path.
+ *
+ * An inode is kept until the kernel has forgotten every lookup of it,
+ * i.e nlookup drops back to 0. The root is never forgotten.
+ *
+ * Inodes are found either by number, or by their parent's number and
+ * their name, with a hash table for each.
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "jamendo-fuse.h"
+#include "intern.h"
+#include "inode.h"
+
+#define INODE_BUCKETS_MIN	1024
+
+struct jf_inode {
+	uint64_t ino;
+	uint64_t parent;
+	char *path;
+	const char *name;
+
+	uint64_t nlookup;
+
+	uint32_t hash;
+	struct jf_inode *hnext;	/* by parent/name */
+	struct jf_inode *inext;	/* by ino */
+};
+
+static struct jf_inode **by_name;
+static struct jf_inode **by_ino;
+static size_t nr_buckets;
+static size_t nr_inodes;
+static uint64_t next_ino = JF_ROOT_INO + 1;
+static pthread_rwlock_t inode_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static uint32_t inode_hash(uint64_t parent, const char *name)
+{
+	return jf_hash(name, strlen(name)) ^ (parent * 0x9e3779b97f4a7c15ULL);
+}
+
+static size_t ino_bucket(uint64_t ino)
+{
+	return (ino * 0x9e3779b97f4a7c15ULL >> 32) & (nr_buckets - 1);
+}
+
+static void inode_insert(struct jf_inode *inode)
+{
+	size_t b = inode->hash & (nr_buckets - 1);
+
+	inode->hnext = by_name[b];
+	by_name[b] = inode;
+
+	b = ino_bucket(inode->ino);
+	inode->inext = by_ino[b];
+	by_ino[b] = inode;
+}
+
+static void inode_grow(void)
+{
+	struct jf_inode **old = by_ino;
+	size_t old_nr = nr_buckets;
+
+	nr_buckets *= 2;
+	free(by_name);
+	by_name = calloc(nr_buckets, sizeof(struct jf_inode *));
+	by_ino = calloc(nr_buckets, sizeof(struct jf_inode *));
+
+	for (size_t i = 0; i < old_nr; i++) {
+		struct jf_inode *inode = old[i];
+
+		while (inode) {
+			struct jf_inode *next = inode->inext;
+
+			inode_insert(inode);
+			inode = next;
+		}
+	}
+
+	free(old);
+}
+
+static struct jf_inode *inode_get(uint64_t ino)
+{
+	struct jf_inode *inode = by_ino[ino_bucket(ino)];
+
+	for ( ; inode; inode = inode->inext) {
+		if (inode->ino == ino)
+			return inode;
+	}
+
+	return NULL;
+}
+
+static struct jf_inode *inode_find(uint64_t parent, const char *name,
+				   uint32_t hash)
+{
+	struct jf_inode *inode = by_name[hash & (nr_buckets - 1)];
+
+	for ( ; inode; inode = inode->hnext) {
+		if (inode->hash == hash && inode->parent == parent &&
+		    strcmp(inode->name, name) == 0)
+			return inode;
+	}
+
+	return NULL;
+}
+
+static char *inode_child_path(const struct jf_inode *parent, const char *name)
+{
+	char *path;
+	int len;
+
+	if (parent->ino == JF_ROOT_INO)
+		len = asprintf(&path, "/%s", name);
+	else
+		len = asprintf(&path, "%s/%s", parent->path, name);
+	if (len == -1)
+		return NULL;
+
+	return path;
+}
+
+static void inode_free(struct jf_inode *inode)
+{
+	free(inode->path);
+	free(inode);
+}
+
+void jf_inode_init(void)
+{
+	struct jf_inode *root;
+
+	nr_buckets = INODE_BUCKETS_MIN;
+	by_name = calloc(nr_buckets, sizeof(struct jf_inode *));
+	by_ino = calloc(nr_buckets, sizeof(struct jf_inode *));
+
+	root = calloc(1, sizeof(struct jf_inode));
+	root->ino = JF_ROOT_INO;
+	root->path = strdup("/");
+	root->name = root->path;
+	root->nlookup = 1;
+	root->hash = inode_hash(0, root->name);
+	inode_insert(root);
+	nr_inodes = 1;
+}
+
+void jf_inode_destroy(void)
+{
+	for (size_t i = 0; i < nr_buckets; i++) {
+		struct jf_inode *inode = by_ino[i];
+
+		while (inode) {
+			struct jf_inode *next = inode->inext;
+
+			inode_free(inode);
+			inode = next;
+		}
+	}
+
+	free(by_name);
+	free(by_ino);
+	by_name = by_ino = NULL;
+	nr_buckets = nr_inodes = 0;
+}
+
+/* Returns a copy of the inode's path, to be free(3)'d, or NULL */
+char *jf_inode_path(uint64_t ino)
+{
+	struct jf_inode *inode;
+	char *path = NULL;
+
+	pthread_rwlock_rdlock(&inode_lock);
+	inode = inode_get(ino);
+	if (inode)
+		path = strdup(inode->path);
+	pthread_rwlock_unlock(&inode_lock);
+
+	return path;
+}
+
+/* Returns the path name would have under parent, to be free(3)'d, or NULL */
+char *jf_inode_child_path(uint64_t parent, const char *name)
+{
+	struct jf_inode *inode;
+	char *path = NULL;
+
+	pthread_rwlock_rdlock(&inode_lock);
+	inode = inode_get(parent);
+	if (inode)
+		path = inode_child_path(inode, name);
+	pthread_rwlock_unlock(&inode_lock);
+
+	return path;
+}
+
+/*
+ * Returns the inode number for name under parent, allocating one if need
+ * be, and takes a lookup reference on it. 0 if parent isn't known.
+ */
+uint64_t jf_inode_lookup(uint64_t parent, const char *name)
+{
+	struct jf_inode *inode;
+	struct jf_inode *pinode;
+	uint32_t hash = inode_hash(parent, name);
+	uint64_t ino = 0;
+
+	pthread_rwlock_wrlock(&inode_lock);
+	inode = inode_find(parent, name, hash);
+	if (inode)
+		goto out_ref;
+
+	pinode = inode_get(parent);
+	if (!pinode)
+		goto out_unlock;
+
+	if (nr_inodes >= nr_buckets)
+		inode_grow();
+
+	inode = calloc(1, sizeof(struct jf_inode));
+	inode->ino = next_ino++;
+	inode->parent = parent;
+	inode->path = inode_child_path(pinode, name);
+	inode->name = strrchr(inode->path, '/') + 1;
+	inode->hash = hash;
+	inode_insert(inode);
+	nr_inodes++;
+
+	dbg("ino %lu -> [%s]\n", inode->ino, inode->path);
+
+out_ref:
+	inode->nlookup++;
+	ino = inode->ino;
+out_unlock:
+	pthread_rwlock_unlock(&inode_lock);
+
+	return ino;
+}
+
+/* Like jf_inode_lookup() but doesn't allocate or take a reference */
+uint64_t jf_inode_find(uint64_t parent, const char *name)
+{
+	struct jf_inode *inode;
+	uint32_t hash = inode_hash(parent, name);
+	uint64_t ino = 0;
+
+	pthread_rwlock_rdlock(&inode_lock);
+	inode = inode_find(parent, name, hash);
+	if (inode)
+		ino = inode->ino;
+	pthread_rwlock_unlock(&inode_lock);
+
+	return ino;
+}
+
+/* The inode number of path if the kernel knows about it, or 0 */
+uint64_t jf_inode_find_path(const char *path)
+{
+	char *pathc = strdup(path);
+	char *sptr;
+	char *name;
+	uint64_t ino = JF_ROOT_INO;
+
+	for (name = strtok_r(pathc, "/", &sptr); name && ino;
+	     name = strtok_r(NULL, "/", &sptr))
+		ino = jf_inode_find(ino, name);
+
+	free(pathc);
+
+	return ino;
+}
+
+void jf_inode_forget(uint64_t ino, uint64_t nlookup)
+{
+	struct jf_inode *inode;
+	struct jf_inode **pp;
+
+	if (ino == JF_ROOT_INO)
+		return;
+
+	pthread_rwlock_wrlock(&inode_lock);
+	inode = inode_get(ino);
+	if (!inode)
+		goto out_unlock;
+
+	if (nlookup < inode->nlookup) {
+		inode->nlookup -= nlookup;
+		goto out_unlock;
+	}
+
+	for (pp = &by_name[inode->hash & (nr_buckets - 1)]; *pp != inode;
+	     pp = &(*pp)->hnext)
+		;
+	*pp = inode->hnext;
+	for (pp = &by_ino[ino_bucket(ino)]; *pp != inode; pp = &(*pp)->inext)
+		;
+	*pp = inode->inext;
+	nr_inodes--;
+
+	dbg("ino %lu forgotten [%s]\n", ino, inode->path);
+	inode_free(inode);
+
+out_unlock:
+	pthread_rwlock_unlock(&inode_lock);
+}
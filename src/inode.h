@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * inode.h - Inode numbers handed out to the kernel
+ *
+ * Copyright (c) 2021 - 2024	Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _INODE_H_
+#define _INODE_H_
+
+#include <stdint.h>
+
+/* Same as FUSE_ROOT_ID */
+#define JF_ROOT_INO		1
+
+void jf_inode_init(void);
+void jf_inode_destroy(void);
+char *jf_inode_path(uint64_t ino);
+char *jf_inode_child_path(uint64_t parent, const char *name);
+uint64_t jf_inode_lookup(uint64_t parent, const char *name);
+uint64_t jf_inode_find(uint64_t parent, const char *name);
+uint64_t jf_inode_find_path(const char *path);
+void jf_inode_forget(uint64_t ino, uint64_t nlookup);
+
+#endif /* _INODE_H_ */
@@ -0,0 +1,127 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * intern.c - Interned strings
+ *
+ * Copyright (c) 2021 - 2024	Andrew Clayton <andrew@digital-domain.net>
+ */
+
+/*
+ * Strings that turn up over and over again, i.e the handful of different
+ * content types, are only stored once. Interned strings live until
+ * jf_intern_destroy() so the pointers can be handed out freely. Nothing
+ * is ever removed, so it's not for anything that keeps on growing, like
+ * the names of things fetched from the API.
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "intern.h"
+
+#define INTERN_BUCKETS_MIN	1024
+
+struct intern_str {
+	struct intern_str *next;
+	uint32_t hash;
+	uint32_t len;
+	char str[];
+};
+
+static struct intern_str **buckets;
+static size_t nr_buckets;
+static size_t nr_strs;
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* FNV-1a */
+uint32_t jf_hash(const char *str, size_t len)
+{
+	uint32_t hash = 2166136261U;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)str[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static void intern_grow(void)
+{
+	size_t new_nr = nr_buckets ? nr_buckets * 2 : INTERN_BUCKETS_MIN;
+	struct intern_str **new;
+
+	new = calloc(new_nr, sizeof(struct intern_str *));
+	for (size_t i = 0; i < nr_buckets; i++) {
+		struct intern_str *is = buckets[i];
+
+		while (is) {
+			struct intern_str *next = is->next;
+			size_t b = is->hash & (new_nr - 1);
+
+			is->next = new[b];
+			new[b] = is;
+			is = next;
+		}
+	}
+
+	free(buckets);
+	buckets = new;
+	nr_buckets = new_nr;
+}
+
+/*
+ * Return the interned copy of the len bytes at str, hash being
+ * jf_hash() of them, adding it if need be.
+ */
+const char *jf_intern(const char *str, size_t len, uint32_t hash)
+{
+	struct intern_str *is;
+
+	pthread_mutex_lock(&intern_lock);
+	if (nr_strs >= nr_buckets)
+		intern_grow();
+
+	for (is = buckets[hash & (nr_buckets - 1)]; is; is = is->next) {
+		if (is->hash == hash && is->len == len &&
+		    memcmp(is->str, str, len) == 0)
+			goto out_unlock;
+	}
+
+	is = malloc(sizeof(struct intern_str) + len + 1);
+	is->hash = hash;
+	is->len = len;
+	memcpy(is->str, str, len);
+	is->str[len] = '\0';
+	is->next = buckets[hash & (nr_buckets - 1)];
+	buckets[hash & (nr_buckets - 1)] = is;
+	nr_strs++;
+
+out_unlock:
+	pthread_mutex_unlock(&intern_lock);
+
+	return is->str;
+}
+
+void jf_intern_destroy(void)
+{
+	for (size_t i = 0; i < nr_buckets; i++) {
+		struct intern_str *is = buckets[i];
+
+		while (is) {
+			struct intern_str *next = is->next;
+
+			free(is);
+			is = next;
+		}
+	}
+
+	free(buckets);
+	buckets = NULL;
+	nr_buckets = nr_strs = 0;
+}
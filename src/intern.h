@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * intern.h - Interned strings
+ *
+ * Copyright (c) 2021 - 2024	Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _INTERN_H_
+#define _INTERN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t jf_hash(const char *str, size_t len);
+const char *jf_intern(const char *str, size_t len, uint32_t hash);
+void jf_intern_destroy(void);
+
+#endif /* _INTERN_H_ */
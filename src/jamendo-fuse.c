@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -21,6 +22,10 @@
 #include <ctype.h>
 #include <limits.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <inttypes.h>
 
 #include <curl/curl.h>
 
@@ -29,65 +34,124 @@
 #include <libac.h>
 
 #define FUSE_USE_VERSION 31
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 
-#ifndef gettid
-#include <sys/syscall.h>
-#define gettid()        syscall(SYS_gettid)
-#endif
-
-#define FUSE_MAX_ARGS		8
+#include "jamendo-fuse.h"
+#include "cache.h"
+#include "headtail.h"
+#include "engine.h"
+#include "snapshot.h"
+#include "intern.h"
+#include "inode.h"
+#include "batch.h"
 
 #define DIR_NLINK_NR		2
 
 #define CLIENT_ID		client_id
 
-#define API_URL_MAX_LEN		256
+#define API_PAGE_SIZE		200
+#define API_PAGES_MAX		50
+#define API_PAGES_CONCURRENCY	4
 
-#define list_foreach(list)	for ( ; list; list = list->next)
+#define PROBE_CONCURRENCY_DEF	8
+#define HOST_CONCURRENCY_DEF	64
+#define BG_CONCURRENCY_DEF	4
+#define BG_RATE_DEF		(1024 * 1024)
+#define ENGINE_XFERS_MAX	4096
 
-#define __unused		__attribute__((unused))
+#define JF_SIZE_UNKNOWN		-1
 
-enum getopt_opt_val {
-	OPT_FULL = 0,
-};
+#define CURL_POOL_MAX		16
 
-static const struct option long_opts[] = {
-	{ "full",	no_argument,		NULL,	OPT_FULL },
-	{}
-};
+#define READ_BUF_SIZE		(128 * 1024)
+#define READ_MAX		(1024 * 1024)
 
-enum jf_dentry_type {
-	/*
-	 * The first four items here *Should* match the items in
-	 * jf_autocomplete_entity
-	 */
-	JF_DT_ARTIST = 0,
-	JF_DT_ALBUM,
-	JF_DT_TRACK,
-	JF_DT_TAG,
+#define STREAM_SKIP_MAX		(512 * 1024)
+#define STREAM_RETRIES		1
 
-	JF_DT_FORMAT,
+#define RA_BLOCK_SIZE		(64 * 1024)
+#define RA_WIN_MIN		(256 * 1024)
+#define RA_WIN_MAX		(8 * 1024 * 1024)
+#define RA_KEEP_BEHIND		(256 * 1024)
+#define RA_RING_SIZE		(RA_WIN_MAX + RA_KEEP_BEHIND + 2 * READ_BUF_SIZE)
+#define RA_NR_BLOCKS		(RA_RING_SIZE / RA_BLOCK_SIZE)
+#define RA_SECS			15
+#define RA_SEQ_MIN		2
 
-	JF_DT_TL_ARTISTS,
+#define PREFETCH_SIZE_DEF	(1024 * 1024)
+#define PREFETCH_AT_PCT		80
+#define PREFETCH_EXPIRE_SECS	(10 * 60)
 
-	JF_DT_TL_A,
-	JF_DT_TL_AA,
-	JF_DT_TL_AAA,
-};
+#define ALBUM_TABLES_MAX	64
+
+#define SPEC_BUDGET_DEF		(4 * 26)
+#define SPEC_BUDGET_SECS	60
+#define SPEC_CONCURRENCY	4
+
+#define JF_STATS_XATTR		"user.jamendo-fuse.stats"
+
+#define FSTREE_SHARDS		64
+#define FSTREE_BUCKETS_MIN	64
+#define FSTREE_ROOT_INO		1
+/* Rough cost of a node in a jfiles tree */
+#define FSTREE_NODE_BYTES	32
+
+#define JF_ENTRY_TIMEOUT	3600.0
+#define JF_ATTR_TIMEOUT		3600.0
+#define JF_UNKNOWN_INO		0xffffffff
+
+#define TTL_DAY			(24 * 60 * 60)
+#define SNAPSHOT_SECS		(10 * 60)
+#define REVAL_WAIT_SECS		10
 
-enum jf_autocomplete_entity {
-	JF_A_E_ARTIST = 0,
-	JF_A_E_ALBUM,
-	JF_A_E_TRACK,
-	JF_A_E_TAG,
+#define list_foreach(list)	for ( ; list; list = list->next)
+
+enum getopt_opt_val {
+	OPT_FULL = 0,
+	OPT_PROBE_CONCURRENCY,
+	OPT_LAZY_SIZE,
+	OPT_CACHE_SIZE,
+	OPT_CACHE_DIR,
+	OPT_SNAPSHOT,
+	OPT_SNAPSHOT_TTL,
+	OPT_META_SIZE,
+	OPT_TTL,
+	OPT_HOST_CONCURRENCY,
+	OPT_BG_CONCURRENCY,
+	OPT_BG_RATE,
+	OPT_READ_RATE,
+	OPT_PREFETCH,
+	OPT_HEADTAIL_SIZE,
+	OPT_HEADTAIL_FILL,
+	OPT_WARM_UP,
+	OPT_PREFIX_PREFETCH,
 };
 
-enum {
-	FMT_MP31 = 0,
-	FMT_MP32,
-	FMT_OGG,
-	FMT_FLAC,
+static const struct option long_opts[] = {
+	{ "full",		no_argument,		NULL,	OPT_FULL },
+	{ "probe-concurrency",	required_argument,	NULL,
+						OPT_PROBE_CONCURRENCY },
+	{ "lazy-size",		no_argument,		NULL,	OPT_LAZY_SIZE },
+	{ "cache-size",		required_argument,	NULL,	OPT_CACHE_SIZE },
+	{ "cache-dir",		required_argument,	NULL,	OPT_CACHE_DIR },
+	{ "snapshot",		no_argument,		NULL,	OPT_SNAPSHOT },
+	{ "snapshot-ttl",	required_argument,	NULL,	OPT_SNAPSHOT_TTL },
+	{ "meta-size",		required_argument,	NULL,	OPT_META_SIZE },
+	{ "ttl",		required_argument,	NULL,	OPT_TTL },
+	{ "host-concurrency",	required_argument,	NULL,
+						OPT_HOST_CONCURRENCY },
+	{ "bg-concurrency",	required_argument,	NULL,
+						OPT_BG_CONCURRENCY },
+	{ "bg-rate",		required_argument,	NULL,	OPT_BG_RATE },
+	{ "read-rate",		required_argument,	NULL,	OPT_READ_RATE },
+	{ "prefetch",		required_argument,	NULL,	OPT_PREFETCH },
+	{ "headtail-size",	required_argument,	NULL,
+						OPT_HEADTAIL_SIZE },
+	{ "headtail-fill",	no_argument,		NULL,	OPT_HEADTAIL_FILL },
+	{ "warm-up",		no_argument,		NULL,	OPT_WARM_UP },
+	{ "prefix-prefetch",	required_argument,	NULL,
+						OPT_PREFIX_PREFETCH },
+	{}
 };
 
 enum file_op {
@@ -97,41 +161,120 @@ enum file_op {
 };
 
 struct curl_buf {
+	CURL *curl;
 	char *buf;
 	size_t len;
 };
 
-struct jf_file {
-	char *orig_name;
-	char *name;
-	char *date;
-	mode_t mode;
-	nlink_t nlink;
+struct curl_rbuf {
+	CURL *curl;
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+/*
+ * Per open(2) state for reading a file. Rather than doing a range
+ * request per read(2), we do a single open ended one and keep reading
+ * from it for as long as the reads are sequential.
+ *
+ * The transfer is driven by the engine thread which puts the data
+ * into a ring of blocks holding the file data at [start, end). How far
+ * it's allowed to get ahead of the reader (rpos) is the window, which
+ * grows once we see sequential reads. When it gets there the transfer
+ * is paused until the reader catches up.
+ *
+ * All the fields are protected by lock, apart from curl which is only
+ * touched by the engine thread.
+ */
+struct jf_stream {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	char *url;
 	off_t size;
-	blkcnt_t blocks;
+	double bitrate;
 
-	char *id;
-	char *audio;
-	int audio_fmt;
-	char *content_type;
+	CURL *curl;
+	bool active;
+	bool done;
+	CURLcode result;
+
+	/* Requests to the engine thread, see ra_process_queue() */
+	bool restart;
+	bool unpause;
+	bool closing;
+	bool detached;
+	off_t restart_off;
+	bool paused;
+	bool ra_queued;
+	struct jf_stream *ra_next;
+
+	char *blocks[RA_NR_BLOCKS];
+	off_t start;
+	off_t end;
+	off_t rpos;
+	off_t want;
+	unsigned int seq;
+
+	double dl_rate;
+	size_t dl_bytes;
+	struct timespec dl_t0;
+	double cons_rate;
+	size_t cons_bytes;
+	struct timespec cons_t0;
+
+	struct jf_cache_file *cf;
+	uint32_t cache_next;
+
+	/* The track's directory, pinned while it's open */
+	struct dir_entry *dentry;
+	char *name;
+
+	/* Of the next track, see jf_prefetch_check() */
+	bool prefetched;
+	struct jf_prefetch *prefetch;
 };
 
-struct dir_entry {
-	char *path;
-	enum jf_dentry_type type;
-	enum jf_autocomplete_entity entity;
-	ac_btree_t *jfiles;
+/*
+ * The head of the next track being fetched into the block cache. All
+ * but buf/blen/blk/got (which belong to the transfer) are protected by
+ * prefetch_lock.
+ */
+struct jf_prefetch {
+	uint64_t id;
+	int audio_fmt;
+	off_t size;
+	off_t len;
+	time_t when;
+
+	CURL *curl;
+	struct jf_cache_file *cf;
+	char *buf;
+	size_t blen;
+	uint32_t blk;
+	off_t got;
+	off_t bytes;
+
+	bool cancel;
+	bool done;
+	bool claimed;
+	bool owned;
+
+	struct jf_prefetch *next;
 };
 
+/* kbps is a rough (upper) guess at the bitrate, for read-ahead */
 static const struct audio_fmt {
 	const int audio_fmt;
 	const char *name;
 	const char *ext;
+	const int kbps;
 } audio_fmts[] = {
-	{ FMT_MP31,	"mp31",		"mp3"	},
-	{ FMT_MP32,	"mp32",		"mp3"	},
-	{ FMT_OGG,	"ogg",		"oga"	},
-	{ FMT_FLAC,	"flac",		"flac"	},
+	{ FMT_MP31,	"mp31",		"mp3",	96	},
+	{ FMT_MP32,	"mp32",		"mp3",	320	},
+	{ FMT_OGG,	"ogg",		"oga",	256	},
+	{ FMT_FLAC,	"flac",		"flac",	1200	},
 };
 
 static const char * const jf_autocomplete_entities[] = {
@@ -141,41 +284,135 @@ static const char * const jf_autocomplete_entities[] = {
 	[JF_A_E_TAG]    = "tags",
 };
 
-static const char *client_id;
+const char *client_id;
 
 static size_t nr_root_items = DIR_NLINK_NR;
 
-static ac_btree_t *fstree;
+static long probe_concurrency = PROBE_CONCURRENCY_DEF;
+static long host_concurrency = HOST_CONCURRENCY_DEF;
+static long bg_concurrency = BG_CONCURRENCY_DEF;
+static long bg_rate = BG_RATE_DEF;
+static long read_rate;
+static off_t prefetch_size = PREFETCH_SIZE_DEF;
+static long spec_budget = SPEC_BUDGET_DEF;
+static bool lazy_size;
+static bool headtail_fill;
+static bool warm_up;
+
+/*
+ * Serialises publishing lazily resolved file info into a jf_file, taken
+ * by anything reading the audio URL, content type or blocks of a track
+ * whose size may not be known yet.
+ */
+pthread_mutex_t jf_file_info_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The fstree is indexed like inodes, each dir_entry has a number and is
+ * found by hashing its parent's number and its own name, so a path is
+ * looked up a component at a time from the root without needing to
+ * compare or copy whole paths.
+ *
+ * The hash table is split into shards, each with its own rwlock, so
+ * lookups only ever take a shared lock and inserts only hold up lookups
+ * in the same shard. Adding and evicting entries is serialised by
+ * fstree_add_lock, so a parent can't be evicted while a child is being
+ * added under it.
+ *
+ * With --meta-size, once the fstree goes over budget the least recently
+ * used dir_entry's with nothing under them are evicted, they're simply
+ * fetched again if they're wanted. Entries pinned by an open file (or a
+ * fetch of something under them) are left alone.
+ *
+ * Evicted dir_entry's (and jfiles swapped out on revalidation) may still
+ * be being looked at by other threads. Anything using the fstree does so
+ * between fstree_read_begin() and fstree_read_end(), which counts it in
+ * against the current epoch. To free what's been removed we move onto
+ * the next epoch and wait for the count against the previous one to
+ * drop to 0. So nobody stays in one over a network request, they pin
+ * what they need and leave it, looking things up again afterwards.
+ */
+static struct fstree_shard {
+	pthread_rwlock_t lock;
+	struct dir_entry **buckets;
+	size_t nr_buckets;
+	size_t nr;
+} __attribute__((aligned(64))) fstree[FSTREE_SHARDS];
+
+static struct dir_entry *fstree_root;
+static uint64_t fstree_next_ino = FSTREE_ROOT_INO + 1;
+static pthread_mutex_t fstree_add_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t fstree_bytes;
+static size_t fstree_nr;
+static uint64_t meta_size;
+
+static unsigned int fstree_epoch;
+static unsigned long fstree_readers[2];
+/* Removed from the fstree, waiting to be reclaimed */
+static ac_slist_t *retired_dentries;
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Waiting on the readers from before the last epoch change */
+static ac_slist_t *reclaim_dentries;
+
+/*
+ * How long a directory fetched from the API is good for, by what's in
+ * it. An artist gains albums as they release them, whereas an album's
+ * tracks hardly ever change. 0 means it's never fetched again.
+ */
+static long dentry_ttls[JF_DT_TL_AAA + 1] = {
+	[JF_DT_ARTIST]	= TTL_DAY,
+	[JF_DT_ALBUM]	= TTL_DAY / 4,
+	[JF_DT_TRACK]	= TTL_DAY * 7,
+	[JF_DT_TAG]	= TTL_DAY,
+};
+
+static const char * const dentry_ttl_names[] = {
+	[JF_DT_ARTIST]	= "artists",
+	[JF_DT_ALBUM]	= "albums",
+	[JF_DT_TRACK]	= "tracks",
+	[JF_DT_TAG]	= "tags",
+};
+
+static bool snapshot;
+static char snapshot_file[PATH_MAX];
+static uint32_t snapshot_flags;
+static bool snapshot_dirty;
 
-static bool debug;
+static struct fuse_session *jf_se;
 
-#define dbg(fmt, ...) \
-	do { \
-		if (!debug) \
-			break; \
-		fprintf(stdout, "[%5ld] %s: " fmt, gettid(), __func__, \
-			##__VA_ARGS__); \
-		fflush(stdout); \
-	} while (0)
+bool debug;
+
+struct jf_stats jf_stats;
+
+/* The jf_file's that go in a dir_entry are allocated from its arena */
+struct jf_file *new_jf_file(struct dir_entry *dentry)
+{
+	return jf_arena_alloc(dentry->arena, sizeof(struct jf_file));
+}
 
-static void free_jf_file(void *data)
+/* Only what isn't in the arena */
+void free_jf_file(void *data)
 {
 	struct jf_file *jfile = data;
 
 	if (!jfile)
 		return;
 
-	free(jfile->orig_name);
-	free(jfile->name);
-	free(jfile->id);
-	free(jfile->date);
 	free(jfile->audio);
-	free(jfile->content_type);
+}
+
+struct dir_entry *new_dentry(void)
+{
+	struct dir_entry *dentry;
 
-	free(jfile);
+	dentry = calloc(1, sizeof(struct dir_entry));
+	dentry->jfiles = ac_btree_new(compare_file_paths, free_jf_file);
+	dentry->arena = jf_arena_new();
+
+	return dentry;
 }
 
-static void free_dentry(void *data)
+void free_dentry(void *data)
 {
 	struct dir_entry *dentry = data;
 
@@ -183,6 +420,7 @@ static void free_dentry(void *data)
 		return;
 
 	ac_btree_destroy(dentry->jfiles);
+	jf_arena_free(dentry->arena);
 
 	free(dentry->path);
 	free(dentry);
@@ -216,7 +454,33 @@ static char *normalise_fname(char *name)
 	return name;
 }
 
-static int compare_file_paths(const void *a, const void *b)
+/* Jamendo ids are numbers sent as strings, 0 if there isn't one */
+uint64_t parse_id(const char *id)
+{
+	if (!id)
+		return 0;
+
+	return strtoull(id, NULL, 10);
+}
+
+/* As the API knows it, e.g audioformat=mp32 */
+const char *audio_fmt_name(int audio_fmt)
+{
+	return audio_fmts[audio_fmt].name;
+}
+
+/* Release dates are YYYY-MM-DD, 0 if there isn't one */
+static time_t parse_date(const char *date)
+{
+	struct tm tm = {};
+
+	if (!date || !strptime(date, "%F", &tm))
+		return 0;
+
+	return mktime(&tm);
+}
+
+int compare_file_paths(const void *a, const void *b)
 {
 	const struct jf_file *jfile1 = a;
 	const struct jf_file *jfile2 = b;
@@ -224,12 +488,10 @@ static int compare_file_paths(const void *a, const void *b)
 	return strcmp(jfile1->name, jfile2->name);
 }
 
-static int compare_dentry_paths(const void *a, const void *b)
+/* The jfiles of a dentry can be swapped out from under us */
+static ac_btree_t *dentry_jfiles(const struct dir_entry *dentry)
 {
-	const struct dir_entry *dentry1 = a;
-	const struct dir_entry *dentry2 = b;
-
-        return strcmp(dentry1->path, dentry2->path);
+	return __atomic_load_n(&dentry->jfiles, __ATOMIC_ACQUIRE);
 }
 
 static struct jf_file *lookup_jfile_from_dentry(const char *path,
@@ -242,685 +504,4561 @@ static struct jf_file *lookup_jfile_from_dentry(const char *path,
 
 	jfile.name = strrchr(path, '/') + 1;
 
-	return ac_btree_lookup(dentry->jfiles, &jfile);
+	return ac_btree_lookup(dentry_jfiles(dentry), &jfile);
 }
 
-static size_t header_cb(char *buffer, size_t size, size_t nitems,
-			void *userdata)
+static void fstree_count_jfile(const void *nodep __unused, VISIT which,
+			       void *data)
 {
-	struct jf_file *jf = userdata;
-	char *hdr_val;
-	char **ptr;
-	size_t ret = nitems * size;
+	size_t *nr = data;
 
-	if (strcasestr(buffer, "Location:"))
-		ptr = &jf->audio;
-	else
-		return ret;
+	switch (which) {
+	case preorder:
+	case endorder:
+		return;
+	case postorder:
+	case leaf:
+		(*nr)++;
+	}
+}
 
-	hdr_val = strchr(buffer, ' ');
-	if (!hdr_val)
-		return ret;
-	free(*ptr);
-	*ptr = strdup(ac_str_chomp(++hdr_val));
+static size_t jfiles_count(const ac_btree_t *jfiles)
+{
+	size_t nr = 0;
 
-	return ret;
+	ac_btree_foreach_data(jfiles, fstree_count_jfile, &nr);
+
+	return nr;
 }
 
-static int curl_get_file_info(struct jf_file *jf)
+/* Whether anything the kernel can see differs between two jfiles */
+static bool jfile_same(const struct jf_file *jfile1,
+		       const struct jf_file *jfile2)
 {
-	int ret = 0;
-	CURL *curl;
-	CURLcode res;
-	char *content_type;
+	/* A track's id is what its data is, directories' can be lazy */
+	return jfile1->mode == jfile2->mode &&
+	       (!S_ISREG(jfile1->mode) || jfile1->id == jfile2->id) &&
+	       __atomic_load_n(&jfile1->size, __ATOMIC_RELAXED) ==
+	       __atomic_load_n(&jfile2->size, __ATOMIC_RELAXED) &&
+	       jfile1->mtime == jfile2->mtime &&
+	       __atomic_load_n(&jfile1->nlink, __ATOMIC_RELAXED) ==
+	       __atomic_load_n(&jfile2->nlink, __ATOMIC_RELAXED);
+}
+
+/*
+ * When a directory is fetched again, whatever in it is still there keeps
+ * what we'd already found out about it (a track's size and URL, an
+ * artist's id, a directory's link count) rather than it being looked up
+ * again.
+ *
+ * Returns false if jfile is new or isn't the same thing as before.
+ */
+static bool jfile_carry_over(struct jf_file *jfile, const ac_btree_t *old)
+{
+	const struct jf_file *ojfile;
+	uint64_t id;
+	off_t size;
 
-	curl = curl_easy_init();
+	if (!old)
+		return false;
 
-	curl_easy_setopt(curl, CURLOPT_URL, jf->audio);
+	ojfile = ac_btree_lookup(old, jfile);
+	if (!ojfile)
+		return false;
 
-	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-	curl_easy_setopt(curl, CURLOPT_HEADERDATA, jf);
-        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_cb);
-	curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
-	curl_easy_setopt(curl, CURLOPT_USERAGENT, "jamendo-fuse / libcurl");
+	id = __atomic_load_n(&ojfile->id, __ATOMIC_ACQUIRE);
+	if (jfile->id && jfile->id != id)
+		return false;
+	if (jfile->mode != ojfile->mode || jfile->mtime != ojfile->mtime ||
+	    jfile->audio_fmt != ojfile->audio_fmt)
+		return false;
 
-	res = curl_easy_perform(curl);
-	if (res != CURLE_OK) {
-		dbg("curl_easy_perform(): %s\n", curl_easy_strerror(res));
-		ret = -1;
-		goto out_cleanup;
-	}
+	jfile->id = id;
+	if (!jfile->nlink)
+		jfile->nlink = __atomic_load_n(&ojfile->nlink,
+					       __ATOMIC_RELAXED);
 
-	curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &content_type);
-	jf->content_type = strdup(content_type);
-	curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &jf->size);
+	size = __atomic_load_n(&ojfile->size, __ATOMIC_ACQUIRE);
+	if (!S_ISREG(jfile->mode) || size == JF_SIZE_UNKNOWN)
+		return true;
 
-out_cleanup:
-	curl_easy_cleanup(curl);
+	/* Along with where the size probe was redirected to */
+	pthread_mutex_lock(&jf_file_info_lock);
+	free(jfile->audio);
+	jfile->audio = strdup(ojfile->audio);
+	pthread_mutex_unlock(&jf_file_info_lock);
 
-	return ret;
+	jfile->content_type = ojfile->content_type;
+	jfile->blocks = ojfile->blocks;
+	jfile->size = size;
+
+	return true;
 }
 
-static void set_files_format(const char *album_id, const char *path)
-{
-	struct dir_entry *dentry;
-	size_t n = sizeof(audio_fmts) / sizeof(audio_fmts[0]);
+struct jfiles_cmp {
+	const ac_btree_t *other;
+	bool same;
+};
 
-	dentry = calloc(1, sizeof(struct dir_entry));
-	dentry->jfiles = ac_btree_new(compare_file_paths, free_jf_file);
+static void jfiles_cmp_entry(const void *nodep, VISIT which, void *data)
+{
+	const struct jf_file *jfile = *(struct jf_file **)nodep;
+	struct jfiles_cmp *cmp = data;
+	const struct jf_file *other;
 
-	for (size_t i = 0; i < n; i++) {
-		struct jf_file *jf_file;
+	switch (which) {
+	case preorder:
+	case endorder:
+		return;
+	case postorder:
+	case leaf:
+		break;
+	}
 
-		jf_file = calloc(1, sizeof(struct jf_file));
-		jf_file->name = strdup(audio_fmts[i].name);
-		jf_file->mode = 0555 | S_IFDIR;
-		jf_file->nlink = DIR_NLINK_NR;
-		jf_file->id = strdup(album_id);
-		jf_file->audio_fmt = audio_fmts[i].audio_fmt;
+	if (!cmp->same)
+		return;
 
-		ac_btree_add(dentry->jfiles, jf_file);
-	}
-	dentry->path = strdup(path);
-	dentry->type = JF_DT_FORMAT;
-	ac_btree_add(fstree, dentry);
+	other = ac_btree_lookup(cmp->other, jfile);
+	if (!other || !jfile_same(jfile, other))
+		cmp->same = false;
 }
 
-static void set_files_tracks(const struct curl_buf *buf, const char *ext,
-			     const char *path)
+/* Whether a directory came back from the API just as it was */
+static bool jfiles_same(const ac_btree_t *old, const ac_btree_t *new)
 {
-	json_t *root;
-	json_t *results;
-	json_t *rdate;
-	json_t *tracks;
-	json_t *trks;
-	json_t *track;
-	size_t index;
-	struct dir_entry *dentry;
+	struct jfiles_cmp cmp = { .other = old, .same = true };
 
-	root = json_loads(buf->buf, 0, NULL);
-	results = json_object_get(root, "results");
-	trks = json_array_get(results, 0);
-	rdate = json_object_get(trks, "releasedate");
-	tracks = json_object_get(trks, "tracks");
+	if (jfiles_count(old) != jfiles_count(new))
+		return false;
 
-	dentry = calloc(1, sizeof(struct dir_entry));
-	dentry->jfiles = ac_btree_new(compare_file_paths, free_jf_file);
+	ac_btree_foreach_data(new, jfiles_cmp_entry, &cmp);
 
-	json_array_foreach(tracks, index, track) {
-		json_t *id;
-		json_t *name;
-		json_t *audio;
-		json_t *pos;
-		int len;
-		struct jf_file *jf_file;
+	return cmp.same;
+}
 
-		id = json_object_get(track, "id");
-		name = json_object_get(track, "name");
-		audio = json_object_get(track, "audio");
-		pos = json_object_get(track, "position");
+int mkdir_p(const char *dir)
+{
+	char path[PATH_MAX];
+	char *ptr;
 
-		jf_file = calloc(1, sizeof(struct jf_file));
+	snprintf(path, sizeof(path), "%s", dir);
+	for (ptr = path + 1; *ptr; ptr++) {
+		if (*ptr != '/')
+			continue;
+		*ptr = '\0';
+		if (mkdir(path, 0700) == -1 && errno != EEXIST)
+			return -1;
+		*ptr = '/';
+	}
+	if (mkdir(path, 0700) == -1 && errno != EEXIST)
+		return -1;
 
-		len = asprintf(&jf_file->name, "%02d_-_%s.%s",
-			       atoi(json_string_value(pos)),
-			       json_string_value(name), ext);
-		if (len == -1) { /* shut GCC up [-Wunused-result] */
-			dbg("asprintf() failed!\n");
-			jf_file->name = NULL;
-		}
+	return 0;
+}
 
-		normalise_fname(jf_file->name);
-		jf_file->mode = 0444 | S_IFREG;
-		jf_file->date = strdup(json_string_value(rdate));
-		jf_file->id = strdup(json_string_value(id));
-		jf_file->audio = strdup(json_string_value(audio));
+static void fstree_init(void)
+{
+	for (int i = 0; i < FSTREE_SHARDS; i++) {
+		pthread_rwlock_init(&fstree[i].lock, NULL);
+		fstree[i].nr_buckets = FSTREE_BUCKETS_MIN;
+		fstree[i].buckets = calloc(FSTREE_BUCKETS_MIN,
+					   sizeof(struct dir_entry *));
+	}
+}
 
-		curl_get_file_info(jf_file);
-		jf_file->blocks = (jf_file->size / 512) +
-				  (jf_file->size % 512 == 0 ? 0 : 1);
+static void fstree_destroy(void)
+{
+	for (int i = 0; i < FSTREE_SHARDS; i++) {
+		struct fstree_shard *shard = &fstree[i];
 
-		ac_btree_add(dentry->jfiles, jf_file);
+		for (size_t b = 0; b < shard->nr_buckets; b++) {
+			struct dir_entry *dentry = shard->buckets[b];
+
+			while (dentry) {
+				struct dir_entry *next = dentry->hnext;
+
+				free_dentry(dentry);
+				dentry = next;
+			}
+		}
+		free(shard->buckets);
+		pthread_rwlock_destroy(&shard->lock);
 	}
-	dentry->path = strdup(path);
-	dentry->type = JF_DT_TRACK;
-	ac_btree_add(fstree, dentry);
 
-	json_decref(root);
+	free_dentry(fstree_root);
+	jf_intern_destroy();
 }
 
-static void set_files_album(const struct curl_buf *buf, const char *path,
-			    const struct dir_entry *prev_dir)
+static uint32_t fstree_hash(uint64_t parent_ino, uint32_t name_hash)
 {
-	json_t *root;
-	json_t *albums;
-	json_t *album;
-	size_t index;
-	struct jf_file *jfile;
-	struct dir_entry *dentry;
-	static const size_t nfmts = sizeof(audio_fmts) / sizeof(audio_fmts[0]);
+	return name_hash ^ (uint32_t)(parent_ino * 2654435761U);
+}
 
-	root = json_loads(buf->buf, 0, NULL);
-	albums = json_object_get(root, "results");
+static struct fstree_shard *fstree_shard(uint32_t hash)
+{
+	return &fstree[hash % FSTREE_SHARDS];
+}
 
-	dentry = calloc(1, sizeof(struct dir_entry));
-	dentry->jfiles = ac_btree_new(compare_file_paths, free_jf_file);
+static struct dir_entry **fstree_bucket(const struct fstree_shard *shard,
+					uint32_t hash)
+{
+	return &shard->buckets[(hash / FSTREE_SHARDS) &
+			       (shard->nr_buckets - 1)];
+}
 
-	json_array_foreach(albums, index, album) {
-		json_t *id;
-		json_t *name;
-		json_t *date;
-		struct jf_file *jf_file;
+/* Called with the shard lock held */
+static struct dir_entry *fstree_find(const struct fstree_shard *shard,
+				     const struct dir_entry *parent,
+				     const char *name, size_t len,
+				     uint32_t hash)
+{
+	struct dir_entry *dentry = *fstree_bucket(shard, hash);
 
-		id = json_object_get(album, "id");
-		name = json_object_get(album, "name");
-		date = json_object_get(album, "releasedate");
+	for ( ; dentry; dentry = dentry->hnext) {
+		if (dentry->hash == hash && dentry->parent == parent &&
+		    dentry->name_len == len &&
+		    memcmp(dentry->name, name, len) == 0)
+			return dentry;
+	}
 
-		jf_file = calloc(1, sizeof(struct jf_file));
-		jf_file->name = strdup(json_string_value(name));
-		normalise_fname(jf_file->name);
-		jf_file->date = strdup(json_string_value(date));
-		jf_file->mode = 0555 | S_IFDIR;
-		jf_file->nlink = DIR_NLINK_NR + nfmts;
-		jf_file->id = strdup(json_string_value(id));
+	return NULL;
+}
 
-		ac_btree_add(dentry->jfiles, jf_file);
-	}
-	dentry->path = strdup(path);
-	dentry->type = JF_DT_ALBUM;
-	ac_btree_add(fstree, dentry);
+/* Called with the shard write lock held */
+static void fstree_grow(struct fstree_shard *shard)
+{
+	struct dir_entry **old = shard->buckets;
+	size_t old_nr = shard->nr_buckets;
 
-	jfile = lookup_jfile_from_dentry(path, prev_dir);
-	if (jfile)
-		jfile->nlink = DIR_NLINK_NR + index;
+	shard->nr_buckets *= 2;
+	shard->buckets = calloc(shard->nr_buckets, sizeof(struct dir_entry *));
 
-	json_decref(root);
+	for (size_t i = 0; i < old_nr; i++) {
+		struct dir_entry *dentry = old[i];
+
+		while (dentry) {
+			struct dir_entry *next = dentry->hnext;
+			struct dir_entry **bucket;
+
+			bucket = fstree_bucket(shard, dentry->hash);
+			dentry->hnext = *bucket;
+			*bucket = dentry;
+			dentry = next;
+		}
+	}
+	free(old);
 }
 
-static void set_file_entity(const struct curl_buf *buf, const char *path,
-			    const struct dir_entry *prev_dir)
+static struct dir_entry *fstree_child(const struct dir_entry *parent,
+				      const char *name, size_t len)
 {
+	struct fstree_shard *shard;
+	struct dir_entry *dentry;
+	uint32_t hash;
+
+	hash = fstree_hash(parent->ino, jf_hash(name, len));
+	shard = fstree_shard(hash);
+
+	pthread_rwlock_rdlock(&shard->lock);
+	dentry = fstree_find(shard, parent, name, len, hash);
+	pthread_rwlock_unlock(&shard->lock);
+
+	return dentry;
+}
+
+/*
+ * Walk down the fstree from the root following the first len bytes of
+ * path, returning the deepest dentry we got to. *rest is left pointing
+ * at the part of the path we couldn't follow, path + len if we got all
+ * the way.
+ */
+static struct dir_entry *fstree_walk(const char *path, size_t len,
+				     const char **rest)
+{
+	struct dir_entry *dentry = fstree_root;
+	const char *end = path + len;
+	const char *ptr = path;
+
+	while (ptr < end) {
+		struct dir_entry *child;
+		const char *name;
+
+		if (*ptr == '/') {
+			ptr++;
+			continue;
+		}
+
+		name = ptr;
+		while (ptr < end && *ptr != '/')
+			ptr++;
+
+		child = fstree_child(dentry, name, ptr - name);
+		if (!child) {
+			ptr = name;
+			break;
+		}
+		dentry = child;
+	}
+	*rest = ptr;
+
+	return dentry;
+}
+
+static struct dir_entry *fstree_lookup(const char *path)
+{
+	struct dir_entry *dentry;
+	const char *rest;
+
+	dentry = fstree_walk(path, strlen(path), &rest);
+	if (*rest)
+		return NULL;
+
+	return dentry;
+}
+
+/* What's in path now, if we're fetching it again */
+static const ac_btree_t *fstree_old_jfiles(const char *path)
+{
+	const struct dir_entry *dentry = fstree_lookup(path);
+
+	return dentry ? dentry_jfiles(dentry) : NULL;
+}
+
+static unsigned int fstree_read_begin(void)
+{
+	unsigned int epoch;
+
+	for (;;) {
+		epoch = __atomic_load_n(&fstree_epoch, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&fstree_readers[epoch & 1], 1,
+				   __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&fstree_epoch, __ATOMIC_SEQ_CST) == epoch)
+			return epoch;
+		/* Raced with the epoch changing, count us in the new one */
+		__atomic_sub_fetch(&fstree_readers[epoch & 1], 1,
+				   __ATOMIC_SEQ_CST);
+	}
+}
+
+static void fstree_read_end(unsigned int epoch)
+{
+	__atomic_sub_fetch(&fstree_readers[epoch & 1], 1, __ATOMIC_RELEASE);
+}
+
+/* dentry has been removed from the fstree, free it once it's safe to */
+static void fstree_retire(struct dir_entry *dentry)
+{
+	pthread_mutex_lock(&retired_lock);
+	ac_slist_preadd(&retired_dentries, dentry);
+	pthread_mutex_unlock(&retired_lock);
+}
+
+/*
+ * Free what was retired before the last epoch change if everyone from
+ * then has finished, then move onto the next epoch for anything retired
+ * since. Only called from the revalidation thread.
+ */
+static void fstree_reclaim(void)
+{
+	unsigned int epoch = __atomic_load_n(&fstree_epoch, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&fstree_readers[(epoch - 1) & 1],
+			    __ATOMIC_ACQUIRE) != 0)
+		return;
+
+	ac_slist_destroy(&reclaim_dentries, free_dentry);
+
+	pthread_mutex_lock(&retired_lock);
+	reclaim_dentries = retired_dentries;
+	retired_dentries = NULL;
+	pthread_mutex_unlock(&retired_lock);
+
+	if (reclaim_dentries)
+		__atomic_add_fetch(&fstree_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Stop dentry from being evicted, fails if it already has been. Pinning
+ * and eviction each set their flag then check the other's, so one of
+ * them always backs off.
+ */
+static bool fstree_pin(struct dir_entry *dentry)
+{
+	__atomic_add_fetch(&dentry->pins, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&dentry->evicted, __ATOMIC_SEQ_CST))
+		return true;
+
+	__atomic_sub_fetch(&dentry->pins, 1, __ATOMIC_SEQ_CST);
+
+	return false;
+}
+
+static void fstree_unpin(struct dir_entry *dentry)
+{
+	__atomic_sub_fetch(&dentry->pins, 1, __ATOMIC_SEQ_CST);
+}
+
+static void fstree_touch(struct dir_entry *dentry)
+{
+	time_t now = time(NULL);
+
+	/* Save dirtying the cacheline when we can */
+	if (__atomic_load_n(&dentry->used, __ATOMIC_RELAXED) != now)
+		__atomic_store_n(&dentry->used, now, __ATOMIC_RELAXED);
+}
+
+static void dentry_count_bytes(const void *nodep, VISIT which, void *data)
+{
+	const struct jf_file *jfile = *(struct jf_file **)nodep;
+	size_t *bytes = data;
+
+	switch (which) {
+	case preorder:
+	case endorder:
+		return;
+	case postorder:
+	case leaf:
+		*bytes += FSTREE_NODE_BYTES;
+		if (jfile->audio)
+			*bytes += strlen(jfile->audio) + 1;
+	}
+}
+
+/* Roughly how much memory dentry is using */
+static size_t dentry_bytes(const struct dir_entry *dentry)
+{
+	size_t bytes = sizeof(struct dir_entry) + strlen(dentry->path) + 1;
+
+	bytes += jf_arena_size(dentry->arena);
+	ac_btree_foreach_data(dentry->jfiles, dentry_count_bytes, &bytes);
+
+	return bytes;
+}
+
+/*
+ * Add a dentry we've just built to the fstree. If there's already one
+ * for this path (we're revalidating it) it gets the new contents, its
+ * old jfiles are retired as other threads may still be looking at them.
+ * Unless nothing has changed, in which case it's left as it is.
+ */
+static void fstree_add(struct dir_entry *dentry)
+{
+	struct fstree_shard *shard;
+	struct dir_entry *parent;
+	struct dir_entry *old;
+	struct dir_entry *retired;
+	const char *name;
+	const char *rest;
+	size_t plen;
+	uint32_t name_hash;
+
+	if (strcmp(dentry->path, "/") == 0) {
+		if (fstree_root) {
+			free_dentry(dentry);
+			return;
+		}
+		dentry->ino = FSTREE_ROOT_INO;
+		fstree_root = dentry;
+		return;
+	}
+
+	dentry->bytes = dentry_bytes(dentry);
+	dentry->used = time(NULL);
+
+	pthread_mutex_lock(&fstree_add_lock);
+
+	name = strrchr(dentry->path, '/') + 1;
+	plen = name - 1 - dentry->path;
+	parent = fstree_walk(dentry->path, plen, &rest);
+	if (rest != dentry->path + plen) {
+		pthread_mutex_unlock(&fstree_add_lock);
+		dbg("no parent for [%s]\n", dentry->path);
+		free_dentry(dentry);
+		return;
+	}
+
+	dentry->name_len = strlen(name);
+	name_hash = jf_hash(name, dentry->name_len);
+	dentry->parent = parent;
+	dentry->hash = fstree_hash(parent->ino, name_hash);
+	shard = fstree_shard(dentry->hash);
+
+	pthread_rwlock_wrlock(&shard->lock);
+	old = fstree_find(shard, parent, name, dentry->name_len,
+			  dentry->hash);
+	if (!old) {
+		struct dir_entry **bucket;
+
+		/* Part of its path, so it goes with it and is counted */
+		dentry->name = name;
+		dentry->ino = __atomic_fetch_add(&fstree_next_ino, 1,
+						 __ATOMIC_RELAXED);
+		if (++shard->nr > shard->nr_buckets)
+			fstree_grow(shard);
+		bucket = fstree_bucket(shard, dentry->hash);
+		dentry->hnext = *bucket;
+		*bucket = dentry;
+		pthread_rwlock_unlock(&shard->lock);
+
+		parent->nr_children++;
+		__atomic_add_fetch(&fstree_bytes, dentry->bytes,
+				   __ATOMIC_RELAXED);
+		__atomic_add_fetch(&fstree_nr, 1, __ATOMIC_RELAXED);
+		goto out_dirty;
+	}
+
+	if (jfiles_same(old->jfiles, dentry->jfiles)) {
+		__atomic_store_n(&old->fetched, dentry->fetched,
+				 __ATOMIC_RELAXED);
+		__atomic_store_n(&old->reval_queued, false, __ATOMIC_RELEASE);
+		pthread_rwlock_unlock(&shard->lock);
+
+		jf_stats_inc(refreshes_unchanged);
+		free_dentry(dentry);
+		goto out_dirty;
+	}
+
+	retired = calloc(1, sizeof(struct dir_entry));
+	retired->jfiles = old->jfiles;
+	retired->arena = old->arena;
+	fstree_retire(retired);
+
+	__atomic_store_n(&old->jfiles, dentry->jfiles, __ATOMIC_RELEASE);
+	old->arena = dentry->arena;
+	__atomic_store_n(&old->fetched, dentry->fetched, __ATOMIC_RELAXED);
+	__atomic_store_n(&old->reval_queued, false, __ATOMIC_RELEASE);
+	pthread_rwlock_unlock(&shard->lock);
+
+	__atomic_add_fetch(&fstree_bytes, dentry->bytes - old->bytes,
+			   __ATOMIC_RELAXED);
+	old->bytes = dentry->bytes;
+
+	free(dentry->path);
+	free(dentry);
+
+out_dirty:
+	pthread_mutex_unlock(&fstree_add_lock);
+	__atomic_store_n(&snapshot_dirty, true, __ATOMIC_RELAXED);
+}
+
+static int compare_evict_used(const void *a, const void *b)
+{
+	const struct dir_entry *d1 = *(struct dir_entry **)a;
+	const struct dir_entry *d2 = *(struct dir_entry **)b;
+	time_t u1 = __atomic_load_n(&d1->used, __ATOMIC_RELAXED);
+	time_t u2 = __atomic_load_n(&d2->used, __ATOMIC_RELAXED);
+
+	return (u1 > u2) - (u1 < u2);
+}
+
+/* Remove dentry from the fstree, called with its shard write locked */
+static void fstree_unlink(struct fstree_shard *shard,
+			  struct dir_entry *dentry)
+{
+	struct dir_entry **pp = fstree_bucket(shard, dentry->hash);
+
+	while (*pp != dentry)
+		pp = &(*pp)->hnext;
+	*pp = dentry->hnext;
+	shard->nr--;
+}
+
+/*
+ * If we're over --meta-size, evict least recently used dentries, that
+ * have nothing under them, until we're at 90% of it.
+ */
+static void fstree_evict(void)
+{
+	struct dir_entry **victims = NULL;
+	size_t nr_victims = 0;
+	size_t alloc = 0;
+	size_t target;
+
+	if (!meta_size ||
+	    __atomic_load_n(&fstree_bytes, __ATOMIC_RELAXED) <= meta_size)
+		return;
+
+	target = meta_size / 10 * 9;
+
+	pthread_mutex_lock(&fstree_add_lock);
+	for (int i = 0; i < FSTREE_SHARDS; i++) {
+		struct fstree_shard *shard = &fstree[i];
+
+		pthread_rwlock_rdlock(&shard->lock);
+		for (size_t b = 0; b < shard->nr_buckets; b++) {
+			struct dir_entry *dentry = shard->buckets[b];
+
+			for ( ; dentry; dentry = dentry->hnext) {
+				if (dentry->nr_children ||
+				    __atomic_load_n(&dentry->pins,
+						    __ATOMIC_RELAXED))
+					continue;
+
+				if (nr_victims == alloc) {
+					alloc = alloc ? alloc * 2 : 256;
+					victims = realloc(victims, alloc *
+						sizeof(struct dir_entry *));
+				}
+				victims[nr_victims++] = dentry;
+			}
+		}
+		pthread_rwlock_unlock(&shard->lock);
+	}
+
+	qsort(victims, nr_victims, sizeof(struct dir_entry *),
+	      compare_evict_used);
+
+	for (size_t i = 0; i < nr_victims &&
+	     __atomic_load_n(&fstree_bytes, __ATOMIC_RELAXED) > target; i++) {
+		struct dir_entry *dentry = victims[i];
+		struct fstree_shard *shard = fstree_shard(dentry->hash);
+
+		pthread_rwlock_wrlock(&shard->lock);
+		__atomic_store_n(&dentry->evicted, true, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&dentry->pins, __ATOMIC_SEQ_CST)) {
+			__atomic_store_n(&dentry->evicted, false,
+					 __ATOMIC_SEQ_CST);
+			pthread_rwlock_unlock(&shard->lock);
+			continue;
+		}
+		fstree_unlink(shard, dentry);
+		pthread_rwlock_unlock(&shard->lock);
+
+		dbg("evicting [%s] (%zu bytes)\n", dentry->path,
+		    dentry->bytes);
+
+		dentry->parent->nr_children--;
+		__atomic_sub_fetch(&fstree_bytes, dentry->bytes,
+				   __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&fstree_nr, 1, __ATOMIC_RELAXED);
+		jf_stats_inc(meta_evictions);
+		fstree_retire(dentry);
+	}
+	pthread_mutex_unlock(&fstree_add_lock);
+
+	free(victims);
+}
+
+static int jf_stats_fmt(char *buf, size_t len)
+{
+	return snprintf(buf, len,
+			"api_requests: %lu\n"
+			"probe_requests: %lu\n"
+			"read_requests: %lu\n"
+			"reused_connections: %lu\n"
+			"readahead_hits: %lu\n"
+			"readahead_misses: %lu\n"
+			"cache_hits: %lu\n"
+			"cache_misses: %lu\n"
+			"cache_evictions: %lu\n"
+			"cache_bytes: %lu\n"
+			"shared_fetches: %lu\n"
+			"meta_bytes: %zu\n"
+			"meta_entries: %zu\n"
+			"meta_evictions: %lu\n"
+			"refreshes: %lu\n"
+			"refreshes_unchanged: %lu\n"
+			"prefetches: %lu\n"
+			"prefetch_useful_bytes: %lu\n"
+			"prefetch_wasted_bytes: %lu\n"
+			"headtail_hits: %lu\n"
+			"headtail_misses: %lu\n"
+			"headtail_bytes: %lu\n"
+			"batched_lookups: %lu\n"
+			"speculative_fetches: %lu\n",
+			jf_stats_get(api_reqs), jf_stats_get(probe_reqs),
+			jf_stats_get(read_reqs), jf_stats_get(reused_conns),
+			jf_stats_get(ra_hits), jf_stats_get(ra_misses),
+			jf_stats_get(cache_hits), jf_stats_get(cache_misses),
+			jf_stats_get(cache_evictions), jf_cache_used(),
+			jf_stats_get(shared_fetches),
+			__atomic_load_n(&fstree_bytes, __ATOMIC_RELAXED),
+			__atomic_load_n(&fstree_nr, __ATOMIC_RELAXED),
+			jf_stats_get(meta_evictions), jf_stats_get(refreshes),
+			jf_stats_get(refreshes_unchanged),
+			jf_stats_get(prefetches), jf_stats_get(prefetch_useful),
+			jf_stats_get(prefetch_wasted),
+			jf_stats_get(headtail_hits),
+			jf_stats_get(headtail_misses), jf_headtail_used(),
+			jf_stats_get(batched_lookups),
+			jf_stats_get(spec_fetches));
+}
+
+/*
+ * The priority API requests and size probes are made at, background
+ * threads lower it for theirs so they don't get in the way of anyone
+ * waiting on a listing.
+ */
+__thread enum jf_engine_prio api_prio = JF_PRIO_META;
+
+/*
+ * Background threads can point this at their exit flag, so a listing
+ * they're fetching is given up on between pages once it's set.
+ */
+static __thread const bool *api_stop;
+
+static bool api_stopped(void)
+{
+	return api_stop && __atomic_load_n(api_stop, __ATOMIC_RELAXED);
+}
+
+/*
+ * Easy handles for the engine to run.
+ *
+ * The share handle gives every easy handle a common DNS cache and TLS
+ * session cache (so new connections can do an abbreviated handshake).
+ * Connections themselves are kept in the engine's multi handle and
+ * shared by all its transfers, idle easy handles are just kept in a
+ * pool to save setting them up again.
+ */
+static CURLSH *curl_share;
+static pthread_mutex_t curl_share_locks[CURL_LOCK_DATA_LAST];
+
+static CURL *curl_pool[CURL_POOL_MAX];
+static int curl_pool_nr;
+static pthread_mutex_t curl_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void curl_share_lock_cb(CURL *curl __unused, curl_lock_data data,
+			    curl_lock_access access __unused,
+			    void *userptr __unused)
+{
+	pthread_mutex_lock(&curl_share_locks[data]);
+}
+
+static void curl_share_unlock_cb(CURL *curl __unused, curl_lock_data data,
+			      void *userptr __unused)
+{
+	pthread_mutex_unlock(&curl_share_locks[data]);
+}
+
+static void curl_pool_init(void)
+{
+	for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		pthread_mutex_init(&curl_share_locks[i], NULL);
+
+	curl_share = curl_share_init();
+	curl_share_setopt(curl_share, CURLSHOPT_LOCKFUNC, curl_share_lock_cb);
+	curl_share_setopt(curl_share, CURLSHOPT_UNLOCKFUNC,
+			  curl_share_unlock_cb);
+	curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(curl_share, CURLSHOPT_SHARE,
+			  CURL_LOCK_DATA_SSL_SESSION);
+}
+
+static void curl_setopt_common(CURL *curl)
+{
+	curl_easy_setopt(curl, CURLOPT_SHARE, curl_share);
+	curl_easy_setopt(curl, CURLOPT_USERAGENT, "jamendo-fuse / libcurl");
+
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, 60L);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, 30L);
+	curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 300L);
+}
+
+CURL *curl_pool_get(void)
+{
+	CURL *curl = NULL;
+
+	pthread_mutex_lock(&curl_pool_lock);
+	if (curl_pool_nr > 0)
+		curl = curl_pool[--curl_pool_nr];
+	pthread_mutex_unlock(&curl_pool_lock);
+
+	if (!curl) {
+		curl = curl_easy_init();
+		dbg("CURL created new pool handle @ %p\n", curl);
+	}
+	curl_setopt_common(curl);
+
+	return curl;
+}
+
+static void curl_stats_conn(CURL *curl)
+{
+	long nr_conns = 0;
+
+	/* A transfer that didn't need to create a connection re-used one */
+	curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &nr_conns);
+	if (nr_conns == 0)
+		jf_stats_inc(reused_conns);
+}
+
+void curl_pool_put(CURL *curl)
+{
+	/* Clears the options, ready for the next user */
+	curl_easy_reset(curl);
+
+	pthread_mutex_lock(&curl_pool_lock);
+	if (curl_pool_nr < CURL_POOL_MAX) {
+		curl_pool[curl_pool_nr++] = curl;
+		curl = NULL;
+	}
+	pthread_mutex_unlock(&curl_pool_lock);
+
+	curl_easy_cleanup(curl);
+}
+
+static void curl_pool_destroy(void)
+{
+	while (curl_pool_nr > 0)
+		curl_easy_cleanup(curl_pool[--curl_pool_nr]);
+
+	curl_share_cleanup(curl_share);
+	for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		pthread_mutex_destroy(&curl_share_locks[i]);
+}
+
+static size_t header_cb(char *buffer, size_t size, size_t nitems,
+			void *userdata)
+{
+	struct jf_file *jf = userdata;
+	char *hdr_val;
+	char **ptr;
+	size_t ret = nitems * size;
+
+	if (strcasestr(buffer, "Location:"))
+		ptr = &jf->audio;
+	else
+		return ret;
+
+	hdr_val = strchr(buffer, ' ');
+	if (!hdr_val)
+		return ret;
+	free(*ptr);
+	*ptr = strdup(ac_str_chomp(++hdr_val));
+
+	return ret;
+}
+
+static CURL *curl_file_info_init(struct jf_file *jf)
+{
+	CURL *curl;
+
+	curl = curl_pool_get();
+
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, jf);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_cb);
+	curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+
+	jf_stats_inc(probe_reqs);
+
+	return curl;
+}
+
+static void curl_file_info_set(CURL *curl, struct jf_file *jf)
+{
+	char *content_type = NULL;
+
+	curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &content_type);
+	if (content_type) {
+		size_t len = strlen(content_type);
+
+		jf->content_type = jf_intern(content_type, len,
+					     jf_hash(content_type, len));
+	}
+	curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &jf->size);
+	if (jf->size < 0)
+		jf->size = 0;
+	jf->blocks = (jf->size / 512) + (jf->size % 512 == 0 ? 0 : 1);
+}
+
+/*
+ * Fetch the size/content-type of a bunch of files concurrently.
+ *
+ * Doing a HEAD per track serially means listing an album directory
+ * costs the sum of all the round trips (plus TLS handshakes). Hand
+ * them to the engine instead, with at most probe_concurrency of them
+ * submitted at a time, so it costs roughly the slowest one.
+ *
+ * We return once every probe has either completed or failed, failed
+ * ones are just left with a zero size as before.
+ */
+struct probe_batch {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	long active;
+	size_t done;
+};
+
+struct probe {
+	struct probe_batch *batch;
+	struct jf_file *jf;
+};
+
+static void probe_done(CURL *curl, CURLcode res, void *data)
+{
+	struct probe *probe = data;
+	struct probe_batch *batch = probe->batch;
+
+	curl_stats_conn(curl);
+	if (res == CURLE_OK)
+		curl_file_info_set(curl, probe->jf);
+	else
+		dbg("probe [%s]: %s\n", probe->jf->name,
+		    curl_easy_strerror(res));
+	curl_pool_put(curl);
+
+	pthread_mutex_lock(&batch->lock);
+	batch->active--;
+	batch->done++;
+	pthread_cond_signal(&batch->cond);
+	pthread_mutex_unlock(&batch->lock);
+}
+
+static void curl_get_files_info(struct jf_file **jfiles, size_t nr)
+{
+	struct probe_batch batch = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	struct probe *probes;
+	size_t next = 0;
+	struct timespec start;
+	struct timespec end;
+
+	if (nr == 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	probes = calloc(nr, sizeof(struct probe));
+
+	pthread_mutex_lock(&batch.lock);
+	while (batch.done < nr) {
+		while (next < nr && batch.active < probe_concurrency) {
+			CURL *curl = curl_file_info_init(jfiles[next]);
+
+			probes[next].batch = &batch;
+			probes[next].jf = jfiles[next];
+			batch.active++;
+
+			pthread_mutex_unlock(&batch.lock);
+			jf_engine_submit(curl, jfiles[next]->audio, api_prio,
+					 probe_done, &probes[next]);
+			pthread_mutex_lock(&batch.lock);
+			next++;
+		}
+
+		if (batch.done < nr)
+			pthread_cond_wait(&batch.cond, &batch.lock);
+	}
+	pthread_mutex_unlock(&batch.lock);
+
+	pthread_mutex_destroy(&batch.lock);
+	pthread_cond_destroy(&batch.cond);
+	free(probes);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	dbg("probed %zu files in %.3fs (concurrency %ld)\n", nr,
+	    (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9, probe_concurrency);
+}
+
+/*
+ * In --lazy-size mode tracks are added with a size of JF_SIZE_UNKNOWN
+ * and we only do the HEAD request the first time the size is actually
+ * needed (stat(2) or open(2)), the result is then kept in the jf_file.
+ *
+ * The probe is done against a copy so we don't hold the lock over the
+ * network request, if two threads race, the first one to finish wins.
+ *
+ * jf is path's entry in dentry, looked up in the read section begun as
+ * *epoch. We leave that over the request, so return path's entry as it
+ * is afterwards (dentry may have been fetched again meanwhile), NULL if
+ * it's gone or we couldn't get its size.
+ */
+static struct jf_file *jf_file_resolve_size(const char *path,
+					    struct dir_entry *dentry,
+					    struct jf_file *jf,
+					    unsigned int *epoch)
+{
+	struct jf_file tmp = {};
+	CURL *curl;
+	CURLcode res;
+	bool pinned;
+
+	if (__atomic_load_n(&jf->size, __ATOMIC_ACQUIRE) != JF_SIZE_UNKNOWN)
+		return jf;
+
+	pthread_mutex_lock(&jf_file_info_lock);
+	tmp.audio = strdup(jf->audio);
+	pthread_mutex_unlock(&jf_file_info_lock);
+
+	dbg("resolving size of [%s]\n", path);
+
+	/* If it's being evicted we can't let go of it, it's rare enough */
+	pinned = fstree_pin(dentry);
+	if (pinned)
+		fstree_read_end(*epoch);
+
+	curl = curl_file_info_init(&tmp);
+	res = jf_engine_perform(curl, tmp.audio, api_prio);
+	curl_stats_conn(curl);
+
+	if (pinned) {
+		*epoch = fstree_read_begin();
+		fstree_unpin(dentry);
+		jf = lookup_jfile_from_dentry(path, dentry);
+	}
+
+	if (res != CURLE_OK) {
+		dbg("jf_engine_perform(): %s\n", curl_easy_strerror(res));
+		jf = NULL;
+		goto out_cleanup;
+	}
+	if (!jf)
+		goto out_cleanup;
+	curl_file_info_set(curl, &tmp);
+
+	pthread_mutex_lock(&jf_file_info_lock);
+	if (jf->size == JF_SIZE_UNKNOWN) {
+		free(jf->audio);
+		jf->audio = tmp.audio;
+		jf->content_type = tmp.content_type;
+		jf->blocks = tmp.blocks;
+		__atomic_store_n(&jf->size, tmp.size, __ATOMIC_RELEASE);
+		__atomic_store_n(&snapshot_dirty, true, __ATOMIC_RELAXED);
+
+		tmp.audio = NULL;
+	}
+	pthread_mutex_unlock(&jf_file_info_lock);
+
+out_cleanup:
+	curl_pool_put(curl);
+	free(tmp.audio);
+
+	return jf;
+}
+
+/*
+ * With --headtail-fill, when a track directory is fetched the head and
+ * tail (see headtail.c) of each of its tracks that we don't already have
+ * are fetched into the head/tail cache in the background, so the first
+ * scan of it doesn't have to wait on them one at a time.
+ */
+struct headtail_fill {
+	CURL *curl;
+	uint64_t id;
+	const char *fmt;
+	off_t size;
+	off_t roff;
+	char *buf;
+	size_t len;
+	size_t got;
+};
+
+static size_t headtail_write_cb(void *contents, size_t size, size_t nmemb,
+				void *userp)
+{
+	size_t realsize = size * nmemb;
+	struct headtail_fill *hf = userp;
+
+	if (jf_engine_throttle(hf->curl, realsize))
+		return CURL_WRITEFUNC_PAUSE;
+
+	/* Returning short will stop the transfer */
+	if (realsize > hf->len - hf->got)
+		realsize = hf->len - hf->got;
+
+	memcpy(hf->buf + hf->got, contents, realsize);
+	hf->got += realsize;
+
+	return realsize;
+}
+
+static void headtail_fill_done(CURL *curl, CURLcode res, void *data)
+{
+	struct headtail_fill *hf = data;
+
+	curl_stats_conn(curl);
+	curl_pool_put(curl);
+
+	/*
+	 * We stop the transfer ourselves if we're sent more than we asked.
+	 * We're on the engine thread, so its writer stores it.
+	 */
+	if ((res == CURLE_OK || res == CURLE_WRITE_ERROR) &&
+	    hf->got == hf->len) {
+		jf_headtail_give(hf->id, hf->fmt, hf->size, hf->roff,
+				 hf->buf, hf->len);
+	} else {
+		dbg("%" PRIu64 ".%s @ %jd: %s\n", hf->id, hf->fmt,
+		    (intmax_t)hf->roff, curl_easy_strerror(res));
+		free(hf->buf);
+	}
+
+	free(hf);
+}
+
+static void headtail_fill_region(const struct jf_file *jf, off_t roff,
+				 size_t rlen)
+{
+	struct headtail_fill *hf;
+	const char *fmt = audio_fmts[jf->audio_fmt].name;
+	char range[64];
+
+	if (jf_headtail_has(jf->id, fmt, jf->size, roff))
+		return;
+
+	hf = calloc(1, sizeof(struct headtail_fill));
+	hf->id = jf->id;
+	hf->fmt = fmt;
+	hf->size = jf->size;
+	hf->roff = roff;
+	hf->buf = malloc(rlen);
+	hf->len = rlen;
+
+	snprintf(range, sizeof(range), "%jd-%jd", (intmax_t)roff,
+		 (intmax_t)(roff + rlen - 1));
+
+	hf->curl = curl_pool_get();
+	curl_easy_setopt(hf->curl, CURLOPT_RANGE, range);
+	curl_easy_setopt(hf->curl, CURLOPT_WRITEFUNCTION, headtail_write_cb);
+	curl_easy_setopt(hf->curl, CURLOPT_WRITEDATA, hf);
+
+	jf_stats_inc(read_reqs);
+	jf_engine_submit(hf->curl, jf->audio, JF_PRIO_BG, headtail_fill_done,
+			 hf);
+}
+
+static void headtail_fill_track(const void *nodep, VISIT which,
+				void *data __unused)
+{
+	const struct jf_file *jf = *(const struct jf_file **)nodep;
+	off_t roff;
+	size_t rlen;
+
+	switch (which) {
+	case preorder:
+	case endorder:
+		return;
+	case postorder:
+	case leaf:
+		/* Unknown (--lazy-size) or the probe failed */
+		if (jf->size <= 0)
+			return;
+
+		jf_headtail_region(jf->size, 0, 1, &roff, &rlen);
+		headtail_fill_region(jf, roff, rlen);
+		/* Small enough to be all head */
+		if (!jf_headtail_region(jf->size, jf->size - 1, 1, &roff,
+					&rlen) || roff == 0)
+			return;
+		headtail_fill_region(jf, roff, rlen);
+	}
+}
+
+static void set_files_format(uint64_t album_id, const char *path)
+{
+	struct dir_entry *dentry;
+	size_t n = sizeof(audio_fmts) / sizeof(audio_fmts[0]);
+
+	dentry = new_dentry();
+
+	for (size_t i = 0; i < n; i++) {
+		struct jf_file *jf_file;
+
+		jf_file = new_jf_file(dentry);
+		jf_file->name = jf_arena_strdup(dentry->arena,
+						audio_fmts[i].name);
+		jf_file->mode = 0555 | S_IFDIR;
+		jf_file->nlink = DIR_NLINK_NR;
+		jf_file->id = album_id;
+		jf_file->audio_fmt = audio_fmts[i].audio_fmt;
+
+		ac_btree_add(dentry->jfiles, jf_file);
+	}
+	dentry->path = strdup(path);
+	dentry->type = JF_DT_FORMAT;
+	fstree_add(dentry);
+}
+
+/*
+ * An album's track listing, fetched once and shared by its four format
+ * directories, rather than each of them doing its own API call. The
+ * audio URLs only differ between formats by their format= parameter,
+ * so those for the other formats are made from the ones we got.
+ *
+ * Only the most recently used ALBUM_TABLES_MAX are kept, browsing an
+ * album in different formats tends to happen all at once.
+ */
+struct album_track {
+	uint64_t id;
+	int position;
+	char *name;
+	char *audio;
+};
+
+struct album_table {
+	uint64_t id;
+	int audio_fmt;
+	bool any_fmt;
+	time_t fetched;
+	time_t mtime;
+	size_t nr;
+	struct album_track *tracks;
+	int refs;
+
+	struct album_table *next;
+};
+
+static struct album_table *album_tables;
+static size_t nr_album_tables;
+static pthread_mutex_t album_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Make the URL for fmt from one for another format, NULL if url doesn't
+ * have a format= parameter.
+ */
+static char *audio_url_fmt(const char *url, const char *fmt)
+{
+	const char *param = url;
+	const char *rest;
+	char *furl;
+	size_t len;
+
+	for (;;) {
+		param = strstr(param, "format=");
+		if (!param)
+			return NULL;
+		if (param > url && (param[-1] == '?' || param[-1] == '&'))
+			break;
+		param++;
+	}
+	param += strlen("format=");
+	rest = strchrnul(param, '&');
+
+	len = (param - url) + strlen(fmt) + strlen(rest);
+	furl = malloc(len + 1);
+	snprintf(furl, len + 1, "%.*s%s%s", (int)(param - url), url, fmt,
+		 rest);
+
+	return furl;
+}
+
+static void album_table_free(struct album_table *at)
+{
+	for (size_t i = 0; i < at->nr; i++) {
+		free(at->tracks[i].name);
+		free(at->tracks[i].audio);
+	}
+	free(at->tracks);
+	free(at);
+}
+
+static void album_table_put(struct album_table *at)
+{
+	bool last;
+
+	pthread_mutex_lock(&album_tables_lock);
+	last = --at->refs == 0;
+	pthread_mutex_unlock(&album_tables_lock);
+
+	if (last)
+		album_table_free(at);
+}
+
+/* Make a table from an album as returned by /albums/tracks */
+static struct album_table *album_table_new(json_t *album, uint64_t album_id,
+					   int audio_fmt)
+{
+	json_t *rdate;
+	json_t *tracks;
+	json_t *track;
+	size_t index;
+	struct album_table *at;
+
+	rdate = json_object_get(album, "releasedate");
+	tracks = json_object_get(album, "tracks");
+
+	at = calloc(1, sizeof(struct album_table));
+	at->id = album_id;
+	at->audio_fmt = audio_fmt;
+	at->any_fmt = true;
+	at->fetched = time(NULL);
+	at->mtime = parse_date(json_string_value(rdate));
+	at->tracks = calloc(json_array_size(tracks),
+			    sizeof(struct album_track));
+	at->refs = 1;
+
+	json_array_foreach(tracks, index, track) {
+		struct album_track *t = &at->tracks[at->nr++];
+		json_t *id;
+		json_t *name;
+		json_t *audio;
+		json_t *pos;
+		char *furl;
+
+		id = json_object_get(track, "id");
+		name = json_object_get(track, "name");
+		audio = json_object_get(track, "audio");
+		pos = json_object_get(track, "position");
+
+		t->id = parse_id(json_string_value(id));
+		t->position = atoi(json_string_value(pos));
+		t->name = strdup(json_string_value(name));
+		t->audio = strdup(json_string_value(audio));
+
+		/* Can we make the other formats' URLs from it? */
+		furl = audio_url_fmt(t->audio, audio_fmts[0].name);
+		if (!furl)
+			at->any_fmt = false;
+		free(furl);
+	}
+
+	return at;
+}
+
+/*
+ * Look for a usable table for album_id in audio_fmt, taking a reference
+ * to it. It's too old if the track directories made from it would be.
+ */
+static struct album_table *album_table_get(uint64_t album_id, int audio_fmt)
+{
+	struct album_table *at;
+	struct album_table **pp;
+	long ttl = dentry_ttls[JF_DT_TRACK];
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&album_tables_lock);
+	for (pp = &album_tables; *pp; pp = &(*pp)->next) {
+		at = *pp;
+		if (at->id != album_id)
+			continue;
+		if ((ttl > 0 && now - at->fetched >= ttl) ||
+		    (!at->any_fmt && at->audio_fmt != audio_fmt))
+			break;
+
+		/* Most recently used to the front */
+		*pp = at->next;
+		at->next = album_tables;
+		album_tables = at;
+		at->refs++;
+		pthread_mutex_unlock(&album_tables_lock);
+
+		return at;
+	}
+	pthread_mutex_unlock(&album_tables_lock);
+
+	return NULL;
+}
+
+/* Add a newly fetched table, replacing any for the same album */
+static void album_table_add(struct album_table *at)
+{
+	struct album_table *old = NULL;
+	struct album_table **pp;
+
+	pthread_mutex_lock(&album_tables_lock);
+	for (pp = &album_tables; *pp; pp = &(*pp)->next) {
+		if ((*pp)->id != at->id)
+			continue;
+		old = *pp;
+		*pp = old->next;
+		nr_album_tables--;
+		break;
+	}
+	if (!old && nr_album_tables == ALBUM_TABLES_MAX) {
+		for (pp = &album_tables; (*pp)->next; pp = &(*pp)->next)
+			;
+		old = *pp;
+		*pp = NULL;
+		nr_album_tables--;
+	}
+
+	at->refs++;
+	at->next = album_tables;
+	album_tables = at;
+	nr_album_tables++;
+	pthread_mutex_unlock(&album_tables_lock);
+
+	if (old)
+		album_table_put(old);
+}
+
+static void album_tables_destroy(void)
+{
+	while (album_tables) {
+		struct album_table *at = album_tables;
+
+		album_tables = at->next;
+		album_table_put(at);
+	}
+}
+
+static void set_files_tracks(const struct album_table *at,
+			     const struct audio_fmt *fmt, const char *path)
+{
+	struct dir_entry *dentry;
+	struct jf_file **jfiles;
+	const ac_btree_t *old;
+	unsigned int epoch;
+	size_t nr_probe = 0;
+
+	dentry = new_dentry();
+
+	jfiles = calloc(at->nr, sizeof(struct jf_file *));
+
+	epoch = fstree_read_begin();
+	old = fstree_old_jfiles(path);
+	for (size_t i = 0; i < at->nr; i++) {
+		const struct album_track *t = &at->tracks[i];
+		char fname[NAME_MAX + 1];
+		int len;
+		struct jf_file *jf_file;
+
+		jf_file = new_jf_file(dentry);
+
+		len = snprintf(fname, sizeof(fname), "%02d_-_%s.%s",
+			       t->position, t->name, fmt->ext);
+		jf_file->name = jf_arena_strndup(dentry->arena, fname,
+						 len < (int)sizeof(fname) ?
+						 (size_t)len :
+						 sizeof(fname) - 1);
+
+		normalise_fname(jf_file->name);
+		jf_file->mode = 0444 | S_IFREG;
+		jf_file->mtime = at->mtime;
+		jf_file->id = t->id;
+		if (fmt->audio_fmt == at->audio_fmt)
+			jf_file->audio = strdup(t->audio);
+		else
+			jf_file->audio = audio_url_fmt(t->audio, fmt->name);
+		jf_file->audio_fmt = fmt->audio_fmt;
+		jf_file->size = JF_SIZE_UNKNOWN;
+		jfile_carry_over(jf_file, old);
+
+		ac_btree_add(dentry->jfiles, jf_file);
+		if (lazy_size || jf_file->size != JF_SIZE_UNKNOWN)
+			continue;
+
+		jf_file->size = 0;
+		jfiles[nr_probe++] = jf_file;
+	}
+	fstree_read_end(epoch);
+
+	curl_get_files_info(jfiles, nr_probe);
+	free(jfiles);
+
+	if (headtail_fill && jf_headtail_enabled())
+		ac_btree_foreach_data(dentry->jfiles, headtail_fill_track,
+				      NULL);
+
+	dentry->path = strdup(path);
+	dentry->type = JF_DT_TRACK;
+	/* As old as what it was made from */
+	dentry->fetched = at->fetched;
+	fstree_add(dentry);
+}
+
+/*
+ * A directory being built up from the pages of an API listing, see
+ * api_fetch_all(). prev_dir must be pinned until it's finished, we're
+ * not in a read section between pages.
+ */
+struct jf_listing {
+	const struct dir_entry *prev_dir;
+	const char *path;
+	struct dir_entry *dentry;
+	size_t nr;
+};
+
+static void listing_init(struct jf_listing *ls, const char *path,
+			 const struct dir_entry *prev_dir)
+{
+	ls->prev_dir = prev_dir;
+	ls->path = path;
+	ls->dentry = new_dentry();
+	ls->nr = 0;
+}
+
+/*
+ * Returns false if there's already an entry by that name, e.g from an
+ * earlier page.
+ */
+static bool listing_add(struct jf_listing *ls, const char *name,
+			struct jf_file **jfilep)
+{
+	struct jf_file key = {};
+
+	key.name = jf_arena_strdup(ls->dentry->arena, name);
+	normalise_fname(key.name);
+	if (!key.name || ac_btree_lookup(ls->dentry->jfiles, &key))
+		return false;
+
+	*jfilep = new_jf_file(ls->dentry);
+	(*jfilep)->name = key.name;
+	ls->nr++;
+
+	return true;
+}
+
+static void listing_finish(struct jf_listing *ls, const char *path,
+			   enum jf_dentry_type type)
+{
+	struct jf_file *jfile;
+	unsigned int epoch;
+
+	ls->dentry->path = strdup(path);
+	ls->dentry->type = type;
+	ls->dentry->fetched = time(NULL);
+	fstree_add(ls->dentry);
+
+	epoch = fstree_read_begin();
+	jfile = lookup_jfile_from_dentry(path, ls->prev_dir);
+	if (jfile)
+		__atomic_store_n(&jfile->nlink, DIR_NLINK_NR + ls->nr,
+				 __ATOMIC_RELAXED);
+	fstree_read_end(epoch);
+}
+
+/* Add a page of an artist's albums, returns how many were in it */
+static size_t set_files_album(json_t *root, void *data, size_t *nr_new)
+{
+	struct jf_listing *ls = data;
+	const ac_btree_t *old;
+	json_t *albums;
+	json_t *album;
+	size_t index;
+	unsigned int epoch;
+	static const size_t nfmts = sizeof(audio_fmts) / sizeof(audio_fmts[0]);
+
+	albums = json_object_get(root, "results");
+
+	/* What's there now, if we're fetching it again */
+	epoch = fstree_read_begin();
+	old = fstree_old_jfiles(ls->path);
+	json_array_foreach(albums, index, album) {
+		json_t *id;
+		json_t *name;
+		json_t *date;
+		struct jf_file *jf_file;
+
+		id = json_object_get(album, "id");
+		name = json_object_get(album, "name");
+		date = json_object_get(album, "releasedate");
+
+		if (!listing_add(ls, json_string_value(name), &jf_file))
+			continue;
+		jf_file->mtime = parse_date(json_string_value(date));
+		jf_file->mode = 0555 | S_IFDIR;
+		jf_file->nlink = DIR_NLINK_NR + nfmts;
+		jf_file->id = parse_id(json_string_value(id));
+		jfile_carry_over(jf_file, old);
+
+		ac_btree_add(ls->dentry->jfiles, jf_file);
+		(*nr_new)++;
+	}
+	fstree_read_end(epoch);
+
+	return json_array_size(albums);
+}
+
+/* Add a page of autocomplete results, returns how many were in it */
+static size_t set_file_entity(json_t *root, void *data, size_t *nr_new)
+{
+	struct jf_listing *ls = data;
+	const ac_btree_t *old;
+	json_t *results;
+	json_t *entities;
+	unsigned int epoch;
+
+	results = json_object_get(root, "results");
+	entities = json_object_get(results,
+				   jf_autocomplete_entities[ls->prev_dir->entity]);
+
+	epoch = fstree_read_begin();
+	old = fstree_old_jfiles(ls->path);
+	for (size_t i = 0; i < json_array_size(entities); i++) {
+		json_t *entity;
+		struct jf_file *jf_file;
+
+		entity = json_array_get(entities, i);
+
+		if (!listing_add(ls, json_string_value(entity), &jf_file))
+			continue;
+		jf_file->orig_name = jf_arena_strdup(ls->dentry->arena,
+						     json_string_value(entity));
+		jf_file->mode = 0555 | S_IFDIR;
+		jfile_carry_over(jf_file, old);
+
+		ac_btree_add(ls->dentry->jfiles, jf_file);
+		(*nr_new)++;
+	}
+	fstree_read_end(epoch);
+
+	return json_array_size(entities);
+}
+
+static size_t curl_writeb_cb(void *contents, size_t size, size_t nmemb,
+			     void *userp)
+{
+	void *ptr;
+	size_t realsize = size * nmemb;
+	struct curl_buf *curl_buf = userp;
+
+	if (jf_engine_throttle(curl_buf->curl, realsize))
+		return CURL_WRITEFUNC_PAUSE;
+
+	ptr = realloc(curl_buf->buf, curl_buf->len + realsize + 1);
+	if (!ptr)
+		return 0;
+	curl_buf->buf = ptr;
+
+	memcpy(curl_buf->buf + curl_buf->len, contents, realsize);
+	curl_buf->len += realsize;
+	curl_buf->buf[curl_buf->len] = '\0';
+
+	return realsize;
+}
+
+/*
+ * Used for reading file data, this writes straight into the buffer
+ * we're going to hand back to FUSE, rather than growing a temporary
+ * buffer and copying it over at the end.
+ */
+static size_t curl_writer_cb(void *contents, size_t size, size_t nmemb,
+			     void *userp)
+{
+	size_t realsize = size * nmemb;
+	struct curl_rbuf *rbuf = userp;
+	size_t avail = rbuf->size - rbuf->len;
+
+	if (jf_engine_throttle(rbuf->curl, realsize))
+		return CURL_WRITEFUNC_PAUSE;
+
+	/*
+	 * Shouldn't happen for a range request, but don't overrun the
+	 * buffer if it does. Returning short will stop the transfer.
+	 */
+	if (realsize > avail)
+		realsize = avail;
+
+	memcpy(rbuf->buf + rbuf->len, contents, realsize);
+	rbuf->len += realsize;
+
+	return realsize;
+}
+
+static int curl_perform(const char *url, struct curl_buf *curl_buf)
+{
+	int ret = 0;
+	CURL *curl;
+	CURLcode res;
+
+	curl = curl_pool_get();
+	curl_buf->curl = curl;
+
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_writeb_cb);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, curl_buf);
+
+	/* The JSON compresses well, let curl ask for whatever it supports */
+	curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+
+	jf_stats_inc(api_reqs);
+
+	res = jf_engine_perform(curl, url, api_prio);
+	if (res != CURLE_OK) {
+		dbg("jf_engine_perform(): %s\n", curl_easy_strerror(res));
+		ret = -1;
+	}
+	curl_stats_conn(curl);
+
+	curl_pool_put(curl);
+
+	return ret;
+}
+
+/*
+ * We _really_ want to use persistent connections when reading the
+ * file data. Not doing so introduces too much latency and audio
+ * apps suffer buffer drop outs. E.g ogg123 would often get down to
+ * a 22% buffer and sometime below and stutter. With this I don't
+ * really see it drop below 77%.
+ *
+ * I'm sure this will also even if very slightly reduce load on the
+ * end server.
+ *
+ * The connections live in the engine's multi handle, so any handle
+ * from the pool will do.
+ */
+static int curl_read_file(const char *url, char *buf, size_t size,
+			  off_t offset)
+{
+	CURL *curl;
+	CURLcode res;
+	char range[64];
+	struct curl_rbuf rbuf = { .buf = buf, .size = size };
+
+	snprintf(range, sizeof(range), "%zu-%zu", offset, offset + size - 1);
+	dbg("Requesting bytes [%s] from : %s\n", range, url);
+
+	curl = curl_pool_get();
+	rbuf.curl = curl;
+	curl_easy_setopt(curl, CURLOPT_BUFFERSIZE, READ_BUF_SIZE);
+	curl_easy_setopt(curl, CURLOPT_RANGE, range);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_writer_cb);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &rbuf);
+
+	if (debug) {
+		curl_easy_setopt(curl, CURLOPT_STDERR, stdout);
+		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+	}
+
+	jf_stats_inc(read_reqs);
+
+	res = jf_engine_perform(curl, url, JF_PRIO_READ);
+	curl_stats_conn(curl);
+	curl_pool_put(curl);
+	/* We stop the transfer ourselves if we're sent more than we asked */
+	if (res == CURLE_WRITE_ERROR && rbuf.len == rbuf.size)
+		res = CURLE_OK;
+	if (res != CURLE_OK) {
+		dbg("CURL jf_engine_perform(): %s\n",
+		    curl_easy_strerror(res));
+		return -1;
+	}
+
+	return rbuf.len;
+}
+
+/*
+ * Listings come back from the API at most API_PAGE_SIZE entries at a
+ * time. The first page asks for the total (fullcount) and once we know
+ * it, the rest are fetched concurrently, each being added to the
+ * listing as it arrives. Where no total is given, pages are fetched one
+ * after another until one comes back short or with nothing new in it.
+ * See api_page_fn in jamendo-fuse.h.
+ */
+struct api_pager {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct api_page *ready;
+	long active;
+};
+
+struct api_page {
+	struct api_pager *pager;
+	struct curl_buf buf;
+	CURLcode res;
+	void *data;
+	struct api_page *next;
+};
+
+static size_t api_page_parse(const struct curl_buf *buf, api_page_fn page_fn,
+			     void *data, size_t *nr_new, json_int_t *total)
+{
+	json_t *root;
+	json_t *headers;
+	size_t nr;
+
+	root = json_loads(buf->buf, 0, NULL);
+	if (total) {
+		headers = json_object_get(root, "headers");
+		*total = json_integer_value(json_object_get(headers,
+						"results_fullcount"));
+	}
+	nr = page_fn(root, data, nr_new);
+	json_decref(root);
+
+	return nr;
+}
+
+static void api_page_done(CURL *curl, CURLcode res, void *data)
+{
+	struct api_page *page = data;
+	struct api_pager *pager = page->pager;
+
+	curl_stats_conn(curl);
+	curl_pool_put(curl);
+
+	pthread_mutex_lock(&pager->lock);
+	page->res = res;
+	page->next = pager->ready;
+	pager->ready = page;
+	pager->active--;
+	pthread_cond_signal(&pager->cond);
+	pthread_mutex_unlock(&pager->lock);
+}
+
+static void api_page_submit(struct api_pager *pager, const char *api,
+			    size_t offset, void *data)
+{
+	struct api_page *page;
+	char url[API_URL_MAX_LEN];
+	CURL *curl;
+
+	snprintf(url, sizeof(url), "%s&limit=%d&offset=%zu", api,
+		 API_PAGE_SIZE, offset);
+	dbg("** api : %s\n", url);
+
+	page = calloc(1, sizeof(struct api_page));
+	page->pager = pager;
+	page->data = data;
+
+	curl = curl_pool_get();
+	page->buf.curl = curl;
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_writeb_cb);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &page->buf);
+	curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+
+	jf_stats_inc(api_reqs);
+
+	jf_engine_submit(curl, url, api_prio, api_page_done, page);
+}
+
+/*
+ * Fetch all of the listing at api (a URL without limit/offset). Returns
+ * -1 if any of it couldn't be fetched, or we were told to stop.
+ */
+int api_fetch_all(const char *api, api_page_fn page_fn, void *data)
+{
+	struct api_pager pager = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	struct curl_buf curl_buf = {};
+	char url[API_URL_MAX_LEN];
+	json_int_t total = 0;
+	size_t nr_pages;
+	size_t next;
+	size_t nr;
+	size_t nr_new = 0;
+	int ret;
+
+	if (api_stopped())
+		return -1;
+
+	snprintf(url, sizeof(url), "%s&limit=%d&offset=0&fullcount=true",
+		 api, API_PAGE_SIZE);
+	dbg("** api : %s\n", url);
+	ret = curl_perform(url, &curl_buf);
+	if (ret == -1)
+		goto out_free;
+	nr = api_page_parse(&curl_buf, page_fn, data, &nr_new, &total);
+
+	if (total <= 0) {
+		for (next = 1; nr == API_PAGE_SIZE && nr_new > 0 &&
+			       next < API_PAGES_MAX; next++) {
+			if (api_stopped()) {
+				ret = -1;
+				goto out_free;
+			}
+			free(curl_buf.buf);
+			curl_buf.buf = NULL;
+			curl_buf.len = 0;
+
+			snprintf(url, sizeof(url), "%s&limit=%d&offset=%zu",
+				 api, API_PAGE_SIZE, next * API_PAGE_SIZE);
+			dbg("** api : %s\n", url);
+			ret = curl_perform(url, &curl_buf);
+			if (ret == -1)
+				goto out_free;
+			nr_new = 0;
+			nr = api_page_parse(&curl_buf, page_fn, data, &nr_new,
+					    NULL);
+		}
+		goto out_free;
+	}
+
+	nr_pages = (total + API_PAGE_SIZE - 1) / API_PAGE_SIZE;
+	if (nr_pages > API_PAGES_MAX)
+		nr_pages = API_PAGES_MAX;
+
+	pthread_mutex_lock(&pager.lock);
+	for (next = 1; next < nr_pages || pager.active > 0 || pager.ready; ) {
+		struct api_page *page;
+
+		if (next < nr_pages && api_stopped()) {
+			ret = -1;
+			next = nr_pages;
+		}
+		while (next < nr_pages &&
+		       pager.active < API_PAGES_CONCURRENCY) {
+			pager.active++;
+			pthread_mutex_unlock(&pager.lock);
+			api_page_submit(&pager, api, next * API_PAGE_SIZE,
+					NULL);
+			pthread_mutex_lock(&pager.lock);
+			next++;
+		}
+
+		if (!pager.ready) {
+			pthread_cond_wait(&pager.cond, &pager.lock);
+			continue;
+		}
+		page = pager.ready;
+		pager.ready = page->next;
+		pthread_mutex_unlock(&pager.lock);
+
+		if (page->res == CURLE_OK) {
+			api_page_parse(&page->buf, page_fn, data, &nr_new,
+				       NULL);
+		} else {
+			dbg("jf_engine_submit(): %s\n",
+			    curl_easy_strerror(page->res));
+			ret = -1;
+			/* No point fetching any more */
+			next = nr_pages;
+		}
+		free(page->buf.buf);
+		free(page);
+
+		pthread_mutex_lock(&pager.lock);
+	}
+	pthread_mutex_unlock(&pager.lock);
+
+	pthread_mutex_destroy(&pager.lock);
+	pthread_cond_destroy(&pager.cond);
+
+out_free:
+	free(curl_buf.buf);
+
+	return ret;
+}
+
+static struct jf_stream *ra_queue;
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double ts_elapsed(const struct timespec *t0, const struct timespec *t1)
+{
+	return (t1->tv_sec - t0->tv_sec) + (t1->tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/* Hand the stream to the engine thread, called with st->lock held */
+static void ra_queue_stream(struct jf_stream *st)
+{
+	pthread_mutex_lock(&ra_lock);
+	if (!st->ra_queued) {
+		st->ra_queued = true;
+		st->ra_next = ra_queue;
+		ra_queue = st;
+	}
+	pthread_mutex_unlock(&ra_lock);
+
+	jf_engine_wakeup();
+}
+
+/*
+ * How far ahead of the reader we try to be. Until we've seen a few
+ * sequential reads, just enough to cover the next read or so. After
+ * that, enough for RA_SECS worth of playback at whichever is the higher
+ * of the measured consumption rate or the guessed bitrate, and more if
+ * the link is struggling to keep up with that.
+ */
+static size_t ra_window(const struct jf_stream *st)
+{
+	double cons;
+	double secs = RA_SECS;
+	double win;
+
+	if (st->seq < RA_SEQ_MIN)
+		return RA_WIN_MIN;
+
+	cons = st->cons_rate > st->bitrate ? st->cons_rate : st->bitrate;
+	if (st->dl_rate > 0.0 && st->dl_rate < cons * 2)
+		secs *= 2 * cons / st->dl_rate;
+
+	win = cons * secs;
+	if (win < RA_WIN_MIN)
+		return RA_WIN_MIN;
+	if (win > RA_WIN_MAX)
+		return RA_WIN_MAX;
+
+	return win;
+}
+
+static bool ra_want_more(const struct jf_stream *st)
+{
+	return st->end < st->want ||
+	       (size_t)(st->end - st->rpos) < ra_window(st);
+}
+
+static void ra_rate_update(double *rate, size_t *bytes, struct timespec *t0,
+			   double min_secs)
+{
+	struct timespec now;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (t0->tv_sec == 0) {
+		*t0 = now;
+		return;
+	}
+
+	secs = ts_elapsed(t0, &now);
+	if (secs < min_secs)
+		return;
+
+	if (*rate == 0.0)
+		*rate = *bytes / secs;
+	else
+		*rate = *rate * 0.7 + (*bytes / secs) * 0.3;
+	*bytes = 0;
+	*t0 = now;
+}
+
+/*
+ * Hand to the cache any cache blocks we now have all of, called with
+ * st->lock held. Blocks whose start we missed (we came in through a
+ * seek) are skipped. They're written out by the cache's writer thread,
+ * we're on the engine thread here.
+ */
+static void ra_cache_blocks(struct jf_stream *st)
+{
+	if (!st->cf)
+		return;
+
+	for (;;) {
+		struct iovec iov[CACHE_BLOCK_SIZE / RA_BLOCK_SIZE];
+		int iovcnt = 0;
+		off_t bstart = (off_t)st->cache_next * CACHE_BLOCK_SIZE;
+		off_t bend = bstart + CACHE_BLOCK_SIZE;
+
+		if (bend > st->size)
+			bend = st->size;
+		if (bstart >= st->size || st->end < bend)
+			break;
+
+		if (bstart < st->start) {
+			st->cache_next++;
+			continue;
+		}
+
+		for (off_t off = bstart; off < bend; off += RA_BLOCK_SIZE) {
+			size_t blk = (off / RA_BLOCK_SIZE) % RA_NR_BLOCKS;
+
+			iov[iovcnt].iov_base = st->blocks[blk];
+			iov[iovcnt].iov_len = bend - off < RA_BLOCK_SIZE ?
+					      (size_t)(bend - off) :
+					      RA_BLOCK_SIZE;
+			iovcnt++;
+		}
+		jf_cache_write_block(st->cf, st->cache_next, iov, iovcnt);
+		st->cache_next++;
+	}
+}
+
+static size_t stream_write_cb(void *contents, size_t size, size_t nmemb,
+			      void *userp)
+{
+	struct jf_stream *st = userp;
+	size_t realsize = size * nmemb;
+	size_t len = realsize;
+	char *data = contents;
+
+	pthread_mutex_lock(&st->lock);
+
+	/* Data from a transfer that's about to be replaced */
+	if (st->restart || st->closing)
+		goto out_unlock;
+
+	/*
+	 * Far enough ahead. When pausing we mustn't consume anything,
+	 * curl hands us the same data again when we unpause.
+	 */
+	if (!ra_want_more(st)) {
+		st->paused = true;
+		st->dl_t0.tv_sec = 0;
+		pthread_mutex_unlock(&st->lock);
+		return CURL_WRITEFUNC_PAUSE;
+	}
+
+	/* Had our share of the bandwidth, the engine will carry us on */
+	if (jf_engine_throttle(st->curl, realsize)) {
+		pthread_mutex_unlock(&st->lock);
+		return CURL_WRITEFUNC_PAUSE;
+	}
+
+	if (st->end + (off_t)len - st->start > RA_RING_SIZE)
+		st->start = st->end + len - RA_RING_SIZE;
+
+	while (len > 0) {
+		size_t blk = (st->end / RA_BLOCK_SIZE) % RA_NR_BLOCKS;
+		size_t boff = st->end % RA_BLOCK_SIZE;
+		size_t n = RA_BLOCK_SIZE - boff;
+
+		if (!st->blocks[blk]) {
+			st->blocks[blk] = malloc(RA_BLOCK_SIZE);
+			if (!st->blocks[blk]) {
+				realsize = 0;
+				goto out_unlock;
+			}
+		}
+
+		if (n > len)
+			n = len;
+		memcpy(st->blocks[blk] + boff, data, n);
+		st->end += n;
+		data += n;
+		len -= n;
+	}
+
+	ra_cache_blocks(st);
+
+	st->dl_bytes += realsize;
+	ra_rate_update(&st->dl_rate, &st->dl_bytes, &st->dl_t0, 0.25);
+
+	pthread_cond_broadcast(&st->cond);
+
+out_unlock:
+	pthread_mutex_unlock(&st->lock);
+
+	return realsize;
+}
+
+static void ra_copy_out(const struct jf_stream *st, char *buf, off_t offset,
+			size_t len)
+{
+	while (len > 0) {
+		size_t blk = (offset / RA_BLOCK_SIZE) % RA_NR_BLOCKS;
+		size_t boff = offset % RA_BLOCK_SIZE;
+		size_t n = RA_BLOCK_SIZE - boff;
+
+		if (n > len)
+			n = len;
+		memcpy(buf, st->blocks[blk] + boff, n);
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+}
+
+static void ra_detach(struct jf_stream *st)
+{
+	if (!st->curl)
+		return;
+
+	jf_engine_cancel(st->curl);
+	curl_pool_put(st->curl);
+	st->curl = NULL;
+}
+
+static void ra_stream_done(CURL *curl, CURLcode res, void *data)
+{
+	struct jf_stream *st = data;
+
+	curl_stats_conn(curl);
+
+	pthread_mutex_lock(&st->lock);
+	st->done = true;
+	st->result = res;
+	if (res != CURLE_OK)
+		dbg("CURL stream: %s\n", curl_easy_strerror(res));
+	pthread_cond_broadcast(&st->cond);
+	pthread_mutex_unlock(&st->lock);
+}
+
+static void ra_attach(struct jf_stream *st, off_t offset)
+{
+	char range[32];
+
+	snprintf(range, sizeof(range), "%zu-", offset);
+	dbg("Streaming bytes [%s] from : %s\n", range, st->url);
+
+	st->curl = curl_pool_get();
+	curl_easy_setopt(st->curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(st->curl, CURLOPT_RANGE, range);
+	curl_easy_setopt(st->curl, CURLOPT_BUFFERSIZE, READ_BUF_SIZE);
+	curl_easy_setopt(st->curl, CURLOPT_WRITEFUNCTION, stream_write_cb);
+	curl_easy_setopt(st->curl, CURLOPT_WRITEDATA, st);
+	jf_engine_submit(st->curl, st->url, JF_PRIO_READ, ra_stream_done, st);
+
+	jf_stats_inc(read_reqs);
+}
+
+/*
+ * Act on what the readers have asked of us, called on the engine thread
+ * each time around its loop. Any curl calls are made without st->lock
+ * held as unpausing can call straight back into stream_write_cb().
+ */
+static void ra_process_queue(void)
+{
+	struct jf_stream *st;
+
+	pthread_mutex_lock(&ra_lock);
+	st = ra_queue;
+	ra_queue = NULL;
+	pthread_mutex_unlock(&ra_lock);
+
+	while (st) {
+		struct jf_stream *next;
+		bool closing;
+		bool restart;
+		bool unpause;
+		off_t offset;
+
+		pthread_mutex_lock(&st->lock);
+		next = st->ra_next;
+		st->ra_queued = false;
+		closing = st->closing;
+		restart = st->restart;
+		unpause = st->unpause;
+		offset = st->restart_off;
+		st->unpause = false;
+		if (unpause)
+			st->paused = false;
+		pthread_mutex_unlock(&st->lock);
+
+		if (closing) {
+			ra_detach(st);
+			pthread_mutex_lock(&st->lock);
+			st->detached = true;
+			pthread_cond_broadcast(&st->cond);
+			pthread_mutex_unlock(&st->lock);
+			/* st is no longer ours to touch */
+		} else if (restart) {
+			ra_detach(st);
+			ra_attach(st, offset);
+			pthread_mutex_lock(&st->lock);
+			st->restart = false;
+			pthread_mutex_unlock(&st->lock);
+		} else if (unpause && st->curl) {
+			curl_easy_pause(st->curl, CURLPAUSE_CONT);
+		}
+
+		st = next;
+	}
+}
+
+/*
+ * Players generally read an album's tracks in order, so once a track is
+ * PREFETCH_AT_PCT of the way through, the first prefetch_size bytes of
+ * the next one (by name) are fetched into the block cache in the
+ * background. When it's opened, its first reads then come straight from
+ * the cache rather than waiting on a new request.
+ *
+ * A prefetch is cancelled if the track that started it is closed before
+ * it was read to the end (the listener skipped or stopped), unless the
+ * next track has been opened by then. Prefetched tracks that are opened
+ * count towards prefetch_useful, those cancelled or not opened within
+ * PREFETCH_EXPIRE_SECS towards prefetch_wasted.
+ *
+ * Only done with the block cache enabled, there's nowhere to put it
+ * otherwise.
+ */
+static struct jf_prefetch *prefetches;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct next_track {
+	const char *name;
+	const struct jf_file *next;
+};
+
+static void find_next_track(const void *nodep, VISIT which, void *data)
+{
+	const struct jf_file *jfile = *(struct jf_file **)nodep;
+	struct next_track *nt = data;
+
+	switch (which) {
+	case preorder:
+	case endorder:
+		return;
+	case postorder:
+	case leaf:
+		break;
+	}
+
+	if (!S_ISREG(jfile->mode) || strcmp(jfile->name, nt->name) <= 0)
+		return;
+	if (!nt->next || strcmp(jfile->name, nt->next->name) < 0)
+		nt->next = jfile;
+}
+
+static size_t prefetch_write_cb(void *contents, size_t size, size_t nmemb,
+				void *userp)
+{
+	struct jf_prefetch *pf = userp;
+	size_t realsize = size * nmemb;
+	size_t left = realsize;
+	const char *data = contents;
+
+	if (__atomic_load_n(&pf->cancel, __ATOMIC_ACQUIRE))
+		return 0;
+	if (jf_engine_throttle(pf->curl, realsize))
+		return CURL_WRITEFUNC_PAUSE;
+
+	/* More than we asked for, stop it there */
+	if (pf->got + (off_t)left > pf->len)
+		left = pf->len - pf->got;
+
+	while (left > 0) {
+		off_t bstart = (off_t)pf->blk * CACHE_BLOCK_SIZE;
+		size_t blen = CACHE_BLOCK_SIZE;
+		size_t n;
+
+		if (bstart + (off_t)blen > pf->size)
+			blen = pf->size - bstart;
+		n = blen - pf->blen;
+		if (n > left)
+			n = left;
+
+		memcpy(pf->buf + pf->blen, data, n);
+		pf->blen += n;
+		pf->got += n;
+		data += n;
+		left -= n;
+
+		/* The cache's writer has it from here, we're on the engine */
+		if (pf->blen == blen) {
+			jf_cache_give_block(pf->cf, pf->blk, pf->buf);
+			pf->buf = malloc(CACHE_BLOCK_SIZE);
+			pf->bytes += blen;
+			pf->blk++;
+			pf->blen = 0;
+		}
+	}
+
+	return pf->got == pf->len ? 0 : realsize;
+}
+
+static void prefetch_done(CURL *curl, CURLcode res, void *data)
+{
+	struct jf_prefetch *pf = data;
+
+	curl_stats_conn(curl);
+	if (res != CURLE_OK && pf->got < pf->len)
+		dbg("prefetch [%" PRIu64 "]: %s\n", pf->id,
+		    curl_easy_strerror(res));
+	curl_pool_put(curl);
+
+	jf_cache_close(pf->cf);
+	free(pf->buf);
+
+	pthread_mutex_lock(&prefetch_lock);
+	pf->curl = NULL;
+	pf->cf = NULL;
+	pf->buf = NULL;
+	pf->done = true;
+	if (pf->cancel)
+		jf_stats_add(prefetch_wasted, pf->got);
+	pthread_mutex_unlock(&prefetch_lock);
+}
+
+/* Called by a reader having got to pos in st */
+static void jf_prefetch_check(struct jf_stream *st, off_t pos)
+{
+	struct next_track nt = { .name = st->name };
+	struct jf_prefetch *pf;
+	unsigned int epoch;
+	char range[64];
+	char *url = NULL;
+
+	if (!prefetch_size || !st->dentry ||
+	    pos < st->size / 100 * PREFETCH_AT_PCT)
+		return;
+	if (__atomic_exchange_n(&st->prefetched, true, __ATOMIC_ACQ_REL))
+		return;
+
+	pf = calloc(1, sizeof(struct jf_prefetch));
+
+	/* Its directory is pinned by st */
+	epoch = fstree_read_begin();
+	ac_btree_foreach_data(dentry_jfiles(st->dentry), find_next_track, &nt);
+	if (nt.next &&
+	    __atomic_load_n(&nt.next->size, __ATOMIC_ACQUIRE) > 0) {
+		pf->id = nt.next->id;
+		pf->audio_fmt = nt.next->audio_fmt;
+		pf->size = nt.next->size;
+		pthread_mutex_lock(&jf_file_info_lock);
+		url = strdup(nt.next->audio);
+		pthread_mutex_unlock(&jf_file_info_lock);
+	}
+	fstree_read_end(epoch);
+
+	if (!url)
+		goto out_free;
+
+	/* Only whole blocks go in the cache */
+	pf->len = (prefetch_size + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE *
+		  CACHE_BLOCK_SIZE;
+	if (pf->len > pf->size)
+		pf->len = pf->size;
+	pf->cf = jf_cache_open(pf->id, audio_fmts[pf->audio_fmt].name,
+			       pf->size);
+	if (!pf->cf || jf_cache_has(pf->cf, 0, pf->len))
+		goto out_free;
+
+	dbg("prefetching %jd bytes of [%" PRIu64 "]\n", (intmax_t)pf->len,
+	    pf->id);
+
+	pf->buf = malloc(CACHE_BLOCK_SIZE);
+	pf->when = time(NULL);
+	pf->owned = true;
+	pf->curl = curl_pool_get();
+	snprintf(range, sizeof(range), "0-%jd", (intmax_t)pf->len - 1);
+	curl_easy_setopt(pf->curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(pf->curl, CURLOPT_RANGE, range);
+	curl_easy_setopt(pf->curl, CURLOPT_WRITEFUNCTION, prefetch_write_cb);
+	curl_easy_setopt(pf->curl, CURLOPT_WRITEDATA, pf);
+
+	jf_stats_inc(prefetches);
+	jf_stats_inc(read_reqs);
+
+	jf_engine_submit(pf->curl, url, JF_PRIO_BG, prefetch_done, pf);
+	free(url);
+
+	pthread_mutex_lock(&prefetch_lock);
+	pf->next = prefetches;
+	prefetches = pf;
+	st->prefetch = pf;
+	pthread_mutex_unlock(&prefetch_lock);
+
+	return;
+
+out_free:
+	jf_cache_close(pf->cf);
+	free(url);
+	free(pf);
+}
+
+/* A track's being opened, anything we prefetched of it was worth it */
+static void jf_prefetch_claim(uint64_t id, int audio_fmt)
+{
+	struct jf_prefetch *pf;
+
+	pthread_mutex_lock(&prefetch_lock);
+	for (pf = prefetches; pf; pf = pf->next) {
+		if (pf->id == id && pf->audio_fmt == audio_fmt &&
+		    !pf->cancel)
+			pf->claimed = true;
+	}
+	pthread_mutex_unlock(&prefetch_lock);
+}
+
+/* st is being closed, if it wasn't read to the end, cancel its prefetch */
+static void jf_prefetch_release(struct jf_stream *st)
+{
+	struct jf_prefetch *pf = st->prefetch;
+	bool cancel = false;
+
+	if (!pf)
+		return;
+
+	pthread_mutex_lock(&prefetch_lock);
+	pf->owned = false;
+	if (!pf->done && !pf->claimed && st->rpos < st->size) {
+		__atomic_store_n(&pf->cancel, true, __ATOMIC_RELEASE);
+		cancel = true;
+	}
+	pthread_mutex_unlock(&prefetch_lock);
+
+	if (cancel) {
+		dbg("cancelling prefetch of [%" PRIu64 "]\n", pf->id);
+		jf_engine_wakeup();
+	}
+}
+
+/*
+ * Stop cancelled prefetches and account for and free finished ones.
+ * Called on the engine thread.
+ */
+static void prefetch_reap(void)
+{
+	struct jf_prefetch **pp;
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&prefetch_lock);
+	pp = &prefetches;
+	while (*pp) {
+		struct jf_prefetch *pf = *pp;
+
+		if (pf->cancel && !pf->done) {
+			jf_engine_cancel(pf->curl);
+			curl_pool_put(pf->curl);
+			jf_cache_close(pf->cf);
+			free(pf->buf);
+			pf->curl = NULL;
+			pf->cf = NULL;
+			pf->buf = NULL;
+			pf->done = true;
+			jf_stats_add(prefetch_wasted, pf->got);
+		}
+
+		if (!pf->done || pf->owned) {
+			pp = &pf->next;
+			continue;
+		}
+
+		/* Give it a while to be opened */
+		if (!pf->claimed && !pf->cancel &&
+		    now - pf->when < PREFETCH_EXPIRE_SECS) {
+			pp = &pf->next;
+			continue;
+		}
+
+		if (pf->claimed)
+			jf_stats_add(prefetch_useful, pf->bytes);
+		else if (!pf->cancel)
+			jf_stats_add(prefetch_wasted, pf->bytes);
+
+		*pp = pf->next;
+		free(pf);
+	}
+	pthread_mutex_unlock(&prefetch_lock);
+}
+
+/* Once the engine has stopped */
+static void prefetch_destroy(void)
+{
+	while (prefetches) {
+		struct jf_prefetch *pf = prefetches;
+
+		prefetches = pf->next;
+		free(pf);
+	}
+}
+
+/* Called with st->lock held */
+static void jf_stream_seek(struct jf_stream *st, off_t offset)
+{
+	st->start = st->end = st->rpos = offset;
+	st->cache_next = (offset + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE;
+	st->restart_off = offset;
+	st->restart = true;
+	st->active = true;
+	st->done = false;
+	st->result = CURLE_OK;
+	st->paused = false;
+	st->dl_t0.tv_sec = 0;
+
+	ra_queue_stream(st);
+}
+
+static int jf_stream_read(struct jf_stream *st, char *buf, size_t size,
+			  off_t offset)
+{
+	size_t len = 0;
+	int tries = 0;
+	bool waited = false;
+	bool failed;
+
+	pthread_mutex_lock(&st->lock);
+
+	st->cons_bytes += size;
+	ra_rate_update(&st->cons_rate, &st->cons_bytes, &st->cons_t0, 2.0);
+
+	if (offset == st->rpos)
+		st->seq++;
+	else
+		st->seq = 0;
+
+	if (!st->active || offset < st->start ||
+	    offset > st->end + STREAM_SKIP_MAX ||
+	    (st->done && st->result != CURLE_OK && offset >= st->end))
+		jf_stream_seek(st, offset);
+
+	st->rpos = offset;
+	st->want = offset + size;
+	if (st->want > st->size)
+		st->want = st->size;
+
+	while (st->end < st->want) {
+		if (st->done) {
+			if (st->result == CURLE_OK || tries++ == STREAM_RETRIES)
+				break;
+			/*
+			 * The connection went away under us, a short read
+			 * looks like EOF to the kernel so pick up where we
+			 * left off.
+			 */
+			st->restart_off = st->end;
+			st->restart = true;
+			st->done = false;
+			ra_queue_stream(st);
+		} else if (st->paused && !st->unpause) {
+			st->unpause = true;
+			ra_queue_stream(st);
+		}
+		waited = true;
+		pthread_cond_wait(&st->cond, &st->lock);
+	}
+
+	if (st->end > offset) {
+		len = st->end - offset;
+		if (len > size)
+			len = size;
+		ra_copy_out(st, buf, offset, len);
+	}
+	st->rpos = offset + len;
+
+	/* Let it get ahead again */
+	if (st->paused && !st->unpause && ra_want_more(st)) {
+		st->unpause = true;
+		ra_queue_stream(st);
+	}
+
+	failed = st->done && st->result != CURLE_OK;
+
+	pthread_mutex_unlock(&st->lock);
+
+	if (waited)
+		jf_stats_inc(ra_misses);
+	else
+		jf_stats_inc(ra_hits);
+
+	jf_prefetch_check(st, offset + len);
+
+	if (len == 0 && failed)
+		return -1;
+
+	return len;
+}
+
+static struct jf_stream *jf_stream_new(const struct jf_file *jf)
+{
+	struct jf_stream *st;
+
+	if (!jf_engine_running())
+		return NULL;
+
+	st = calloc(1, sizeof(struct jf_stream));
+	if (!st)
+		return NULL;
+
+	pthread_mutex_init(&st->lock, NULL);
+	pthread_cond_init(&st->cond, NULL);
+	st->url = strdup(jf->audio);
+	st->name = strdup(jf->name);
+	st->size = jf->size;
+	st->bitrate = audio_fmts[jf->audio_fmt].kbps * 1000 / 8;
+	st->cf = jf_cache_open(jf->id, audio_fmts[jf->audio_fmt].name,
+			       jf->size);
+	jf_prefetch_claim(jf->id, jf->audio_fmt);
+
+	return st;
+}
+
+static void jf_stream_free(struct jf_stream *st)
+{
+	pthread_mutex_lock(&st->lock);
+	st->closing = true;
+	ra_queue_stream(st);
+	while (!st->detached)
+		pthread_cond_wait(&st->cond, &st->lock);
+	pthread_mutex_unlock(&st->lock);
+
+	jf_prefetch_release(st);
+	jf_cache_close(st->cf);
+
+	for (int i = 0; i < RA_NR_BLOCKS; i++)
+		free(st->blocks[i]);
+	pthread_cond_destroy(&st->cond);
+	pthread_mutex_destroy(&st->lock);
+
+	free(st->url);
+	free(st->name);
+	free(st);
+}
+
+/*
+ * Names are batched unless they have a space in them, as the API takes
+ * a '+' (i.e space) separated list of them. Batched results can only be
+ * matched up by name though, so if ours isn't found among them (the API
+ * matching it some other way) it's looked up on its own, taking the
+ * first result as we always did.
+ */
+static uint64_t lookup_artist_id(const char *name)
+{
+	char api[API_URL_MAX_LEN];
+	uint64_t aid = 0;
+	char *cstr;
+	CURL *curl;
 	json_t *root;
 	json_t *results;
-	json_t *entities;
-	struct jf_file *jfile;
+	struct curl_buf curl_buf = {};
+	static const char *api_fmt =
+		"https://api.jamendo.com/v3.0/artists/"
+		"?client_id=%s&format=json&name=%s";
+
+	if (!strchr(name, ' ') && strlen(name) <= BATCH_NAME_MAX) {
+		struct jf_batch_member m = { .name = name };
+
+		if (jf_batch_lookup(JF_BATCH_ARTIST_IDS, 0, &m) == -1)
+			return 0;
+		if (m.id)
+			return m.id;
+	}
+
+	curl = curl_pool_get();
+	cstr = curl_easy_escape(curl, name, 0);
+	curl_pool_put(curl);
+
+	snprintf(api, sizeof(api), api_fmt, CLIENT_ID, cstr);
+
+	dbg("** api : %s\n", api);
+	curl_perform(api, &curl_buf);
+
+	curl_free(cstr);
+
+	root = json_loads(curl_buf.buf, 0, NULL);
+	results = json_object_get(root, "results");
+	if (json_array_size(results) > 0) {
+		json_t *obj;
+		json_t *id;
+
+		obj = json_array_get(results, 0);
+		id = json_object_get(obj, "id");
+		aid = parse_id(json_string_value(id));
+	}
+
+	json_decref(root);
+	free(curl_buf.buf);
+
+	return aid;
+}
+
+/* The autocomplete URL for an artists/x/y/z path */
+static void autocomplete_api(char *api, size_t size, const char *path,
+			     enum jf_autocomplete_entity entity)
+{
+	char prefix[4] = {};
+	const char *ptr;
+	static const char *api_fmt =
+		"https://api.jamendo.com/v3.0/autocomplete/"
+		"?client_id=%s&format=json&prefix=%s&entity=%s";
+
+	ptr = strchr(path, '/');
+	ptr++;
+	ptr = strchr(ptr, '/');
+
+	prefix[0] = *++ptr;
+	ptr += 2;
+	prefix[1] = *ptr;
+	ptr += 2;
+	prefix[2] = *ptr;
+
+	snprintf(api, size, api_fmt, CLIENT_ID, prefix,
+		 jf_autocomplete_entities[entity]);
+}
+
+static int do_curl_autocomplete(const char *path,
+				const struct dir_entry *dentry)
+{
+	int ret;
+	char api[API_URL_MAX_LEN];
+	struct jf_listing ls;
+
+	autocomplete_api(api, sizeof(api), path, dentry->entity);
+
+	listing_init(&ls, path, dentry);
+	ret = api_fetch_all(api, set_file_entity, &ls);
+	if (ret == 0)
+		listing_finish(&ls, path,
+			       (enum jf_dentry_type)dentry->entity);
+	else
+		free_dentry(ls.dentry);
+
+	return ret;
+}
+
+/*
+ * Artists found via autocomplete only come with a name, the id is looked
+ * up the first time it's needed. If two threads race, the first one in
+ * wins.
+ */
+static uint64_t jf_file_artist_id(struct jf_file *jfile)
+{
+	uint64_t id;
+	uint64_t expected = 0;
+
+	id = __atomic_load_n(&jfile->id, __ATOMIC_ACQUIRE);
+	if (id)
+		return id;
+
+	id = lookup_artist_id(jfile->orig_name);
+	if (!id)
+		return 0;
+
+	if (!__atomic_compare_exchange_n(&jfile->id, &expected, id, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		id = expected;
+
+	return id;
+}
+
+static void artist_albums_set(const char *path,
+			      const struct dir_entry *prev_dir, json_t *albums)
+{
+	struct jf_listing ls;
+	size_t nr_new = 0;
+	json_t *root;
+
+	root = json_pack("{s:O}", "results", albums);
+	listing_init(&ls, path, prev_dir);
+	set_files_album(root, &ls, &nr_new);
+	listing_finish(&ls, path, JF_DT_ALBUM);
+	json_decref(root);
+}
+
+static int artist_albums_populate(const char *path,
+				  const struct dir_entry *dentry,
+				  struct jf_file *jfile)
+{
+	struct jf_batch_member m = {};
+	int ret;
+
+	m.id = jf_file_artist_id(jfile);
+	if (!m.id)
+		return -1;
+
+	m.results = json_array();
+	ret = jf_batch_lookup(JF_BATCH_ALBUMS, 0, &m);
+	if (ret == 0)
+		artist_albums_set(path, dentry, m.results);
+	json_decref(m.results);
+
+	return ret;
+}
+
+static int album_tracks_populate(const char *path,
+				 const struct jf_file *jfile)
+{
+	struct jf_batch_member m = { .id = jfile->id };
+	struct album_table *at;
+
+	at = album_table_get(jfile->id, jfile->audio_fmt);
+	if (!at) {
+		if (jf_batch_lookup(JF_BATCH_TRACKS, jfile->audio_fmt,
+				    &m) == -1)
+			return -1;
+
+		/* Not found, don't keep that for the other formats */
+		at = album_table_new(m.results, jfile->id, jfile->audio_fmt);
+		if (m.results)
+			album_table_add(at);
+		json_decref(m.results);
+	}
+
+	set_files_tracks(at, &audio_fmts[jfile->audio_fmt], path);
+	album_table_put(at);
+
+	return 0;
+}
+
+static int do_curl(const char *path, const struct dir_entry *dentry,
+		   struct jf_file *jfile)
+{
+	if (dentry->type == JF_DT_ARTIST)
+		return artist_albums_populate(path, dentry, jfile);
+	else if (dentry->type == JF_DT_FORMAT)
+		return album_tracks_populate(path, jfile);
+
+	return 0;
+}
+
+static void fstree_populate_a_z(const char *path,
+				const struct dir_entry *prev_dir)
+{
+	struct dir_entry *dentry;
+
+	dentry = new_dentry();
+
+	for (int c = 'a', i = 0; c <= 'z'; c++, i++) {
+		struct jf_file *jf_file;
+		char name = c;
+
+		jf_file = new_jf_file(dentry);
+		jf_file->name = jf_arena_strndup(dentry->arena, &name, 1);
+		jf_file->mode = 0555 | S_IFDIR;
+
+		if (prev_dir->type == JF_DT_TL_ARTISTS ||
+		    prev_dir->type == JF_DT_TL_A)
+			jf_file->nlink = DIR_NLINK_NR + 26;
+
+		ac_btree_add(dentry->jfiles, jf_file);
+	}
+	dentry->path = strdup(path);
+	dentry->entity = prev_dir->entity;
+
+	if (prev_dir->type == JF_DT_TL_ARTISTS)
+		dentry->type = JF_DT_TL_A;
+	else
+		dentry->type = prev_dir->type + 1;
+
+	fstree_add(dentry);
+}
+
+/*
+ * Fill in the directory at path, whose entry is jfilep in dentry.
+ * Returns -1 if we failed to fetch it.
+ */
+static int fstree_populate(const char *path, const struct dir_entry *dentry,
+			   struct jf_file *jfilep)
+{
+	switch (dentry->type) {
+	case JF_DT_TL_ARTISTS:
+	case JF_DT_TL_A ... JF_DT_TL_AA:
+		fstree_populate_a_z(path, dentry);
+		return 0;
+	case JF_DT_TL_AAA:
+		return do_curl_autocomplete(path, dentry);
+	case JF_DT_ALBUM:
+		set_files_format(jfilep->id, path);
+		return 0;
+	default:
+		return do_curl(path, dentry, jfilep);
+	}
+}
+
+/* A directory currently being fetched */
+struct inflight {
+	char *path;
+	pthread_cond_t cond;
+	bool done;
+	int result;
+	int refs;
+
+	/* A background guess, see spec_fetch() */
+	bool spec;
+	/* Someone in the foreground has taken over fetching it */
+	bool superseded;
+};
+
+static ac_slist_t *inflight;
+static pthread_mutex_t inflight_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void inflight_put(struct inflight *ifl)
+{
+	if (--ifl->refs > 0)
+		return;
+
+	pthread_cond_destroy(&ifl->cond);
+	free(ifl->path);
+	free(ifl);
+}
+
+/* Called with inflight_lock held */
+static struct inflight *inflight_find(const char *path)
+{
+	ac_slist_t *p;
+
+	for (p = inflight; p; p = p->next) {
+		struct inflight *ifl = p->data;
+
+		if (strcmp(ifl->path, path) == 0)
+			return ifl;
+	}
+
+	return NULL;
+}
+
+/* Called with inflight_lock held */
+static struct inflight *inflight_new(const char *path)
+{
+	struct inflight *ifl;
+
+	ifl = calloc(1, sizeof(struct inflight));
+	ifl->path = strdup(path);
+	pthread_cond_init(&ifl->cond, NULL);
+	ifl->refs = 1;
+	ac_slist_add(&inflight, ifl);
+
+	return ifl;
+}
+
+/*
+ * Hand the result to anyone waiting on it, if it was fetched it must be
+ * in the fstree by now.
+ */
+static void inflight_done(struct inflight *ifl, int ret)
+{
+	pthread_mutex_lock(&inflight_lock);
+	ifl->done = true;
+	ifl->result = ret;
+	pthread_cond_broadcast(&ifl->cond);
+	if (!ifl->superseded)
+		ac_slist_remove(&inflight, ifl, NULL);
+	inflight_put(ifl);
+	pthread_mutex_unlock(&inflight_lock);
+}
+
+/*
+ * Take over from a speculative fetch still sitting behind the background
+ * work. Anyone waiting on it goes and waits on ours instead. Called with
+ * inflight_lock held.
+ */
+static void inflight_supersede(struct inflight *ifl)
+{
+	ifl->superseded = true;
+	ac_slist_remove(&inflight, ifl, NULL);
+	pthread_cond_broadcast(&ifl->cond);
+}
+
+/*
+ * Populate a directory that isn't in the fstree yet, making sure it's
+ * only fetched once no matter how many threads want it at the same
+ * time. Whoever gets in first does the fetch, anyone else asking for
+ * the same path meanwhile waits for it and gets the same result.
+ *
+ * Speculative fetches are the exception: if one fails it's tried again
+ * for real, and someone in the foreground doesn't wait on one at
+ * background priority, they fetch it themselves.
+ *
+ * Called outside of a read section with dentry pinned.
+ */
+static int fstree_populate_once(const char *path,
+				const struct dir_entry *dentry,
+				struct jf_file *jfilep)
+{
+	struct inflight *ifl;
+	unsigned int epoch;
+	bool there;
+	int ret;
+
+	pthread_mutex_lock(&inflight_lock);
+	for (;;) {
+		bool retry;
+
+		ifl = inflight_find(path);
+		if (!ifl)
+			break;
+		if (ifl->spec && api_prio < JF_PRIO_BG) {
+			inflight_supersede(ifl);
+			break;
+		}
+
+		ifl->refs++;
+		while (!ifl->done && !ifl->superseded)
+			pthread_cond_wait(&ifl->cond, &inflight_lock);
+		ret = ifl->result;
+		retry = ifl->superseded || (ifl->spec && ret == -1);
+		inflight_put(ifl);
+		if (retry)
+			continue;
+		pthread_mutex_unlock(&inflight_lock);
+
+		jf_stats_inc(shared_fetches);
+
+		return ret;
+	}
+
+	/*
+	 * Someone may have finished fetching it since we looked, they add
+	 * it to the fstree before they remove it from inflight.
+	 */
+	epoch = fstree_read_begin();
+	there = fstree_lookup(path) != NULL;
+	fstree_read_end(epoch);
+	if (there) {
+		pthread_mutex_unlock(&inflight_lock);
+		return 0;
+	}
+
+	ifl = inflight_new(path);
+	pthread_mutex_unlock(&inflight_lock);
+
+	ret = fstree_populate(path, dentry, jfilep);
+	inflight_done(ifl, ret);
+
+	return ret;
+}
+
+/*
+ * In browse mode, entering one of the artists/x/y directories is a good
+ * sign that the artists/x/y/z ones under it are going to be looked at
+ * next, quite likely one after another. So the autocomplete requests for
+ * all 26 of them are made in the background, SPEC_CONCURRENCY at a time,
+ * rather than each costing a round trip as it's entered.
+ *
+ * Only the directory entered last is worked on, entering another stops
+ * anything not yet requested for the one before. Each is fetched under
+ * inflight, so background work wanting one already on its way waits for
+ * it, the foreground takes it over (see fstree_populate_once()). No more
+ * than spec_budget requests are made a minute, so someone wandering
+ * around the tree doesn't have us hammering the API.
+ */
+static char *spec_parent;
+static pthread_t spec_thread;
+static bool spec_running;
+static bool spec_exit;
+static pthread_mutex_t spec_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spec_cond = PTHREAD_COND_INITIALIZER;
+
+/* Only touched by the spec thread */
+static time_t spec_window;
+static long spec_used;
+
+static void spec_queue(const char *path)
+{
+	if (!spec_running)
+		return;
+
+	pthread_mutex_lock(&spec_lock);
+	free(spec_parent);
+	spec_parent = strdup(path);
+	pthread_cond_signal(&spec_cond);
+	pthread_mutex_unlock(&spec_lock);
+}
+
+/* Has something else come along for us to be doing? */
+static bool spec_cancelled(void)
+{
+	bool ret;
+
+	pthread_mutex_lock(&spec_lock);
+	ret = spec_exit || spec_parent;
+	pthread_mutex_unlock(&spec_lock);
+
+	return ret;
+}
+
+static bool spec_take_budget(void)
+{
+	time_t now = time(NULL);
+
+	if (now - spec_window >= SPEC_BUDGET_SECS) {
+		spec_window = now;
+		spec_used = 0;
+	}
+	if (spec_used >= spec_budget)
+		return false;
+	spec_used++;
+
+	return true;
+}
+
+/*
+ * Claim path for fetching, returns NULL if it's already there or someone
+ * else is fetching it.
+ */
+static struct inflight *spec_claim(const char *path)
+{
+	struct inflight *ifl = NULL;
+	unsigned int epoch;
+
+	epoch = fstree_read_begin();
+	pthread_mutex_lock(&inflight_lock);
+	if (!inflight_find(path) && !fstree_lookup(path)) {
+		ifl = inflight_new(path);
+		ifl->spec = true;
+	}
+	pthread_mutex_unlock(&inflight_lock);
+	fstree_read_end(epoch);
+
+	return ifl;
+}
+
+/* Returns false once there's no point in going on */
+static bool spec_submit(struct api_pager *pager, const char *parent,
+			enum jf_autocomplete_entity entity, int c)
+{
+	struct inflight *ifl;
+	char api[API_URL_MAX_LEN];
+	char path[PATH_MAX];
+
+	if (spec_cancelled() || !spec_take_budget())
+		return false;
+
+	snprintf(path, sizeof(path), "%s/%c", parent, c);
+	ifl = spec_claim(path);
+	if (!ifl) {
+		/* It didn't cost anything */
+		spec_used--;
+		return true;
+	}
+
+	autocomplete_api(api, sizeof(api), path, entity);
+
+	pthread_mutex_lock(&pager->lock);
+	pager->active++;
+	pthread_mutex_unlock(&pager->lock);
+
+	jf_stats_inc(spec_fetches);
+	api_page_submit(pager, api, 0, ifl);
+
+	return true;
+}
+
+/* Add the directory fetched by page to the fstree */
+static int spec_finish(const char *parent, const struct api_page *page)
+{
+	const struct inflight *ifl = page->data;
+	struct dir_entry *prev_dir;
+	struct jf_listing ls;
+	unsigned int epoch;
+	size_t nr_new = 0;
+	size_t nr;
+	bool pinned;
+	int ret;
+
+	if (page->res != CURLE_OK) {
+		dbg("jf_engine_submit(): %s\n", curl_easy_strerror(page->res));
+		return -1;
+	}
+
+	/* Pinned, so we needn't stay in the read section for the rest */
+	epoch = fstree_read_begin();
+	prev_dir = fstree_lookup(parent);
+	pinned = prev_dir && fstree_pin(prev_dir);
+	fstree_read_end(epoch);
+	if (!pinned)
+		return -1;
+
+	listing_init(&ls, ifl->path, prev_dir);
+	nr = api_page_parse(&page->buf, set_file_entity, &ls, &nr_new, NULL);
+	if (nr < API_PAGE_SIZE) {
+		listing_finish(&ls, ifl->path,
+			       (enum jf_dentry_type)prev_dir->entity);
+		ret = 0;
+	} else {
+		/* There's more to it, so fetch it all properly */
+		free_dentry(ls.dentry);
+		ret = do_curl_autocomplete(ifl->path, prev_dir);
+	}
+	fstree_unpin(prev_dir);
+
+	return ret;
+}
+
+static void spec_fetch(const char *parent)
+{
+	struct api_pager pager = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+	enum jf_autocomplete_entity entity;
+	const struct dir_entry *prev_dir;
+	unsigned int epoch;
+	int c = 'a';
+
+	epoch = fstree_read_begin();
+	prev_dir = fstree_lookup(parent);
+	if (!prev_dir) {
+		fstree_read_end(epoch);
+		return;
+	}
+	entity = prev_dir->entity;
+	fstree_read_end(epoch);
+
+	dbg("speculatively fetching [%s/*]\n", parent);
+
+	pthread_mutex_lock(&pager.lock);
+	while (c <= 'z' || pager.active > 0 || pager.ready) {
+		struct api_page *page;
+		struct inflight *ifl;
+		bool superseded;
+		int ret;
+
+		while (c <= 'z' && pager.active < SPEC_CONCURRENCY) {
+			bool more;
+
+			pthread_mutex_unlock(&pager.lock);
+			more = spec_submit(&pager, parent, entity, c);
+			pthread_mutex_lock(&pager.lock);
+			c = more ? c + 1 : 'z' + 1;
+		}
+
+		if (!pager.ready) {
+			pthread_cond_wait(&pager.cond, &pager.lock);
+			continue;
+		}
+		page = pager.ready;
+		pager.ready = page->next;
+		pthread_mutex_unlock(&pager.lock);
+
+		ifl = page->data;
+		pthread_mutex_lock(&inflight_lock);
+		superseded = ifl->superseded;
+		pthread_mutex_unlock(&inflight_lock);
+		/* Someone else has it, or will have shortly */
+		ret = superseded ? -1 : spec_finish(parent, page);
+		inflight_done(ifl, ret);
+		free(page->buf.buf);
+		free(page);
+
+		pthread_mutex_lock(&pager.lock);
+	}
+	pthread_mutex_unlock(&pager.lock);
+
+	pthread_mutex_destroy(&pager.lock);
+	pthread_cond_destroy(&pager.cond);
+}
+
+static void *spec_thread_fn(void *arg __unused)
+{
+	api_prio = JF_PRIO_BG;
+	api_stop = &spec_exit;
+
+	pthread_mutex_lock(&spec_lock);
+	while (!spec_exit) {
+		char *parent;
+
+		if (!spec_parent) {
+			pthread_cond_wait(&spec_cond, &spec_lock);
+			continue;
+		}
+		parent = spec_parent;
+		spec_parent = NULL;
+		pthread_mutex_unlock(&spec_lock);
+
+		spec_fetch(parent);
+		free(parent);
+
+		pthread_mutex_lock(&spec_lock);
+	}
+	pthread_mutex_unlock(&spec_lock);
+
+	return NULL;
+}
+
+static void spec_init(void)
+{
+	int err;
+
+	if (spec_budget <= 0)
+		return;
+
+	err = pthread_create(&spec_thread, NULL, spec_thread_fn, NULL);
+	if (err) {
+		dbg("pthread_create(): %s\n", strerror(err));
+		return;
+	}
+	spec_running = true;
+}
+
+/* Stop starting anything new, before the engine goes */
+static void spec_stop(void)
+{
+	pthread_mutex_lock(&spec_lock);
+	spec_exit = true;
+	pthread_cond_signal(&spec_cond);
+	pthread_mutex_unlock(&spec_lock);
+}
+
+/* Called after the engine has gone, so nothing is left outstanding */
+static void spec_destroy(void)
+{
+	if (!spec_running)
+		return;
+
+	pthread_join(spec_thread, NULL);
+	spec_running = false;
+
+	free(spec_parent);
+	spec_parent = NULL;
+}
+
+static ac_slist_t *reval_queue;
+static pthread_t reval_thread;
+static bool reval_running;
+static bool reval_exit;
+static pthread_mutex_t reval_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reval_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Anything fetched from the API longer ago than the TTL for its type is
+ * still served as is, but gets queued to be fetched again in the
+ * background.
+ */
+static void reval_check(struct dir_entry *dentry)
+{
+	time_t fetched = __atomic_load_n(&dentry->fetched, __ATOMIC_RELAXED);
+	long ttl = dentry_ttls[dentry->type];
+
+	if (!reval_running || !fetched || ttl <= 0)
+		return;
+	if (time(NULL) - fetched < ttl)
+		return;
+	if (__atomic_exchange_n(&dentry->reval_queued, true, __ATOMIC_ACQ_REL))
+		return;
+
+	dbg("queueing [%s] for revalidation\n", dentry->path);
+
+	pthread_mutex_lock(&reval_lock);
+	ac_slist_add(&reval_queue, strdup(dentry->path));
+	pthread_cond_signal(&reval_cond);
+	pthread_mutex_unlock(&reval_lock);
+}
+
+/*
+ * Get the dentry for the directory path is in (or for path itself for
+ * FOP_READDIR). If it's not in the fstree yet but its parent is, it's
+ * populated.
+ *
+ * Must be called in the read section begun as *epoch, the dentry is only
+ * good until it ends (unless it's pinned). We leave it while fetching
+ * anything, so *epoch may have changed by the time we return.
+ */
+static struct dir_entry *get_dentry(const char *path, enum file_op op,
+				    unsigned int *epoch)
+{
+	struct jf_file jfile;
+	struct jf_file jf = {};
+	struct jf_file *jfilep;
+	struct dir_entry *dentry;
+	const char *rest;
+	char *lpath = NULL;
+	char *orig_name = NULL;
+	uint64_t expected = 0;
+	size_t len = 0;
+	int ret;
+
+	switch (op) {
+	case FOP_GETATTR:
+	case FOP_READ:
+		len = strrchr(path, '/') - path;
+		break;
+	case FOP_READDIR:
+		len = strlen(path);
+		break;
+	}
+
+	dentry = fstree_walk(path, len, &rest);
+	if (rest == path + len)
+		goto out;
+
+	/* We can only fill in one level at a time */
+	if (memchr(rest, '/', path + len - rest)) {
+		dentry = NULL;
+		goto out;
+	}
+
+	lpath = strndup(path, len);
+	jfile.name = lpath + (rest - path);
+	jfilep = ac_btree_lookup(dentry_jfiles(dentry), &jfile);
+	if (!jfilep) {
+		dentry = NULL;
+		goto out;
+	}
+
+	/* Keep it from being evicted while we add to it */
+	if (!fstree_pin(dentry)) {
+		/* Too late, there's nowhere for it to go */
+		dentry = NULL;
+		goto out;
+	}
+
+	/*
+	 * Don't hold up freeing fstree entries while we're on the network.
+	 * dentry's entries can be swapped out if it's fetched again
+	 * meanwhile, so work from a copy of the one we want.
+	 */
+	if (jfilep->orig_name)
+		orig_name = strdup(jfilep->orig_name);
+	jf.orig_name = orig_name;
+	jf.id = __atomic_load_n(&jfilep->id, __ATOMIC_ACQUIRE);
+	jf.audio_fmt = jfilep->audio_fmt;
+	fstree_read_end(*epoch);
+
+	ret = fstree_populate_once(lpath, dentry, &jf);
+
+	*epoch = fstree_read_begin();
+	fstree_unpin(dentry);
+	free(orig_name);
+
+	/* Hang on to an artist id we had to look up */
+	jfilep = ac_btree_lookup(dentry_jfiles(dentry), &jfile);
+	if (jfilep && jf.id)
+		__atomic_compare_exchange_n(&jfilep->id, &expected, jf.id,
+					    false, __ATOMIC_ACQ_REL,
+					    __ATOMIC_ACQUIRE);
+	if (ret == -1) {
+		dentry = NULL;
+		goto out;
+	}
+
+	/* Entered an artists/x/y directory, get ahead of what's under it */
+	if (dentry->type == JF_DT_TL_AA)
+		spec_queue(lpath);
+
+	dentry = fstree_lookup(lpath);
+
+out:
+	if (dentry) {
+		fstree_touch(dentry);
+		reval_check(dentry);
+	}
+
+	free(lpath);
+
+	return dentry;
+}
+
+static void fstree_snapshot_save(void)
+{
+	struct jf_snapshot *snap;
+	unsigned int epoch;
+
+	if (!snapshot)
+		return;
+
+	/* Cleared first so any changes while we're at it aren't lost */
+	if (!__atomic_exchange_n(&snapshot_dirty, false, __ATOMIC_RELAXED))
+		return;
+
+	snap = jf_snapshot_new(snapshot_file);
+	if (!snap)
+		goto out_dirty;
+
+	/* Keep lazily resolved sizes from changing under us */
+	pthread_mutex_lock(&jf_file_info_lock);
+	epoch = fstree_read_begin();
+	for (int i = 0; i < FSTREE_SHARDS; i++) {
+		struct fstree_shard *shard = &fstree[i];
+
+		pthread_rwlock_rdlock(&shard->lock);
+		for (size_t b = 0; b < shard->nr_buckets; b++) {
+			const struct dir_entry *dentry = shard->buckets[b];
+
+			for ( ; dentry; dentry = dentry->hnext)
+				jf_snapshot_add(snap, dentry);
+		}
+		pthread_rwlock_unlock(&shard->lock);
+	}
+	fstree_read_end(epoch);
+	pthread_mutex_unlock(&jf_file_info_lock);
+
+	if (jf_snapshot_commit(snap, snapshot_flags) == 0)
+		return;
+
+out_dirty:
+	__atomic_store_n(&snapshot_dirty, true, __ATOMIC_RELAXED);
+}
+
+struct jf_inval_data {
+	uint64_t parent;
+	const ac_btree_t *other;
+};
+
+/*
+ * Have the kernel drop a name in a directory we've just re-fetched if
+ * it's gone, is new (it may have a negative entry for it) or has changed,
+ * along with any data it's keeping for it (see jf_open()).
+ */
+static void jf_inval_entry(const void *nodep, VISIT which, void *data)
+{
+	const struct jf_file *jfile = *(struct jf_file **)nodep;
+	const struct jf_inval_data *inval = data;
+	const struct jf_file *other;
+	uint64_t ino;
+
+	switch (which) {
+	case preorder:
+	case endorder:
+		return;
+	case postorder:
+	case leaf:
+		break;
+	}
+
+	other = ac_btree_lookup(inval->other, jfile);
+	if (other && jfile_same(jfile, other))
+		return;
+
+	fuse_lowlevel_notify_inval_entry(jf_se, inval->parent, jfile->name,
+					 strlen(jfile->name));
+	if (!S_ISREG(jfile->mode))
+		return;
+	ino = jf_inode_find(inval->parent, jfile->name);
+	if (ino)
+		fuse_lowlevel_notify_inval_inode(jf_se, ino, 0, 0);
+}
+
+/*
+ * The kernel may be holding onto entries and attributes for a directory
+ * for up to JF_ENTRY_TIMEOUT/JF_ATTR_TIMEOUT seconds, so tell it about
+ * anything that changed when it was re-fetched.
+ *
+ * Only called from the revalidation thread, never while handling a
+ * request, which would deadlock.
+ */
+static void jf_invalidate_dir(const char *path, const ac_btree_t *old,
+			      const ac_btree_t *new)
+{
+	struct jf_inval_data inval;
+
+	if (!jf_se || old == new)
+		return;
+
+	inval.parent = jf_inode_find_path(path);
+	if (!inval.parent)
+		return;
+
+	dbg("invalidating [%s] ino %lu\n", path, inval.parent);
+
+	fuse_lowlevel_notify_inval_inode(jf_se, inval.parent, 0, 0);
+
+	inval.other = new;
+	ac_btree_foreach_data(old, jf_inval_entry, &inval);
+	inval.other = old;
+	ac_btree_foreach_data(new, jf_inval_entry, &inval);
+}
+
+static void fstree_revalidate(const char *path)
+{
+	char *pathc;
 	struct dir_entry *dentry;
+	struct dir_entry *parent;
+	struct jf_file *jfilep = NULL;
+	const ac_btree_t *old = NULL;
+	unsigned int epoch;
+
+	dbg("revalidating [%s]\n", path);
+
+	epoch = fstree_read_begin();
+	dentry = fstree_lookup(path);
+	if (dentry)
+		old = dentry_jfiles(dentry);
+
+	pathc = strdup(path);
+	parent = fstree_lookup(dirname(pathc));
+	if (parent)
+		jfilep = lookup_jfile_from_dentry(path, parent);
+	if (jfilep && fstree_populate(path, parent, jfilep) == 0) {
+		jf_stats_inc(refreshes);
+		/* The replaced jfiles aren't freed until we're done */
+		dentry = fstree_lookup(path);
+		if (dentry && old)
+			jf_invalidate_dir(path, old, dentry_jfiles(dentry));
+		goto out_free;
+	}
 
-	root = json_loads(buf->buf, 0, NULL);
-	results = json_object_get(root, "results");
-	entities = json_object_get(results,
-				   jf_autocomplete_entities[prev_dir->entity]);
+	/* Leave it as it is, it'll be tried again next time it's used */
+	if (dentry)
+		__atomic_store_n(&dentry->reval_queued, false,
+				 __ATOMIC_RELEASE);
 
-	dentry = calloc(1, sizeof(struct dir_entry));
-	dentry->jfiles = ac_btree_new(compare_file_paths, free_jf_file);
+out_free:
+	fstree_read_end(epoch);
+	free(pathc);
+}
 
-	for (size_t i = 0; i < json_array_size(entities); i++) {
-		json_t *entity;
-		struct jf_file *jf_file;
+/*
+ * Fetches queued stale directories (nobody waits on these, they carry on
+ * seeing the old contents until the new ones are swapped in), keeps the
+ * fstree within --meta-size, frees what's been removed from it and
+ * periodically writes out the snapshot if anything has changed.
+ */
+static void *reval_thread_fn(void *arg __unused)
+{
+	struct timespec last_save;
 
-		entity = json_array_get(entities, i);
+	api_prio = JF_PRIO_BG;
+	clock_gettime(CLOCK_MONOTONIC, &last_save);
 
-		jf_file = calloc(1, sizeof(struct jf_file));
-		jf_file->orig_name = strdup(json_string_value(entity));
-		jf_file->name = strdup(json_string_value(entity));
-		normalise_fname(jf_file->name);
-		jf_file->mode = 0555 | S_IFDIR;
+	pthread_mutex_lock(&reval_lock);
+	while (!reval_exit) {
+		struct timespec now;
+		char *path;
 
-		ac_btree_add(dentry->jfiles, jf_file);
+		if (!reval_queue) {
+			struct timespec ts;
+
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += REVAL_WAIT_SECS;
+			pthread_cond_timedwait(&reval_cond, &reval_lock, &ts);
+		}
+
+		pthread_mutex_unlock(&reval_lock);
+		fstree_evict();
+		fstree_reclaim();
+		pthread_mutex_lock(&reval_lock);
+
+		if (reval_queue) {
+			path = reval_queue->data;
+			ac_slist_remove(&reval_queue, path, NULL);
+
+			pthread_mutex_unlock(&reval_lock);
+			fstree_revalidate(path);
+			free(path);
+			pthread_mutex_lock(&reval_lock);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec - last_save.tv_sec < SNAPSHOT_SECS)
+			continue;
+
+		pthread_mutex_unlock(&reval_lock);
+		fstree_snapshot_save();
+		pthread_mutex_lock(&reval_lock);
+		last_save = now;
 	}
-	dentry->path = strdup(path);
-	dentry->type = (enum jf_dentry_type)prev_dir->entity;
-	ac_btree_add(fstree, dentry);
+	pthread_mutex_unlock(&reval_lock);
 
-	jfile = lookup_jfile_from_dentry(path, prev_dir);
-	if (jfile)
-		jfile->nlink = DIR_NLINK_NR + json_array_size(entities);
+	return NULL;
+}
 
-	json_decref(root);
+static void reval_init(void)
+{
+	int err;
+
+	err = pthread_create(&reval_thread, NULL, reval_thread_fn, NULL);
+	if (err) {
+		dbg("pthread_create(): %s\n", strerror(err));
+		return;
+	}
+	reval_running = true;
 }
 
-static size_t curl_writeb_cb(void *contents, size_t size, size_t nmemb,
-			     void *userp)
+static void reval_destroy(void)
 {
-	void *ptr;
-	size_t realsize = size * nmemb;
-	struct curl_buf *curl_buf = userp;
+	if (!reval_running)
+		return;
 
-	ptr = realloc(curl_buf->buf, curl_buf->len + realsize + 1);
-	if (!ptr)
-		return 0;
-	curl_buf->buf = ptr;
+	pthread_mutex_lock(&reval_lock);
+	reval_exit = true;
+	pthread_cond_signal(&reval_cond);
+	pthread_mutex_unlock(&reval_lock);
 
-	memcpy(curl_buf->buf + curl_buf->len, contents, realsize);
-	curl_buf->len += realsize;
-	curl_buf->buf[curl_buf->len] = '\0';
+	pthread_join(reval_thread, NULL);
+	reval_running = false;
 
-	return realsize;
+	ac_slist_destroy(&reval_queue, free);
 }
 
-static int curl_perform(const char *url, struct curl_buf *curl_buf)
+/*
+ * With --warm-up, the album listings of all the artists in artists.json
+ * are fetched in the background at startup, BATCH_MAX artists to a
+ * request, so they're there by the time anyone looks.
+ */
+static pthread_t warm_up_thread;
+static bool warm_up_running;
+static bool warm_up_exit;
+
+struct warm_up_artists {
+	struct jf_batch_member *members;
+	char **paths;
+	size_t nr;
+};
+
+static void warm_up_add(const void *nodep, VISIT which, void *data)
 {
-	int ret = 0;
-	CURL *curl;
-	CURLcode res;
+	const struct jf_file *jfile = *(const struct jf_file **)nodep;
+	struct warm_up_artists *wa = data;
+	char path[PATH_MAX];
+
+	switch (which) {
+	case preorder:
+	case endorder:
+		return;
+	case postorder:
+	case leaf:
+		break;
+	}
 
-	curl = curl_easy_init();
+	/* Already there, e.g from a snapshot */
+	snprintf(path, sizeof(path), "/%s", jfile->name);
+	if (!jfile->id || fstree_lookup(path))
+		return;
 
-	curl_easy_setopt(curl, CURLOPT_URL, url);
+	wa->members[wa->nr].id = jfile->id;
+	wa->paths[wa->nr] = strdup(path);
+	wa->nr++;
+}
 
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_writeb_cb);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, curl_buf);
+static void *warm_up_thread_fn(void *arg __unused)
+{
+	struct warm_up_artists wa = {};
+	struct dir_entry *root;
+	unsigned int epoch;
+	size_t nr;
+
+	api_prio = JF_PRIO_BG;
+	api_stop = &warm_up_exit;
+
+	epoch = fstree_read_begin();
+	root = fstree_lookup("/");
+	if (!root || root->type != JF_DT_ARTIST) {
+		fstree_read_end(epoch);
+		return NULL;
+	}
+	nr = jfiles_count(dentry_jfiles(root));
+	wa.members = calloc(nr, sizeof(struct jf_batch_member));
+	wa.paths = calloc(nr, sizeof(char *));
+	ac_btree_foreach_data(dentry_jfiles(root), warm_up_add, &wa);
+	fstree_read_end(epoch);
+
+	for (size_t i = 0; i < wa.nr; ) {
+		struct jf_batch_member *members[BATCH_MAX];
+		struct inflight *ifls[BATCH_MAX];
+		size_t n = 0;
+		int ret;
+
+		if (__atomic_load_n(&warm_up_exit, __ATOMIC_RELAXED))
+			break;
 
-	curl_easy_setopt(curl, CURLOPT_USERAGENT, "jamendo-fuse / libcurl");
+		/*
+		 * Claimed like any other fetch, so anyone wanting one of
+		 * them meanwhile waits for it rather than fetching it too.
+		 * Skip any that have been or are being fetched since.
+		 */
+		epoch = fstree_read_begin();
+		pthread_mutex_lock(&inflight_lock);
+		for ( ; n < BATCH_MAX && i < wa.nr; i++) {
+			const char *path = wa.paths[i];
+
+			if (inflight_find(path) || fstree_lookup(path))
+				continue;
+			ifls[n] = inflight_new(path);
+			members[n] = &wa.members[i];
+			members[n]->results = json_array();
+			n++;
+		}
+		pthread_mutex_unlock(&inflight_lock);
+		fstree_read_end(epoch);
 
-	res = curl_easy_perform(curl);
-	if (res != CURLE_OK) {
-		dbg("curl_easy_perform(): %s\n", curl_easy_strerror(res));
-		ret = -1;
+		if (n == 0)
+			continue;
+
+		ret = jf_batch_run(JF_BATCH_ALBUMS, 0, members, n);
+
+		epoch = fstree_read_begin();
+		root = fstree_lookup("/");
+		if (!root)
+			ret = -1;
+		for (size_t j = 0; j < n; j++) {
+			if (ret == 0)
+				artist_albums_set(ifls[j]->path, root,
+						  members[j]->results);
+			json_decref(members[j]->results);
+		}
+		fstree_read_end(epoch);
+
+		/* They're in the fstree before anyone waiting is woken */
+		for (size_t j = 0; j < n; j++)
+			inflight_done(ifls[j], ret);
 	}
 
-	curl_easy_cleanup(curl);
+	dbg("warmed up %zu artists\n", wa.nr);
 
-	return ret;
+	for (size_t i = 0; i < wa.nr; i++)
+		free(wa.paths[i]);
+	free(wa.paths);
+	free(wa.members);
+
+	return NULL;
+}
+
+static void warm_up_init(void)
+{
+	int err;
+
+	if (!warm_up)
+		return;
+
+	err = pthread_create(&warm_up_thread, NULL, warm_up_thread_fn, NULL);
+	if (err) {
+		dbg("pthread_create(): %s\n", strerror(err));
+		return;
+	}
+	warm_up_running = true;
 }
 
-static ac_slist_t *curls;
 /*
- * We _really_ want to use persistent connections when reading the
- * file data. Not doing so introduces too much latency and audio
- * apps suffer buffer drop outs. E.g ogg123 would often get down to
- * a 22% buffer and sometime below and stutter. With this I don't
- * really see it drop below 77%.
- *
- * I'm sure this will also even if very slightly reduce load on the
- * end server.
- *
- * The reason we use thread local storage for this curl handle
- * is due to FUSE being multi-threaded underneath and this seemed
- * like the simplest way to have per thread curl handles.
+ * Called before the engine goes, with warm_up_exit set it stops between
+ * pages so at most has the requests already made to wait for.
  */
-static __thread CURL *read_file_curl;
-static int curl_read_file(const char *url, char *buf, size_t size,
-			  off_t offset)
+static void warm_up_destroy(void)
 {
-	int ret;
-	CURLcode res;
-	char range[64];
-	struct curl_buf curl_buf = {};
+	if (!warm_up_running)
+		return;
 
-	snprintf(range, sizeof(range), "%zu-%zu", offset, offset + size - 1);
-	dbg("Requesting bytes [%s] from : %s\n", range, url);
+	pthread_join(warm_up_thread, NULL);
+	warm_up_running = false;
+}
+
+struct fstree_load {
+	struct dir_entry **dentries;
+	size_t nr;
+};
+
+static void fstree_load_dentry(struct dir_entry *dentry, void *data)
+{
+	struct fstree_load *load = data;
+
+	load->dentries = realloc(load->dentries,
+				 (load->nr + 1) * sizeof(struct dir_entry *));
+	load->dentries[load->nr++] = dentry;
+}
+
+/* A directory's path is always shorter than those of its children */
+static int compare_dentry_depth(const void *a, const void *b)
+{
+	const struct dir_entry *dentry1 = *(struct dir_entry * const *)a;
+	const struct dir_entry *dentry2 = *(struct dir_entry * const *)b;
+	size_t len1 = strlen(dentry1->path);
+	size_t len2 = strlen(dentry2->path);
+
+	return (len1 > len2) - (len1 < len2);
+}
+
+/*
+ * Load the snapshot into the fstree, parents before children so each
+ * one has somewhere to go. Directories in the root from artists.json
+ * don't have their link count set until they're populated, so do that
+ * here.
+ */
+static void fstree_load_snapshot(void)
+{
+	struct fstree_load load = {};
+
+	jf_snapshot_load(snapshot_file, snapshot_flags, fstree_load_dentry,
+			 &load);
+	qsort(load.dentries, load.nr, sizeof(struct dir_entry *),
+	      compare_dentry_depth);
+
+	for (size_t i = 0; i < load.nr; i++) {
+		struct dir_entry *dentry = load.dentries[i];
+		struct dir_entry *parent;
+		struct jf_file *jfile = NULL;
+		char *pathc;
+
+		pathc = strdup(dentry->path);
+		parent = fstree_lookup(dirname(pathc));
+		free(pathc);
+		if (!parent || fstree_lookup(dentry->path)) {
+			free_dentry(dentry);
+			continue;
+		}
 
-	if (!read_file_curl) {
-		read_file_curl = curl_easy_init();
-		ac_slist_preadd(&curls, read_file_curl);
-		dbg("CURL created new curl handle @ %p\n", read_file_curl);
+		jfile = lookup_jfile_from_dentry(dentry->path, parent);
+		if (jfile && jfile->nlink == 0)
+			jfile->nlink = DIR_NLINK_NR +
+				       jfiles_count(dentry->jfiles);
+		fstree_add(dentry);
 	}
+	free(load.dentries);
+}
 
-	curl_easy_setopt(read_file_curl, CURLOPT_URL, url);
+/*
+ * Fill in st for jfilep, which is in a directory of type, timeout being
+ * how long the kernel can hang onto it for.
+ */
+static void jf_stat_jfile(const struct jf_file *jfilep,
+			  enum jf_dentry_type type, struct stat *st,
+			  double *timeout)
+{
+	memset(st, 0, sizeof(struct stat));
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_atime = st->st_mtime = time(NULL);
+	*timeout = JF_ATTR_TIMEOUT;
 
-	curl_easy_setopt(read_file_curl, CURLOPT_RANGE, range);
-	curl_easy_setopt(read_file_curl, CURLOPT_WRITEFUNCTION, curl_writeb_cb);
-	curl_easy_setopt(read_file_curl, CURLOPT_WRITEDATA, &curl_buf);
+	st->st_mode = jfilep->mode;
 
-	curl_easy_setopt(read_file_curl, CURLOPT_USERAGENT,
-			 "jamendo-fuse / libcurl");
+	if (st->st_mode & S_IFREG) {
+		/*
+		 * Read once, it can be resolved under us. blocks is set
+		 * before size is published, so is only good once it has.
+		 */
+		off_t size = __atomic_load_n(&jfilep->size, __ATOMIC_ACQUIRE);
 
-	if (debug) {
-		curl_easy_setopt(read_file_curl, CURLOPT_STDERR, stdout);
-		curl_easy_setopt(read_file_curl, CURLOPT_VERBOSE, 1L);
+		st->st_nlink = 1;
+		if (size == JF_SIZE_UNKNOWN) {
+			/* Don't let the kernel cache a size we don't know */
+			*timeout = 0.0;
+		} else {
+			st->st_size = size;
+			st->st_blocks = jfilep->blocks;
+		}
 	}
 
-	res = curl_easy_perform(read_file_curl);
-	if (res != CURLE_OK) {
-		dbg("CURL curl_easy_perform(): %s\n", curl_easy_strerror(res));
-		ret = -1;
+	if (st->st_mode & S_IFDIR || type == JF_DT_TRACK) {
+		if (jfilep->mtime)
+			st->st_atime = st->st_mtime = jfilep->mtime;
+
+		if (st->st_mode & S_IFDIR)
+			st->st_nlink = __atomic_load_n(&jfilep->nlink,
+						       __ATOMIC_RELAXED);
+	}
+}
+
+/* Like jf_stat_jfile() but for path, resolving the size if need be */
+static int jf_stat(const char *path, struct stat *st, double *timeout)
+{
+	struct jf_file *jfilep = NULL;
+	struct dir_entry *dentry;
+	unsigned int epoch;
+
+	dbg("path [%s]\n", path);
+
+	if (strcmp(path, "/") == 0) {
+		memset(st, 0, sizeof(struct stat));
+		st->st_uid = getuid();
+		st->st_gid = getgid();
+		st->st_atime = st->st_mtime = time(NULL);
+		st->st_mode = 0555 | S_IFDIR;
+		st->st_nlink = nr_root_items;
+		*timeout = JF_ATTR_TIMEOUT;
+		return 0;
+	}
+
+	epoch = fstree_read_begin();
+	dentry = get_dentry(path, FOP_GETATTR, &epoch);
+	if (dentry)
+		jfilep = lookup_jfile_from_dentry(path, dentry);
+	if (jfilep && jfilep->mode & S_IFREG) {
+		jf_file_resolve_size(path, dentry, jfilep, &epoch);
+		/* Still stat'able if that failed, and it may have changed */
+		jfilep = lookup_jfile_from_dentry(path, dentry);
+	}
+	if (jfilep)
+		jf_stat_jfile(jfilep, dentry->type, st, timeout);
+	fstree_read_end(epoch);
+
+	return jfilep ? 0 : -1;
+}
+
+static void jf_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	struct fuse_entry_param e = {};
+	double timeout;
+	char *path;
+
+	path = jf_inode_child_path(parent, name);
+	if (!path || jf_stat(path, &e.attr, &timeout) == -1)
+		goto out_enoent;
+
+	e.ino = jf_inode_lookup(parent, name);
+	if (!e.ino)
+		goto out_enoent;
+
+	e.attr.st_ino = e.ino;
+	e.attr_timeout = timeout;
+	e.entry_timeout = JF_ENTRY_TIMEOUT;
+	fuse_reply_entry(req, &e);
+	free(path);
+
+	return;
+
+out_enoent:
+	fuse_reply_err(req, ENOENT);
+	free(path);
+}
+
+static void jf_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	jf_inode_forget(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void jf_forget_multi(fuse_req_t req, size_t count,
+			    struct fuse_forget_data *forgets)
+{
+	for (size_t i = 0; i < count; i++)
+		jf_inode_forget(forgets[i].ino, forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+static void jf_getattr(fuse_req_t req, fuse_ino_t ino,
+		       struct fuse_file_info *fi __unused)
+{
+	struct stat st;
+	double timeout;
+	char *path;
+
+	path = jf_inode_path(ino);
+	if (!path || jf_stat(path, &st, &timeout) == -1) {
+		fuse_reply_err(req, ENOENT);
 		goto out_free;
 	}
 
-	if (curl_buf.len > 0)
-		memcpy(buf, curl_buf.buf, curl_buf.len);
-	ret = curl_buf.len;
+	st.st_ino = ino;
+	fuse_reply_attr(req, &st, timeout);
 
 out_free:
-	free(curl_buf.buf);
+	free(path);
+}
 
-	return ret;
+/*
+ * Per opendir(3) state. The directory's entries are copied out at opendir
+ * time (the dentry may be evicted or revalidated before we're done) and
+ * readdir hands them out from there, offset n being the nth entry with 0
+ * and 1 being "." and "..".
+ */
+struct jf_dirent {
+	const char *name;
+	struct stat st;
+	double timeout;
+};
+
+struct jf_dir {
+	enum jf_dentry_type type;
+	struct jf_arena *arena;
+	struct jf_dirent *ents;
+	size_t nr;
+};
+
+static void jf_dir_add(const void *nodep, VISIT which, void *data)
+{
+	const struct jf_file *jfile = *(struct jf_file **)nodep;
+	struct jf_dir *dir = data;
+	struct jf_dirent *ent;
+
+	switch (which) {
+	case preorder:
+	case endorder:
+		return;
+	case postorder:
+	case leaf:
+		break;
+	}
+
+	ent = &dir->ents[dir->nr++];
+	ent->name = jf_arena_strdup(dir->arena, jfile->name);
+	jf_stat_jfile(jfile, dir->type, &ent->st, &ent->timeout);
 }
 
-static char *lookup_artist_id(const char *name)
+static void jf_opendir(fuse_req_t req, fuse_ino_t ino,
+		       struct fuse_file_info *fi)
 {
-	char api[API_URL_MAX_LEN];
-	char *aid = NULL;
-	char *cstr;
-	CURL *curl;
-	json_t *root;
-	json_t *results;
-	struct curl_buf curl_buf = {};
-	static const char *api_fmt =
-		"https://api.jamendo.com/v3.0/artists/"
-		"?client_id=%s&format=json&name=%s";
+	struct dir_entry *dentry;
+	struct jf_dir *dir;
+	unsigned int epoch;
+	char *path;
 
-	curl = curl_easy_init();
-	cstr = curl_easy_escape(curl, name, 0);
+	path = jf_inode_path(ino);
+	if (!path) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
 
-	snprintf(api, sizeof(api), api_fmt, CLIENT_ID, cstr);
+	dbg("path [%s]\n", path);
 
-	dbg("** api : %s\n", api);
-	curl_perform(api, &curl_buf);
+	dir = calloc(1, sizeof(struct jf_dir));
+	dir->arena = jf_arena_new();
 
-	curl_free(cstr);
-	curl_easy_cleanup(curl);
+	epoch = fstree_read_begin();
+	dentry = get_dentry(path, FOP_READDIR, &epoch);
+	if (dentry) {
+		const ac_btree_t *jfiles = dentry_jfiles(dentry);
 
-	root = json_loads(curl_buf.buf, 0, NULL);
-	results = json_object_get(root, "results");
-	if (json_array_size(results) > 0) {
-		json_t *obj;
-		json_t *id;
+		dir->type = dentry->type;
+		dir->ents = malloc(jfiles_count(jfiles) *
+				   sizeof(struct jf_dirent));
+		ac_btree_foreach_data(jfiles, jf_dir_add, dir);
+	}
+	fstree_read_end(epoch);
 
-		obj = json_array_get(results, 0);
-		id = json_object_get(obj, "id");
-		aid = strdup(json_string_value(id));
+	fi->fh = (uintptr_t)dir;
+	fuse_reply_open(req, fi);
+	free(path);
+}
+
+static const char *jf_dir_name(const struct jf_dir *dir, size_t idx)
+{
+	if (idx == 0)
+		return ".";
+	if (idx == 1)
+		return "..";
+
+	return dir->ents[idx - 2].name;
+}
+
+static void jf_readdir(fuse_req_t req, fuse_ino_t ino __unused, size_t size,
+		       off_t offset, struct fuse_file_info *fi)
+{
+	const struct jf_dir *dir = (struct jf_dir *)(uintptr_t)fi->fh;
+	char *buf;
+	size_t len = 0;
+
+	buf = malloc(size);
+	for (size_t i = offset; i < dir->nr + 2; i++) {
+		struct stat sb = {};
+		size_t ret;
+
+		/* We don't know the inode numbers until they're looked up */
+		sb.st_ino = JF_UNKNOWN_INO;
+		sb.st_mode = i < 2 ? S_IFDIR : dir->ents[i - 2].st.st_mode;
+		ret = fuse_add_direntry(req, buf + len, size - len,
+					jf_dir_name(dir, i), &sb, i + 1);
+		if (ret > size - len)
+			break;
+		len += ret;
 	}
 
-	json_decref(root);
-	free(curl_buf.buf);
+	fuse_reply_buf(req, buf, len);
+	free(buf);
+}
+
+/*
+ * Like jf_readdir() but with the attributes of each entry, saving the
+ * kernel a lookup for each one. Every entry (bar "." and "..") handed
+ * back counts as a lookup of it.
+ */
+static void jf_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+			   off_t offset, struct fuse_file_info *fi)
+{
+	const struct jf_dir *dir = (struct jf_dir *)(uintptr_t)fi->fh;
+	char *buf;
+	size_t len = 0;
+
+	buf = malloc(size);
+	for (size_t i = offset; i < dir->nr + 2; i++) {
+		struct fuse_entry_param e = {};
+		const char *name = jf_dir_name(dir, i);
+		size_t ret;
+
+		if (i < 2) {
+			e.attr.st_ino = JF_UNKNOWN_INO;
+			e.attr.st_mode = S_IFDIR;
+		} else {
+			e.attr = dir->ents[i - 2].st;
+			e.attr_timeout = dir->ents[i - 2].timeout;
+			e.ino = jf_inode_lookup(ino, name);
+			if (!e.ino)
+				break;
+			e.attr.st_ino = e.ino;
+			e.entry_timeout = JF_ENTRY_TIMEOUT;
+		}
+
+		ret = fuse_add_direntry_plus(req, buf + len, size - len, name,
+					     &e, i + 1);
+		if (ret > size - len) {
+			/* Didn't fit, so the kernel never saw it */
+			if (e.ino)
+				jf_inode_forget(e.ino, 1);
+			break;
+		}
+		len += ret;
+	}
 
-	return aid;
+	fuse_reply_buf(req, buf, len);
+	free(buf);
 }
 
-static void do_curl_autocomplete(const char *path,
-				 const struct dir_entry *dentry)
+static void jf_releasedir(fuse_req_t req, fuse_ino_t ino __unused,
+			  struct fuse_file_info *fi)
 {
-	char api[API_URL_MAX_LEN];
-	char prefix[4] = {};
-	char *ptr;
-	struct curl_buf curl_buf = {};
-	static const char *api_fmt =
-		"https://api.jamendo.com/v3.0/autocomplete/"
-		"?client_id=%s&format=json&prefix=%s&entity=%s&limit=200";
+	struct jf_dir *dir = (struct jf_dir *)(uintptr_t)fi->fh;
 
-	ptr = strchr(path, '/');
-	ptr++;
-	ptr = strchr(ptr, '/');
+	jf_arena_free(dir->arena);
+	free(dir->ents);
+	free(dir);
+	fuse_reply_err(req, 0);
+}
 
-	prefix[0] = *++ptr;
-	ptr += 2;
-	prefix[1] = *ptr;
-	ptr += 2;
-	prefix[2] = *ptr;
+static void jf_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	struct jf_file *jfilep = NULL;
+	struct dir_entry *dentry = NULL;
+	struct jf_stream *st;
+	unsigned int epoch;
+	char *path;
+	int err = ENOENT;
 
-	snprintf(api, sizeof(api), api_fmt, CLIENT_ID, prefix,
-		 jf_autocomplete_entities[dentry->entity]);
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		fuse_reply_err(req, EACCES);
+		return;
+	}
 
-	dbg("** api : %s\n", api);
-	curl_perform(api, &curl_buf);
+	path = jf_inode_path(ino);
+	if (!path) {
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
 
-	set_file_entity(&curl_buf, path, dentry);
+	dbg("path [%s]\n", path);
 
-	free(curl_buf.buf);
-}
+	epoch = fstree_read_begin();
+	dentry = get_dentry(path, FOP_READ, &epoch);
+	if (dentry)
+		jfilep = lookup_jfile_from_dentry(path, dentry);
+	if (!jfilep)
+		goto out_err;
 
-static void do_curl(const char *path, const struct dir_entry *dentry,
-		    struct jf_file *jfile)
-{
-	char api[API_URL_MAX_LEN];
-	struct curl_buf curl_buf = {};
-	const char *api_fmt = "https://api.jamendo.com/v3.0/albums";
-
-	if (dentry->type == JF_DT_ARTIST) {
-		if (!jfile->id)
-			jfile->id = lookup_artist_id(jfile->orig_name);
-
-		snprintf(api, sizeof(api),
-			 "%s/?client_id=%s&format=json&artist_id=%s&limit=200",
-			 api_fmt, CLIENT_ID, jfile->id);
-	} else if (dentry->type == JF_DT_FORMAT) {
-		snprintf(api, sizeof(api),
-			 "%s/tracks/?client_id=%s&format=json&id=%s&audioformat=%s",
-			 api_fmt, CLIENT_ID, jfile->id,
-			 audio_fmts[jfile->audio_fmt].name);
-	} else {
-		return;
+	jfilep = jf_file_resolve_size(path, dentry, jfilep, &epoch);
+	if (!jfilep) {
+		err = EIO;
+		goto out_err;
 	}
 
-	dbg("** api : %s\n", api);
-	curl_perform(api, &curl_buf);
-	if (dentry->type == JF_DT_ARTIST)
-		set_files_album(&curl_buf, path, dentry);
-	else if (dentry->type == JF_DT_FORMAT)
-		set_files_tracks(&curl_buf,
-				 audio_fmts[jfile->audio_fmt].ext,
-				 path);
+	/*
+	 * A track's data never changes for a given id and format, so let
+	 * the kernel keep whatever it has cached of it from one open to
+	 * the next. If what's at this path does change, it's invalidated
+	 * when the directory is re-fetched.
+	 */
+	fi->keep_cache = 1;
 
-	free(curl_buf.buf);
+	/* Without a stream we fall back to a range request per read */
+	st = jf_stream_new(jfilep);
+	if (st && fstree_pin(dentry))
+		st->dentry = dentry;
+	fstree_read_end(epoch);
+
+	fi->fh = (uintptr_t)st;
+	fuse_reply_open(req, fi);
+	free(path);
+
+	return;
+
+out_err:
+	fstree_read_end(epoch);
+	fuse_reply_err(req, err);
+	free(path);
 }
 
-static void fstree_populate_a_z(const char *path,
-				const struct dir_entry *prev_dir)
+static void jf_release(fuse_req_t req, fuse_ino_t ino __unused,
+		       struct fuse_file_info *fi)
 {
-	struct dir_entry *dentry;
+	struct jf_stream *st = (struct jf_stream *)(uintptr_t)fi->fh;
 
-	dentry = calloc(1, sizeof(struct dir_entry));
-	dentry->jfiles = ac_btree_new(compare_file_paths, free_jf_file);
+	if (st && st->dentry)
+		fstree_unpin(st->dentry);
+	if (st)
+		jf_stream_free(st);
 
-	for (int c = 'a', i = 0; c <= 'z'; c++, i++) {
-		struct jf_file *jf_file;
+	fuse_reply_err(req, 0);
+}
 
-		jf_file = calloc(1, sizeof(struct jf_file));
-		jf_file->name = calloc(2, sizeof(char));
-		*jf_file->name = c;
-		jf_file->mode = 0555 | S_IFDIR;
+/*
+ * See if the requested range is in the block cache, returning its length
+ * (clipped to the end of the file) if so or 0 if not.
+ */
+static size_t jf_stream_cached(const struct jf_stream *st, size_t size,
+			       off_t offset)
+{
+	if (!st || !st->cf || !(offset < st->size))
+		return 0;
 
-		if (prev_dir->type == JF_DT_TL_ARTISTS ||
-		    prev_dir->type == JF_DT_TL_A)
-			jf_file->nlink = DIR_NLINK_NR + 26;
+	if (offset + (off_t)size > st->size)
+		size = st->size - offset;
 
-		ac_btree_add(dentry->jfiles, jf_file);
+	if (!jf_cache_has(st->cf, offset, size)) {
+		jf_stats_inc(cache_misses);
+		return 0;
 	}
-	dentry->path = strdup(path);
-	dentry->entity = prev_dir->entity;
-
-	if (prev_dir->type == JF_DT_TL_ARTISTS)
-		dentry->type = JF_DT_TL_A;
-	else
-		dentry->type = prev_dir->type + 1;
+	jf_stats_inc(cache_hits);
 
-	ac_btree_add(fstree, dentry);
+	return size;
 }
 
-static struct dir_entry *get_dentry(const char *path, enum file_op op)
+/* Is this read just carrying on from where the stream is at? */
+static bool jf_stream_following(struct jf_stream *st, off_t offset)
 {
-	struct jf_file jfile;
-	struct jf_file *jfilep;
-	struct dir_entry *dentry;
-	struct dir_entry data;
-	char *pathc = NULL;
-	char *lpath = NULL;
+	bool ret;
 
-	switch (op) {
-	case FOP_GETATTR:
-	case FOP_READ:
-		pathc = strdup(path);
-		data.path = dirname(pathc);
-		dentry = ac_btree_lookup(fstree, &data);
-		if (dentry)
-			goto out_free;
-		lpath = strdup(data.path);
-		data.path = dirname(data.path);
-		break;
-	case FOP_READDIR:
-		data.path = (char *)path;
-		dentry = ac_btree_lookup(fstree, &data);
-		if (dentry)
-			goto out_free;
-		pathc = strdup(path);
-		lpath = strdup(path);
-		data.path = dirname(pathc);
-		break;
-	}
+	pthread_mutex_lock(&st->lock);
+	ret = st->active && offset == st->rpos;
+	pthread_mutex_unlock(&st->lock);
 
-	dentry = ac_btree_lookup(fstree, &data);
-	if (!dentry)
-		goto out_free;
+	return ret;
+}
 
-	jfile.name = strrchr(lpath, '/') + 1;
-	jfilep = ac_btree_lookup(dentry->jfiles, &jfile);
-	if (!jfilep) {
-		dentry = NULL;
-		goto out_free;
-	}
+/*
+ * Try the head/tail cache, on a miss fetching the whole region into it
+ * with a range request, unless it's a read the stream is about to get
+ * to anyway, i.e something playing through the file. Returns -1 if the
+ * read is to be done the usual way.
+ */
+static int jf_read_headtail(const char *url, uint64_t id, int audio_fmt,
+			    off_t fsize, char *buf, size_t size, off_t offset,
+			    struct jf_stream *st)
+{
+	const char *fmt = audio_fmts[audio_fmt].name;
+	char *rbuf;
+	off_t roff;
+	size_t rlen;
+	ssize_t ret;
+
+	if (!jf_headtail_enabled() ||
+	    !jf_headtail_region(fsize, offset, size, &roff, &rlen))
+		return -1;
 
-	switch (dentry->type) {
-	case JF_DT_TL_ARTISTS:
-	case JF_DT_TL_A ... JF_DT_TL_AA:
-		fstree_populate_a_z(lpath, dentry);
-		break;
-	case JF_DT_TL_AAA:
-		do_curl_autocomplete(lpath, dentry);
-		break;
-	case JF_DT_ALBUM:
-		set_files_format(jfilep->id, lpath);
-		break;
-	default:
-		do_curl(lpath, dentry, jfilep);
+	ret = jf_headtail_read(id, fmt, fsize, buf, size, offset);
+	if (ret >= 0) {
+		jf_stats_inc(headtail_hits);
+		return ret;
 	}
+	jf_stats_inc(headtail_misses);
+
+	if (st && jf_stream_following(st, offset))
+		return -1;
 
-	data.path = lpath;
-	dentry = ac_btree_lookup(fstree, &data);
+	rbuf = malloc(rlen);
+	if (!rbuf)
+		return -1;
+	if (curl_read_file(url, rbuf, rlen, roff) != (int)rlen) {
+		free(rbuf);
+		return -1;
+	}
 
-out_free:
-	free(pathc);
-	free(lpath);
+	if (offset + (off_t)size > fsize)
+		size = fsize - offset;
+	memcpy(buf, rbuf + (offset - roff), size);
+	/* Answer the read now, leave the disk to the writer thread */
+	jf_headtail_give(id, fmt, fsize, roff, rbuf, rlen);
 
-	return dentry;
+	return size;
 }
 
-static int jf_getattr(const char *path, struct stat *st,
-		      struct fuse_file_info *fi __unused)
+static int jf_read_file(const char *path, char *buffer, size_t size,
+			off_t offset, struct jf_stream *st)
 {
-	struct jf_file jfile;
-	struct jf_file *jfilep;
+	struct jf_file *jfilep = NULL;
 	struct dir_entry *dentry;
+	unsigned int epoch;
+	char *url = NULL;
+	off_t fsize = 0;
+	uint64_t id = 0;
+	int audio_fmt = 0;
+	int ret;
 
 	dbg("path [%s]\n", path);
 
-	st->st_uid = getuid();
-	st->st_gid = getgid();
-	st->st_atime = time(NULL);
-	st->st_mtime = time(NULL);
-
-	if (strcmp(path, "/") == 0) {
-		st->st_mode = 0555 | S_IFDIR;
-		st->st_nlink = nr_root_items;
-		return 0;
+	epoch = fstree_read_begin();
+	dentry = get_dentry(path, FOP_READ, &epoch);
+	if (dentry)
+		jfilep = lookup_jfile_from_dentry(path, dentry);
+	if (jfilep)
+		jfilep = jf_file_resolve_size(path, dentry, jfilep, &epoch);
+	if (jfilep) {
+		fsize = jfilep->size;
+		id = jfilep->id;
+		audio_fmt = jfilep->audio_fmt;
+		if (!st || jf_headtail_enabled())
+			url = strdup(jfilep->audio);
 	}
+	/* Don't hold up freeing fstree entries while we're on the network */
+	fstree_read_end(epoch);
 
-	dentry = get_dentry(path, FOP_GETATTR);
-	if (!dentry)
-		return -1;
-
-	jfile.name = strrchr(path, '/') + 1;
-	jfilep = ac_btree_lookup(dentry->jfiles, &jfile);
 	if (!jfilep)
 		return -1;
 
-	st->st_mode = jfilep->mode;
-
-	if (st->st_mode & S_IFREG) {
-		st->st_size = jfilep->size;
-		st->st_blocks = jfilep->blocks;
-		st->st_nlink = 1;
+	if (!(offset < fsize)) {
+		ret = 0;
+		goto out_free;
 	}
 
-	if (st->st_mode & S_IFDIR || dentry->type == JF_DT_TRACK) {
-		if (jfilep->date) {
-			struct tm tm = {};
-			time_t ds;
+	ret = jf_read_headtail(url, id, audio_fmt, fsize, buffer, size, offset,
+			       st);
+	if (ret >= 0)
+		goto out_free;
 
-			strptime(jfilep->date, "%F", &tm);
-			ds = mktime(&tm);
-			st->st_atime = st->st_mtime = ds;
-		}
+	if (st)
+		ret = jf_stream_read(st, buffer, size, offset);
+	else
+		ret = curl_read_file(url, buffer, size, offset);
 
-		if (st->st_mode & S_IFDIR)
-			st->st_nlink = jfilep->nlink;
-	}
+out_free:
+	free(url);
 
-	return 0;
+	return ret;
 }
 
-struct jf_file_filler_data {
-	fuse_fill_dir_t filler;
-	void *buffer;
-};
-
-static void jf_file_filler(const void *nodep, VISIT which, void *data)
+static void jf_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+		    struct fuse_file_info *fi)
 {
-	const struct jf_file *jfile = *(struct jf_file **)nodep;
-	const struct jf_file_filler_data *jf_data = data;
-	struct stat sb = {};
-
-	switch (which) {
-	case preorder:
-	case endorder:
-		return;
-	case postorder:
-	case leaf:
-		sb.st_mode = jfile->mode;
-		jf_data->filler(jf_data->buffer, jfile->name, &sb, 0, 0);
-	}
-}
+	struct jf_stream *st = (struct jf_stream *)(uintptr_t)fi->fh;
+	char *path;
+	char *buf;
+	size_t len;
+	int ret;
 
-static int jf_readdir(const char *path, void *buffer, fuse_fill_dir_t filler,
-		      off_t offset __unused,
-		      struct fuse_file_info *fi __unused,
-		      enum fuse_readdir_flags flags __unused)
-{
-	struct dir_entry *dentry;
-	struct jf_file_filler_data jf_data;
+	/*
+	 * If it's all in the cache, hand FUSE the cache file descriptor
+	 * and let it splice/read the data straight from there.
+	 */
+	len = jf_stream_cached(st, size, offset);
+	if (len > 0) {
+		struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(len);
 
-	dbg("path [%s]\n", path);
+		bufv.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		bufv.buf[0].fd = jf_cache_fd(st->cf);
+		bufv.buf[0].pos = offset;
+		fuse_reply_data(req, &bufv, FUSE_BUF_SPLICE_MOVE);
+		jf_prefetch_check(st, offset + len);
 
-	filler(buffer, ".", NULL, 0, 0);
-	filler(buffer, "..", NULL, 0, 0);
+		return;
+	}
 
-	dentry = get_dentry(path, FOP_READDIR);
-	if (!dentry)
-		return 0;
+	path = jf_inode_path(ino);
+	buf = malloc(size);
+	if (!path || !buf) {
+		fuse_reply_err(req, path ? ENOMEM : ENOENT);
+		goto out_free;
+	}
 
-	jf_data.filler = filler;
-	jf_data.buffer = buffer;
+	ret = jf_read_file(path, buf, size, offset, st);
+	if (ret < 0)
+		fuse_reply_err(req, EIO);
+	else
+		fuse_reply_buf(req, buf, ret);
 
-	ac_btree_foreach_data(dentry->jfiles, jf_file_filler, &jf_data);
+out_free:
+	free(path);
+	free(buf);
+}
 
-	return 0;
+/* Run on the engine thread each time around its loop */
+static void jf_poll(void)
+{
+	ra_process_queue();
+	prefetch_reap();
 }
 
-static int jf_read(const char *path, char *buffer, size_t size, off_t offset,
-		   struct fuse_file_info *fi __unused)
+/*
+ * We handle reads for an open file in order on a single stream, having
+ * the kernel send them one at a time in offset order avoids them
+ * arriving out of order on different threads and looking like seeks.
+ */
+static void jf_init(void *userdata __unused, struct fuse_conn_info *conn)
 {
-	struct jf_file jfile;
-	const struct jf_file *jfilep;
-	struct dir_entry *dentry;
+	conn->want &= ~FUSE_CAP_ASYNC_READ;
 
-	dbg("path [%s]\n", path);
+	/*
+	 * The most the kernel will ask for in one read is max_pages,
+	 * which libfuse works out from max_write (even for us), so ask
+	 * for big reads, fewer round trips for sequential reading.
+	 * Readahead can only be lowered from what the kernel offers, so
+	 * we take all of it.
+	 *
+	 * Have the kernel drop cached data if a file's size or mtime
+	 * changes and let reads from the block cache be spliced.
+	 */
+	conn->max_write = READ_MAX;
+	conn->want |= conn->capable & (FUSE_CAP_AUTO_INVAL_DATA |
+				       FUSE_CAP_SPLICE_WRITE |
+				       FUSE_CAP_SPLICE_MOVE);
 
-	dentry = get_dentry(path, FOP_READ);
-	if (!dentry)
-		return -1;
+	/*
+	 * Reads get whatever they need unless told otherwise, background
+	 * work is kept within a budget so it can't starve them.
+	 */
+	jf_engine_set_class(JF_PRIO_READ, 0, read_rate);
+	jf_engine_set_class(JF_PRIO_META, 0, 0);
+	jf_engine_set_class(JF_PRIO_BG, bg_concurrency, bg_rate);
+
+	/* We're past any daemonising now, so safe to start threads */
+	jf_engine_init(ENGINE_XFERS_MAX, host_concurrency, jf_poll);
+	reval_init();
+	warm_up_init();
+	spec_init();
+}
 
-	jfile.name = strrchr(path, '/') + 1;
-	jfilep = ac_btree_lookup(dentry->jfiles, &jfile);
-	if (!jfilep)
-		return -1;
+static void jf_destroy(void *userdata __unused)
+{
+	__atomic_store_n(&warm_up_exit, true, __ATOMIC_RELAXED);
+	spec_stop();
+	reval_destroy();
+	warm_up_destroy();
+	jf_engine_destroy();
+	spec_destroy();
+	prefetch_destroy();
+}
 
-	if (!(offset < jfilep->size))
-		return 0;
+static void jf_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+			size_t size)
+{
+	char buf[1024];
+	int len;
 
-	dbg("CURL using curl handle @ %p\n", read_file_curl);
+	if (ino != JF_ROOT_INO || strcmp(name, JF_STATS_XATTR) != 0) {
+		fuse_reply_err(req, ENODATA);
+		return;
+	}
 
-	return curl_read_file(jfilep->audio, buffer, size, offset);
+	len = jf_stats_fmt(buf, sizeof(buf));
+	if (size == 0)
+		fuse_reply_xattr(req, len);
+	else if (size < (size_t)len)
+		fuse_reply_err(req, ERANGE);
+	else
+		fuse_reply_buf(req, buf, len);
 }
 
 static void fstree_init_jamendo(void)
@@ -928,14 +5066,13 @@ static void fstree_init_jamendo(void)
 	struct jf_file *jf_file;
 	struct dir_entry *dentry;
 
-	jf_file = calloc(1, sizeof(struct jf_file));
-	jf_file->name = strdup("artists");
+	dentry = new_dentry();
+
+	jf_file = new_jf_file(dentry);
+	jf_file->name = jf_arena_strdup(dentry->arena, "artists");
 	jf_file->mode = 0555 | S_IFDIR;
 	jf_file->nlink = DIR_NLINK_NR + 26;
 
-	dentry = calloc(1, sizeof(struct dir_entry));
-	dentry->jfiles = ac_btree_new(compare_file_paths, free_jf_file);
-
 	ac_btree_add(dentry->jfiles, jf_file);
 
 	nr_root_items++;
@@ -943,7 +5080,7 @@ static void fstree_init_jamendo(void)
 	dentry->path = strdup("/");
 	dentry->type = JF_DT_TL_ARTISTS;
 	dentry->entity = JF_A_E_ARTIST;
-	ac_btree_add(fstree, dentry);
+	fstree_add(dentry);
 }
 
 static void fstree_init_artists_json(void)
@@ -964,17 +5101,17 @@ static void fstree_init_artists_json(void)
 	}
 
 	artists = json_object_get(root, "artists");
-	dentry = calloc(1, sizeof(struct dir_entry));
-	dentry->jfiles = ac_btree_new(compare_file_paths, free_jf_file);
+	dentry = new_dentry();
 
 	json_array_foreach(artists, i, artist) {
 		struct jf_file *jf_file;
 		json_t *name = json_array_get(artist, 0);
 		json_t *id = json_array_get(artist, 1);
 
-		jf_file = calloc(1, sizeof(struct jf_file));
-		jf_file->name = strdup(json_string_value(name));
-		jf_file->id = strdup(json_string_value(id));
+		jf_file = new_jf_file(dentry);
+		jf_file->name = jf_arena_strdup(dentry->arena,
+						json_string_value(name));
+		jf_file->id = parse_id(json_string_value(id));
 		jf_file->mode = 0555 | S_IFDIR;
 
 		ac_btree_add(dentry->jfiles, jf_file);
@@ -984,24 +5121,82 @@ static void fstree_init_artists_json(void)
 	json_decref(root);
 	dentry->path = strdup("/");
 	dentry->type = JF_DT_ARTIST;
-	ac_btree_add(fstree, dentry);
+	fstree_add(dentry);
+}
+
+/*
+ * TYPE:SECS[,TYPE:SECS...] where TYPE is artists, albums, tracks or tags,
+ * the directories listing them.
+ */
+static int parse_ttls(char *str)
+{
+	char *sptr;
+	char *ttl;
+	static const size_t nr = sizeof(dentry_ttl_names) /
+				 sizeof(dentry_ttl_names[0]);
+
+	for (ttl = strtok_r(str, ",", &sptr); ttl;
+	     ttl = strtok_r(NULL, ",", &sptr)) {
+		char *secs = strchr(ttl, ':');
+		size_t i;
+
+		if (!secs)
+			return -1;
+		*secs++ = '\0';
+
+		for (i = 0; i < nr; i++) {
+			if (strcmp(ttl, dentry_ttl_names[i]) == 0)
+				break;
+		}
+		if (i == nr)
+			return -1;
+
+		dentry_ttls[i] = strtol(secs, NULL, 10);
+	}
+
+	return 0;
 }
 
 static void print_usage(void)
 {
-	printf("Usage: jamendo-fuse [-f] [--full] mount-point\n");
+	printf("Usage: jamendo-fuse [-f] [--full] [--probe-concurrency=N] "
+	       "[--lazy-size] [--cache-size=MiB] [--cache-dir=DIR] "
+	       "[--snapshot] [--snapshot-ttl=SECS] [--meta-size=MiB] "
+	       "[--ttl=TYPE:SECS[,...]] [--host-concurrency=N] "
+	       "[--bg-concurrency=N] [--bg-rate=KiB] [--read-rate=KiB] "
+	       "[--prefetch=KiB] [--headtail-size=MiB] [--headtail-fill] "
+	       "[--warm-up] [--prefix-prefetch=N] mount-point\n");
 }
 
 int main(int argc, char *argv[])
 {
-	int fuse_argc = 0;
-	char *fuse_argv[FUSE_MAX_ARGS];
+	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	const char *mountpoint;
+	bool foreground = false;
 	bool use_config = true;
+	int ret = EXIT_FAILURE;
 	const char *dbg;
-	static const struct fuse_operations jf_operations = {
+	const char *cache_dir = NULL;
+	char cache_dir_def[PATH_MAX];
+	char cache_blocks_dir[PATH_MAX];
+	char headtail_dir[PATH_MAX];
+	uint64_t cache_size = 0;
+	uint64_t headtail_size = 0;
+	static const struct fuse_lowlevel_ops jf_operations = {
+		.lookup		= jf_lookup,
+		.forget		= jf_forget,
+		.forget_multi	= jf_forget_multi,
 		.getattr	= jf_getattr,
+		.opendir	= jf_opendir,
 		.readdir	= jf_readdir,
+		.readdirplus	= jf_readdirplus,
+		.releasedir	= jf_releasedir,
+		.open		= jf_open,
 		.read		= jf_read,
+		.release	= jf_release,
+		.getxattr	= jf_getxattr,
+		.init		= jf_init,
+		.destroy	= jf_destroy,
 	};
 
 	client_id = getenv("JAMENDO_FUSE_CLIENT_ID");
@@ -1014,8 +5209,6 @@ int main(int argc, char *argv[])
 	if (dbg && (*dbg == 'y' || *dbg == 't' || *dbg == '1'))
 		debug = true;
 
-	fuse_argv[fuse_argc++] = argv[0];
-
 	while (1) {
 		int c;
 		int opt_idx = 0;
@@ -1026,11 +5219,74 @@ int main(int argc, char *argv[])
 
 		switch (c) {
 		case 'f':
-			fuse_argv[fuse_argc++] = "-f";
+			foreground = true;
 			break;
 		case OPT_FULL:
 			use_config = false;
 			break;
+		case OPT_PROBE_CONCURRENCY:
+			probe_concurrency = strtol(optarg, NULL, 10);
+			if (probe_concurrency < 1)
+				probe_concurrency = 1;
+			break;
+		case OPT_LAZY_SIZE:
+			lazy_size = true;
+			break;
+		case OPT_CACHE_SIZE:
+			cache_size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+			break;
+		case OPT_CACHE_DIR:
+			cache_dir = optarg;
+			break;
+		case OPT_SNAPSHOT:
+			snapshot = true;
+			break;
+		case OPT_SNAPSHOT_TTL:
+			dentry_ttls[JF_DT_ARTIST] = dentry_ttls[JF_DT_ALBUM] =
+			dentry_ttls[JF_DT_TRACK] = dentry_ttls[JF_DT_TAG] =
+				strtol(optarg, NULL, 10);
+			break;
+		case OPT_META_SIZE:
+			meta_size = strtoull(optarg, NULL, 10) * 1024 * 1024;
+			break;
+		case OPT_HOST_CONCURRENCY:
+			host_concurrency = strtol(optarg, NULL, 10);
+			if (host_concurrency < 1)
+				host_concurrency = 1;
+			break;
+		case OPT_BG_CONCURRENCY:
+			bg_concurrency = strtol(optarg, NULL, 10);
+			if (bg_concurrency < 1)
+				bg_concurrency = 1;
+			break;
+		case OPT_BG_RATE:
+			bg_rate = strtol(optarg, NULL, 10) * 1024;
+			break;
+		case OPT_READ_RATE:
+			read_rate = strtol(optarg, NULL, 10) * 1024;
+			break;
+		case OPT_PREFETCH:
+			prefetch_size = strtoll(optarg, NULL, 10) * 1024;
+			break;
+		case OPT_HEADTAIL_SIZE:
+			headtail_size = strtoull(optarg, NULL, 10) * 1024 *
+					1024;
+			break;
+		case OPT_HEADTAIL_FILL:
+			headtail_fill = true;
+			break;
+		case OPT_WARM_UP:
+			warm_up = true;
+			break;
+		case OPT_PREFIX_PREFETCH:
+			spec_budget = strtol(optarg, NULL, 10);
+			break;
+		case OPT_TTL:
+			if (parse_ttls(optarg) == -1) {
+				print_usage();
+				exit(EXIT_FAILURE);
+			}
+			break;
 		default:
 			print_usage();
 			exit(EXIT_FAILURE);
@@ -1042,24 +5298,124 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	fuse_argv[fuse_argc++] = argv[optind];
+	mountpoint = argv[optind];
 
 	printf("jamendo-fuse %s loading.\n", GIT_VERSION);
 
-	fstree = ac_btree_new(compare_dentry_paths, free_dentry);
+	if (!cache_dir) {
+		const char *xdg = getenv("XDG_CACHE_HOME");
+
+		if (xdg && *xdg)
+			snprintf(cache_dir_def, sizeof(cache_dir_def),
+				 "%s/jamendo-fuse", xdg);
+		else
+			snprintf(cache_dir_def, sizeof(cache_dir_def),
+				 "%s/.cache/jamendo-fuse", getenv("HOME"));
+		cache_dir = cache_dir_def;
+	}
+
+	fstree_init();
 
-	if (!use_config)
+	if (!use_config) {
 		fstree_init_jamendo();
-	else
+	} else {
 		fstree_init_artists_json();
+		/* There are no artists/x/y directories to speculate about */
+		spec_budget = 0;
+	}
+
+	if (snapshot) {
+		int len;
+
+		len = snprintf(snapshot_file, sizeof(snapshot_file),
+			       "%s/fstree.snap", cache_dir);
+		if (len >= (int)sizeof(snapshot_file)) {
+			fprintf(stderr, "Cache dir path too long\n");
+			exit(EXIT_FAILURE);
+		}
+		if (mkdir_p(cache_dir) == -1) {
+			fprintf(stderr, "Couldn't create %s: %s\n", cache_dir,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		snapshot_flags = use_config ? 0 : SNAPSHOT_F_FULL;
+		fstree_load_snapshot();
+		/* Nothing new to save yet */
+		snapshot_dirty = false;
+	}
 
 	curl_global_init(CURL_GLOBAL_DEFAULT);
+	curl_pool_init();
+
+	if (cache_size > 0) {
+		int len;
+
+		len = snprintf(cache_blocks_dir, sizeof(cache_blocks_dir),
+			       "%s/blocks", cache_dir);
+		if (len >= (int)sizeof(cache_blocks_dir)) {
+			fprintf(stderr, "Cache dir path too long\n");
+			exit(EXIT_FAILURE);
+		}
+		if (jf_cache_init(cache_blocks_dir, cache_size) == -1) {
+			fprintf(stderr, "Couldn't setup cache in %s: %s\n",
+				cache_blocks_dir, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (headtail_size > 0) {
+		int len;
 
-	fuse_main(fuse_argc, fuse_argv, &jf_operations, NULL);
+		len = snprintf(headtail_dir, sizeof(headtail_dir),
+			       "%s/headtail", cache_dir);
+		if (len >= (int)sizeof(headtail_dir)) {
+			fprintf(stderr, "Cache dir path too long\n");
+			exit(EXIT_FAILURE);
+		}
+		if (jf_headtail_init(headtail_dir, headtail_size) == -1) {
+			fprintf(stderr, "Couldn't setup cache in %s: %s\n",
+				headtail_dir, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
 
-	ac_btree_destroy(fstree);
-	ac_slist_destroy(&curls, curl_easy_cleanup);
+	jf_inode_init();
+
+	fuse_opt_add_arg(&args, argv[0]);
+	jf_se = fuse_session_new(&args, &jf_operations, sizeof(jf_operations),
+				 NULL);
+	if (!jf_se)
+		goto out_free_args;
+	if (fuse_set_signal_handlers(jf_se) == -1)
+		goto out_destroy_session;
+	if (fuse_session_mount(jf_se, mountpoint) == -1)
+		goto out_remove_handlers;
+
+	fuse_daemonize(foreground);
+	/* No clone_fd */
+	if (fuse_session_loop_mt(jf_se, 0) == 0)
+		ret = EXIT_SUCCESS;
+
+	fuse_session_unmount(jf_se);
+out_remove_handlers:
+	fuse_remove_signal_handlers(jf_se);
+out_destroy_session:
+	fuse_session_destroy(jf_se);
+	jf_se = NULL;
+out_free_args:
+	fuse_opt_free_args(&args);
+
+	fstree_snapshot_save();
+	jf_cache_destroy();
+	jf_headtail_destroy();
+
+	fstree_destroy();
+	album_tables_destroy();
+	ac_slist_destroy(&retired_dentries, free_dentry);
+	ac_slist_destroy(&reclaim_dentries, free_dentry);
+	curl_pool_destroy();
 	curl_global_cleanup();
+	jf_inode_destroy();
 
-	exit(EXIT_SUCCESS);
+	exit(ret);
 }
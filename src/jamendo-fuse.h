@@ -0,0 +1,185 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * jamendo-fuse.h - Bits shared between the jamendo-fuse source files
+ *
+ * Copyright (c) 2021 - 2024	Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _JAMENDO_FUSE_H_
+#define _JAMENDO_FUSE_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <curl/curl.h>
+#include <jansson.h>
+#include <libac.h>
+
+#include "arena.h"
+#include "engine.h"
+
+#ifndef gettid
+#include <sys/syscall.h>
+#define gettid()        syscall(SYS_gettid)
+#endif
+
+#define __unused		__attribute__((unused))
+
+#define API_URL_MAX_LEN		4096
+
+enum jf_dentry_type {
+	/*
+	 * The first four items here *Should* match the items in
+	 * jf_autocomplete_entity
+	 */
+	JF_DT_ARTIST = 0,
+	JF_DT_ALBUM,
+	JF_DT_TRACK,
+	JF_DT_TAG,
+
+	JF_DT_FORMAT,
+
+	JF_DT_TL_ARTISTS,
+
+	JF_DT_TL_A,
+	JF_DT_TL_AA,
+	JF_DT_TL_AAA,
+};
+
+enum jf_autocomplete_entity {
+	JF_A_E_ARTIST = 0,
+	JF_A_E_ALBUM,
+	JF_A_E_TRACK,
+	JF_A_E_TAG,
+};
+
+enum {
+	FMT_MP31 = 0,
+	FMT_MP32,
+	FMT_OGG,
+	FMT_FLAC,
+};
+
+/*
+ * The jf_file itself and its names are allocated from its dir_entry's
+ * arena, audio is malloc(3)'d as it can be replaced when the size is
+ * resolved and content_type is interned.
+ */
+struct jf_file {
+	const char *orig_name;
+	char *name;
+	char *audio;
+	const char *content_type;
+
+	uint64_t id;
+	off_t size;
+	blkcnt_t blocks;
+	time_t mtime;
+	nlink_t nlink;
+	mode_t mode;
+	int audio_fmt;
+};
+
+struct dir_entry {
+	char *path;
+	enum jf_dentry_type type;
+	enum jf_autocomplete_entity entity;
+	ac_btree_t *jfiles;
+	struct jf_arena *arena;
+
+	/* fstree index, see jamendo-fuse.c */
+	uint64_t ino;
+	struct dir_entry *parent;
+	const char *name;
+	uint32_t name_len;
+	uint32_t hash;
+	struct dir_entry *hnext;
+
+	/* When it was fetched from the API, 0 for locally made entries */
+	time_t fetched;
+	bool reval_queued;
+
+	/* Memory accounting and eviction, see jamendo-fuse.c */
+	size_t bytes;
+	unsigned int nr_children;
+	unsigned int pins;
+	bool evicted;
+	time_t used;
+};
+
+struct jf_stats {
+	unsigned long api_reqs;
+	unsigned long probe_reqs;
+	unsigned long read_reqs;
+	unsigned long reused_conns;
+	unsigned long ra_hits;
+	unsigned long ra_misses;
+	unsigned long cache_hits;
+	unsigned long cache_misses;
+	unsigned long cache_evictions;
+	unsigned long shared_fetches;
+	unsigned long meta_evictions;
+	unsigned long refreshes;
+	unsigned long refreshes_unchanged;
+	unsigned long prefetches;
+	unsigned long prefetch_useful;
+	unsigned long prefetch_wasted;
+	unsigned long headtail_hits;
+	unsigned long headtail_misses;
+	unsigned long batched_lookups;
+	unsigned long spec_fetches;
+};
+
+extern struct jf_stats jf_stats;
+
+#define jf_stats_inc(counter) \
+	__atomic_add_fetch(&jf_stats.counter, 1, __ATOMIC_RELAXED)
+#define jf_stats_add(counter, n) \
+	__atomic_add_fetch(&jf_stats.counter, n, __ATOMIC_RELAXED)
+#define jf_stats_get(counter) \
+	__atomic_load_n(&jf_stats.counter, __ATOMIC_RELAXED)
+
+extern bool debug;
+
+extern const char *client_id;
+extern __thread enum jf_engine_prio api_prio;
+
+extern pthread_mutex_t jf_file_info_lock;
+
+#define dbg(fmt, ...) \
+	do { \
+		if (!debug) \
+			break; \
+		fprintf(stdout, "[%5ld] %s: " fmt, gettid(), __func__, \
+			##__VA_ARGS__); \
+		fflush(stdout); \
+	} while (0)
+
+int compare_file_paths(const void *a, const void *b);
+struct jf_file *new_jf_file(struct dir_entry *dentry);
+void free_jf_file(void *data);
+struct dir_entry *new_dentry(void);
+void free_dentry(void *data);
+int mkdir_p(const char *dir);
+
+uint64_t parse_id(const char *id);
+const char *audio_fmt_name(int audio_fmt);
+
+CURL *curl_pool_get(void);
+void curl_pool_put(CURL *curl);
+
+/*
+ * Adds a page of an API listing, returning the number of entries it had
+ * and adding to nr_new those that weren't already there.
+ */
+typedef size_t (*api_page_fn)(json_t *root, void *data, size_t *nr_new);
+
+int api_fetch_all(const char *api, api_page_fn page_fn, void *data);
+
+#endif /* _JAMENDO_FUSE_H_ */
@@ -0,0 +1,450 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * snapshot.c - On-disk snapshot of the fstree
+ *
+ * Copyright (c) 2021 - 2024	Andrew Clayton <andrew@digital-domain.net>
+ */
+
+/*
+ * The snapshot is a header followed by a record per dir_entry, each
+ * followed by a record per jf_file in it. Integers are fixed size in
+ * native byte order (it's only ever read back on the same machine) and
+ * strings are a 32bit length followed by the bytes, with
+ * SNAPSHOT_STR_NULL standing in for a NULL pointer.
+ *
+ * It's written to a temporary file which is then rename(2)'d into place
+ * and it's mmap(2)'d when loading, where everything is bounds checked,
+ * anything that doesn't look right and we stop there.
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <libac.h>
+
+#include "jamendo-fuse.h"
+#include "snapshot.h"
+#include "intern.h"
+
+#define SNAPSHOT_MAGIC		"JFSNAP"
+#define SNAPSHOT_VERSION	2
+
+#define SNAPSHOT_STR_NULL	UINT32_MAX
+
+struct snap_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	int64_t created;
+	uint64_t nr_dentries;
+	uint64_t len;
+};
+
+struct jf_snapshot {
+	FILE *fp;
+	char *file;
+	char tmp[PATH_MAX];
+	uint64_t nr_dentries;
+};
+
+struct snap_rd {
+	const char *p;
+	const char *end;
+	bool err;
+};
+
+static void snap_put_u32(struct jf_snapshot *snap, uint32_t val)
+{
+	fwrite(&val, sizeof(val), 1, snap->fp);
+}
+
+static void snap_put_i64(struct jf_snapshot *snap, int64_t val)
+{
+	fwrite(&val, sizeof(val), 1, snap->fp);
+}
+
+static void snap_put_u64(struct jf_snapshot *snap, uint64_t val)
+{
+	fwrite(&val, sizeof(val), 1, snap->fp);
+}
+
+static void snap_put_str(struct jf_snapshot *snap, const char *str)
+{
+	uint32_t len = str ? strlen(str) : SNAPSHOT_STR_NULL;
+
+	snap_put_u32(snap, len);
+	if (str)
+		fwrite(str, 1, len, snap->fp);
+}
+
+static void snap_count_file(const void *nodep __unused, VISIT which,
+			    void *data)
+{
+	uint32_t *nr_files = data;
+
+	switch (which) {
+	case preorder:
+	case endorder:
+		return;
+	case postorder:
+	case leaf:
+		(*nr_files)++;
+	}
+}
+
+static void snap_put_file(const void *nodep, VISIT which, void *data)
+{
+	const struct jf_file *jf = *(struct jf_file **)nodep;
+	struct jf_snapshot *snap = data;
+
+	switch (which) {
+	case preorder:
+	case endorder:
+		return;
+	case postorder:
+	case leaf:
+		break;
+	}
+
+	snap_put_str(snap, jf->orig_name);
+	snap_put_str(snap, jf->name);
+	/* The size could be resolved, and the URL redirected, under us */
+	pthread_mutex_lock(&jf_file_info_lock);
+	snap_put_str(snap, jf->audio);
+	snap_put_str(snap, jf->content_type);
+	snap_put_u64(snap, __atomic_load_n(&jf->id, __ATOMIC_ACQUIRE));
+	snap_put_i64(snap, jf->size);
+	snap_put_i64(snap, jf->blocks);
+	pthread_mutex_unlock(&jf_file_info_lock);
+	snap_put_i64(snap, jf->mtime);
+	snap_put_u32(snap, __atomic_load_n(&jf->nlink, __ATOMIC_RELAXED));
+	snap_put_u32(snap, jf->mode);
+	snap_put_u32(snap, jf->audio_fmt);
+}
+
+/*
+ * Start writing a new snapshot, it only replaces the existing one (if
+ * any) once jf_snapshot_commit() succeeds.
+ */
+struct jf_snapshot *jf_snapshot_new(const char *file)
+{
+	struct jf_snapshot *snap;
+	struct snap_hdr hdr = {};
+
+	snap = calloc(1, sizeof(struct jf_snapshot));
+	snprintf(snap->tmp, sizeof(snap->tmp), "%s.tmp", file);
+	snap->fp = fopen(snap->tmp, "we");
+	if (!snap->fp) {
+		free(snap);
+		return NULL;
+	}
+	snap->file = strdup(file);
+
+	/* Filled in properly once we know what went in */
+	fwrite(&hdr, sizeof(hdr), 1, snap->fp);
+
+	return snap;
+}
+
+/*
+ * The caller needs to make sure the dentry isn't changed under us while
+ * it's being written out.
+ */
+void jf_snapshot_add(struct jf_snapshot *snap,
+		     const struct dir_entry *dentry)
+{
+	const ac_btree_t *jfiles;
+	uint32_t nr_files = 0;
+
+	/* The root is always built afresh from the config or --full */
+	if (strcmp(dentry->path, "/") == 0)
+		return;
+
+	jfiles = __atomic_load_n(&dentry->jfiles, __ATOMIC_ACQUIRE);
+	ac_btree_foreach_data(jfiles, snap_count_file, &nr_files);
+
+	snap_put_u32(snap, dentry->type);
+	snap_put_u32(snap, dentry->entity);
+	snap_put_i64(snap, __atomic_load_n(&dentry->fetched,
+					   __ATOMIC_RELAXED));
+	snap_put_str(snap, dentry->path);
+	snap_put_u32(snap, nr_files);
+	ac_btree_foreach_data(jfiles, snap_put_file, snap);
+
+	snap->nr_dentries++;
+}
+
+/* Finish off the snapshot and move it into place, frees snap */
+int jf_snapshot_commit(struct jf_snapshot *snap, uint32_t flags)
+{
+	struct snap_hdr hdr = {};
+	bool failed;
+	int ret = -1;
+
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	hdr.version = SNAPSHOT_VERSION;
+	hdr.flags = flags;
+	hdr.created = time(NULL);
+	hdr.nr_dentries = snap->nr_dentries;
+	hdr.len = ftello(snap->fp);
+	rewind(snap->fp);
+	fwrite(&hdr, sizeof(hdr), 1, snap->fp);
+
+	failed = fflush(snap->fp) == EOF || ferror(snap->fp) ||
+		 fsync(fileno(snap->fp)) == -1;
+	if (fclose(snap->fp) == EOF || failed)
+		goto out_unlink;
+	if (rename(snap->tmp, snap->file) == -1)
+		goto out_unlink;
+
+	dbg("saved %lu dentries (%lu bytes) to %s\n", hdr.nr_dentries,
+	    hdr.len, snap->file);
+	ret = 0;
+	goto out_free;
+
+out_unlink:
+	dbg("failed to write snapshot %s\n", snap->tmp);
+	unlink(snap->tmp);
+out_free:
+	free(snap->file);
+	free(snap);
+
+	return ret;
+}
+
+static void snap_get(struct snap_rd *rd, void *data, size_t len)
+{
+	if (rd->err || (size_t)(rd->end - rd->p) < len) {
+		rd->err = true;
+		memset(data, 0, len);
+		return;
+	}
+
+	memcpy(data, rd->p, len);
+	rd->p += len;
+}
+
+static uint32_t snap_get_u32(struct snap_rd *rd)
+{
+	uint32_t val;
+
+	snap_get(rd, &val, sizeof(val));
+
+	return val;
+}
+
+static int64_t snap_get_i64(struct snap_rd *rd)
+{
+	int64_t val;
+
+	snap_get(rd, &val, sizeof(val));
+
+	return val;
+}
+
+static uint64_t snap_get_u64(struct snap_rd *rd)
+{
+	uint64_t val;
+
+	snap_get(rd, &val, sizeof(val));
+
+	return val;
+}
+
+/*
+ * Returns a pointer to and the length of the next string in the
+ * snapshot, NULL for a NULL string.
+ */
+static const char *snap_get_strp(struct snap_rd *rd, uint32_t *len)
+{
+	const char *str;
+
+	*len = snap_get_u32(rd);
+	if (rd->err || *len == SNAPSHOT_STR_NULL)
+		return NULL;
+	if ((size_t)(rd->end - rd->p) < *len) {
+		rd->err = true;
+		return NULL;
+	}
+
+	str = rd->p;
+	rd->p += *len;
+
+	return str;
+}
+
+static char *snap_get_str(struct snap_rd *rd)
+{
+	const char *str;
+	uint32_t len;
+
+	str = snap_get_strp(rd, &len);
+	if (!str)
+		return NULL;
+
+	return strndup(str, len);
+}
+
+static char *snap_get_astr(struct snap_rd *rd, struct jf_arena *arena)
+{
+	const char *str;
+	uint32_t len;
+
+	str = snap_get_strp(rd, &len);
+	if (!str)
+		return NULL;
+
+	return jf_arena_strndup(arena, str, len);
+}
+
+static const char *snap_get_istr(struct snap_rd *rd)
+{
+	const char *str;
+	uint32_t len;
+
+	str = snap_get_strp(rd, &len);
+	if (!str)
+		return NULL;
+
+	return jf_intern(str, len, jf_hash(str, len));
+}
+
+static struct jf_file *snap_get_file(struct snap_rd *rd,
+				     struct dir_entry *dentry)
+{
+	struct jf_file *jf;
+
+	jf = new_jf_file(dentry);
+	jf->orig_name = snap_get_astr(rd, dentry->arena);
+	jf->name = snap_get_astr(rd, dentry->arena);
+	jf->audio = snap_get_str(rd);
+	jf->content_type = snap_get_istr(rd);
+	jf->id = snap_get_u64(rd);
+	jf->size = snap_get_i64(rd);
+	jf->blocks = snap_get_i64(rd);
+	jf->mtime = snap_get_i64(rd);
+	jf->nlink = snap_get_u32(rd);
+	jf->mode = snap_get_u32(rd);
+	jf->audio_fmt = snap_get_u32(rd);
+
+	if (rd->err || !jf->name ||
+	    jf->audio_fmt < FMT_MP31 || jf->audio_fmt > FMT_FLAC) {
+		rd->err = true;
+		free_jf_file(jf);
+		return NULL;
+	}
+
+	return jf;
+}
+
+static struct dir_entry *snap_get_dentry(struct snap_rd *rd)
+{
+	struct dir_entry *dentry;
+	uint32_t type;
+	uint32_t entity;
+	uint32_t nr_files;
+
+	dentry = new_dentry();
+
+	type = snap_get_u32(rd);
+	entity = snap_get_u32(rd);
+	dentry->fetched = snap_get_i64(rd);
+	dentry->path = snap_get_str(rd);
+	nr_files = snap_get_u32(rd);
+	if (rd->err || !dentry->path || *dentry->path != '/' ||
+	    type > JF_DT_TL_AAA || entity > JF_A_E_TAG)
+		goto out_free;
+
+	dentry->type = type;
+	dentry->entity = entity;
+
+	for (uint32_t i = 0; i < nr_files; i++) {
+		struct jf_file *jf = snap_get_file(rd, dentry);
+
+		if (!jf)
+			goto out_free;
+		ac_btree_add(dentry->jfiles, jf);
+	}
+
+	return dentry;
+
+out_free:
+	rd->err = true;
+	free_dentry(dentry);
+
+	return NULL;
+}
+
+/*
+ * Hands each dir_entry in the snapshot to add(), which takes ownership
+ * of it. If the snapshot turns out to be damaged part way through we
+ * stop there, but what's been added up to then is fine to use.
+ */
+int jf_snapshot_load(const char *file, uint32_t flags,
+		     void (*add)(struct dir_entry *dentry, void *data),
+		     void *data)
+{
+	int fd;
+	int ret = -1;
+	void *map;
+	struct stat sb;
+	struct snap_hdr hdr;
+	struct snap_rd rd = {};
+	uint64_t i;
+
+	fd = open(file, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	if (fstat(fd, &sb) == -1 || sb.st_size < (off_t)sizeof(hdr))
+		goto out_close;
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		goto out_close;
+
+	rd.p = map;
+	rd.end = rd.p + sb.st_size;
+
+	snap_get(&rd, &hdr, sizeof(hdr));
+	if (memcmp(hdr.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+	    hdr.version != SNAPSHOT_VERSION || hdr.flags != flags ||
+	    hdr.len != (uint64_t)sb.st_size) {
+		dbg("ignoring snapshot %s, wrong version/type\n", file);
+		goto out_unmap;
+	}
+
+	for (i = 0; i < hdr.nr_dentries; i++) {
+		struct dir_entry *dentry = snap_get_dentry(&rd);
+
+		if (!dentry)
+			break;
+		add(dentry, data);
+	}
+	if (i == hdr.nr_dentries)
+		ret = 0;
+
+	dbg("loaded %lu/%lu dentries from %s (%ld seconds old)\n", i,
+	    hdr.nr_dentries, file, (long)(time(NULL) - hdr.created));
+
+out_unmap:
+	munmap(map, sb.st_size);
+out_close:
+	close(fd);
+
+	return ret;
+}
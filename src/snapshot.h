@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/*
+ * snapshot.h - On-disk snapshot of the fstree
+ *
+ * Copyright (c) 2021 - 2024	Andrew Clayton <andrew@digital-domain.net>
+ */
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stdint.h>
+
+#include "jamendo-fuse.h"
+
+/* Which tree a snapshot is of, they aren't interchangeable */
+#define SNAPSHOT_F_FULL		0x1
+
+struct jf_snapshot;
+
+struct jf_snapshot *jf_snapshot_new(const char *file);
+void jf_snapshot_add(struct jf_snapshot *snap,
+		     const struct dir_entry *dentry);
+int jf_snapshot_commit(struct jf_snapshot *snap, uint32_t flags);
+int jf_snapshot_load(const char *file, uint32_t flags,
+		     void (*add)(struct dir_entry *dentry, void *data),
+		     void *data);
+
+#endif /* _SNAPSHOT_H_ */
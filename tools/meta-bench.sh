@@ -0,0 +1,81 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+#
+# meta-bench.sh - Measure jamendo-fuse's memory use and getattr latency
+#
+# Copyright (c) 2021 - 2024	Andrew Clayton <andrew@digital-domain.net>
+#
+# Fully browses DIR (ls -lR), then reports jamendo-fuse's resident set
+# size and how many files that covered, followed by the average time
+# taken to stat(2) each of them over ROUNDS passes.
+#
+# To compare two builds, e.g before and after a change, mount each in
+# turn with the same options and run this against the same DIR, e.g
+#
+#   $ JAMENDO_FUSE_CLIENT_ID=<id> src/jamendo-fuse /tmp/jf
+#   $ tools/meta-bench.sh /tmp/jf/artists/p
+#
+# Use --lazy-size (or be prepared to wait) on large trees. For a 100k
+# track catalogue, pick a DIR covering enough artists, the number of
+# tracks seen is printed.
+#
+# When run as root the kernel's dentry and inode caches are dropped
+# before each pass, so each stat(2) is a lookup and getattr answered by
+# jamendo-fuse rather than the kernel.
+
+set -e
+
+if [ $# -lt 1 ]; then
+	echo "Usage: $0 DIR [ROUNDS]" >&2
+	exit 1
+fi
+
+dir=$1
+rounds=${2:-5}
+
+pid=$(pgrep -n -x jamendo-fuse)
+if [ -z "$pid" ]; then
+	echo "jamendo-fuse doesn't seem to be running" >&2
+	exit 1
+fi
+
+drop_caches()
+{
+	if [ "$(id -u)" -eq 0 ]; then
+		sync
+		echo 2 > /proc/sys/vm/drop_caches
+	fi
+}
+
+rss()
+{
+	awk '/^VmRSS|^VmHWM/ { printf "%s %s kB  ", $1, $2 } END { print "" }' \
+		/proc/$pid/status
+}
+
+echo -n "Before: "
+rss
+
+ls -lR "$dir" > /dev/null
+nr_files=$(find "$dir" -type f | wc -l)
+nr_dirs=$(find "$dir" -type d | wc -l)
+
+echo -n "After ls -lR of $nr_files files in $nr_dirs directories: "
+rss
+
+list=$(mktemp)
+trap 'rm -f "$list"' EXIT
+find "$dir" > "$list"
+nr=$(wc -l < "$list")
+
+total=0
+for ((r = 0; r < rounds; r++)); do
+	drop_caches
+	start=$(date +%s%N)
+	xargs -d '\n' stat --format=%s < "$list" > /dev/null
+	end=$(date +%s%N)
+	total=$((total + end - start))
+done
+
+awk -v t=$total -v n=$nr -v r=$rounds \
+	'BEGIN { printf "stat: %.1f us average over %d paths x %d\n", t / 1000 / (n * r), n, r }'
@@ -0,0 +1,70 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+#
+# stat-stress.sh - Hammer a jamendo-fuse mount with parallel stat/readdir
+#
+# Copyright (c) 2021 - 2024	Andrew Clayton <andrew@digital-domain.net>
+#
+# Walks the tree under DIR with 1, 2, 4 ... MAX concurrent stat(2)ers
+# and readdir(3)ers (find -exec stat and ls -lR), printing how long each
+# round took and the stat(2)s per second, to see how lookups scale with
+# the number of threads at them.
+#
+# To look for data races, run jamendo-fuse built with TSAN=1, e.g
+#
+#   $ make TSAN=1
+#   $ TSAN_OPTIONS="log_path=/tmp/tsan.log" JAMENDO_FUSE_CLIENT_ID=<id> \
+#     src/jamendo-fuse -f --lazy-size /tmp/jf &
+#   $ tools/stat-stress.sh /tmp/jf/artists/p/e 16
+#
+# then check /tmp/tsan.log.* afterwards.
+#
+# When run as root the kernel's dentry and inode caches are dropped
+# before each round, so every lookup and getattr goes to jamendo-fuse
+# rather than being answered by the kernel.
+
+set -e
+
+if [ $# -lt 1 ]; then
+	echo "Usage: $0 DIR [MAX]" >&2
+	exit 1
+fi
+
+dir=$1
+max=${2:-$(nproc)}
+
+drop_caches()
+{
+	if [ "$(id -u)" -eq 0 ]; then
+		sync
+		echo 2 > /proc/sys/vm/drop_caches
+	fi
+}
+
+# Populate everything under dir first, so we're not timing the API
+echo "Populating $dir ..."
+nr=$(find "$dir" | wc -l)
+echo "$nr entries"
+
+printf "%8s %10s %12s\n" "workers" "secs" "stats/sec"
+
+n=1
+while [ $n -le $max ]; do
+	drop_caches
+
+	start=$(date +%s.%N)
+	for ((i = 0; i < n; i++)); do
+		if [ $((i % 2)) -eq 0 ]; then
+			find "$dir" -exec stat --format=%s {} + > /dev/null &
+		else
+			ls -lR "$dir" > /dev/null &
+		fi
+	done
+	wait
+	end=$(date +%s.%N)
+
+	awk -v n=$n -v nr=$nr -v s=$start -v e=$end \
+		'BEGIN { t = e - s; printf "%8d %10.3f %12.0f\n", n, t, n * nr / t }'
+
+	n=$((n * 2))
+done